@@ -51,10 +51,10 @@ for b in $BOARDS; do
 	# The argument '--publish' is used to trigger publication/upload of firmware
 	if [ "x$publish" = "x--publish" ]; then
 		rsync --archive --verbose --compress --rsh "$SSH_COMMAND" \
-			$TOPDIR/firmware/no2bootloader-$b-*-*.{bin,elf} \
+			$TOPDIR/firmware/no2bootloader-$b-*-*.{bin,img,elf} \
 			binaries@ftp.osmocom.org:web-files/no2bootloader/$b/all/
 		rsync --archive --copy-links --verbose --compress --rsh "$SSH_COMMAND" \
-			$TOPDIR/firmware/no2bootloader-$b.{bin,elf} \
+			$TOPDIR/firmware/no2bootloader-$b.{bin,img,elf} \
 			binaries@ftp.osmocom.org:web-files/no2bootloader/$b/latest/
 	fi
 done
@@ -13,3 +13,4 @@
 #define LED_BASE	0x83000000
 #define USB_CORE_BASE	0x84000000
 #define USB_DATA_BASE	0x85000000
+#define XIP_BASE	0x87000000
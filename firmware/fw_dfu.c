@@ -16,12 +16,17 @@
 #include "spi.h"
 #include <no2usb/usb.h>
 #include <no2usb/usb_dfu.h>
+#include <no2usb/usb_dfu_bulk.h>
 #include <no2usb/usb_dfu_proto.h>
+#include <no2usb/usb_msc_uf2.h>
 #include <no2usb/usb_msos20.h>
 #include "utils.h"
+#include "xip.h"
 
 
 extern const struct usb_stack_descriptors dfu_stack_desc;
+extern const struct msos20_desc_set_hdr * const dfu_msos20_desc;
+extern void dfu_desc_patch(bool bl_upgrade);
 
 
 struct wb_misc {
@@ -55,24 +60,100 @@ serial_no_init()
 		desc[2 + (i << 1)] = id[i];
 }
 
+/* Trained SPI clock and the read mode picked by flash_init(), stored
+ * outside of the DFU zones for the boot code.
+ * It can only be stored if that sector isn't write protected : on
+ * protected flash, the boot code keeps using whatever is there (the
+ * defaults if nothing valid is) and only this firmware runs at the
+ * trained clock. */
+#define SPI_CFG_FLASH_ADDR	0x0003f000
+
+static bool
+flash_unprotected(void)
+{
+	/* No block protect bits (BP0-2, TB, SEC) */
+	return (flash_read_sr(1) & 0x7c) == 0;
+}
+
 static void
-boot_app(void)
+spi_train(void)
 {
-	/* Force re-enumeration */
-	usb_disconnect();
+	const struct flash_info *fi = flash_get_info();
+	uint32_t cfg[2], cur[2];
+	int div;
+
+	div = flash_train();
+	if (div < 0) {
+		puts("SPI clock training failed\n");
+		return;
+	}
 
-	/* Boot firmware */
-	misc_regs->boot = (1 << 2) | (2 << 0);
+	printf("SPI clock trained : %d kHz\n", 12000 / (div + 1));
+
+	cfg[0] = SPI_CFG_WORD(div);
+	cfg[1] = SPI_CFG_MODE(fi->read.io, fi->read.opcode, fi->read.dummy);
+
+	/* Only update when it really changed, to spare the flash : at the
+	 * margin the result can flip by a step from one boot to the next,
+	 * and a stored divider one step faster still passed just now */
+	flash_read(cur, SPI_CFG_FLASH_ADDR, sizeof(cur));
+	if (cur[1] == cfg[1])
+		for (int d=div-1; d<=div+1; d++)
+			if ((d >= 0) && (cur[0] == SPI_CFG_WORD(d)))
+				return;
+
+	if (!flash_unprotected()) {
+		puts("SPI clock not stored, flash is write protected\n");
+		return;
+	}
+
+	flash_seq_erase(SPI_CFG_FLASH_ADDR, 4096);
+	flash_seq_page_program(cfg, SPI_CFG_FLASH_ADDR, sizeof(cfg));
+	while (flash_seq_busy());
+
+	flash_read(cur, SPI_CFG_FLASH_ADDR, sizeof(cur));
+	if (memcmp(cur, cfg, sizeof(cfg)))
+		puts("SPI clock not stored\n");
+}
+
+static void __xip
+flash_info_init(void)
+{
+	const struct flash_info *fi = flash_get_info();
+	struct usb_dfu_flash_info dfi = {
+		.page_size    = fi->page_size,
+		.prog_time_us = fi->prog_time_us,
+	};
+	int i;
+
+	printf("Flash params (%s) : %d kB, %d b pages, read x%d %02x\n",
+		fi->sfdp ? "SFDP" : "default",
+		fi->size >> 10, fi->page_size,
+		1 << fi->read.io, fi->read.opcode
+	);
+
+	/* Only pass the erase sizes the flash supports */
+	for (i=0; i<3; i++) {
+		if (!fi->erase[i].opcode)
+			continue;
+		dfi.erase_time_us[i] = fi->erase[i].time_us;
+		printf("Flash erase %02x : %d ms\n", fi->erase[i].opcode, fi->erase[i].time_us / 1000);
+	}
+
+	if (fi->erase_sus.suspend)
+		printf("Flash erase suspend %02x / resume %02x\n", fi->erase_sus.suspend, fi->erase_sus.resume);
+
+	usb_dfu_set_flash_info(&dfi);
 }
 
 static void
-patch_descriptors(bool bl_upgrade)
+boot_app(void)
 {
-	volatile struct usb_conf_desc *conf = (void*)dfu_stack_desc.conf[0];
-	int n = bl_upgrade ? 4 : 2;
+	/* Force re-enumeration */
+	usb_disconnect();
 
-	/* We patch the descriptor length ... in RO section but not really RO */
-	conf->wTotalLength = sizeof( struct usb_conf_desc) + n * (sizeof(struct usb_intf_desc) + sizeof(struct usb_dfu_func_desc));
+	/* Boot firmware */
+	misc_regs->boot = (1 << 2) | (2 << 0);
 }
 
 static void
@@ -96,26 +177,21 @@ usb_dfu_cb_reboot(void)
 bool
 usb_dfu_cb_flash_busy(void)
 {
-	return flash_read_sr(1) & 1;
+	return flash_seq_busy();
 }
 
 void
 usb_dfu_cb_flash_erase(uint32_t addr, unsigned size)
 {
-	flash_write_enable();
-
-	switch (size) {
-	case 4096:  flash_sector_erase(addr);
-	case 32678: flash_block_erase_32k(addr);
-	case 65536: flash_block_erase_64k(addr);
-	}
+	flash_seq_erase(addr, size);
+	xip_flush();
 }
 
 void
 usb_dfu_cb_flash_program(const void *data, uint32_t addr, unsigned size)
 {
-	flash_write_enable();
-	flash_page_program(data, addr, size);
+	flash_seq_page_program(data, addr, size);
+	xip_flush();
 }
 
 void
@@ -127,20 +203,27 @@ usb_dfu_cb_flash_read(void *data, uint32_t addr, unsigned size)
 void
 usb_dfu_cb_flash_raw(void *data, unsigned len)
 {
-	struct spi_xfer_chunk sx[1] = {
-		{ .data = data, .len = len, .read = true, .write = true, },
-	};
-	spi_xfer(SPI_CS_FLASH, sx, 1);
+	flash_raw(data, len);
 }
 
 
 static const struct usb_dfu_zone dfu_zones[] = {
-	{ 0x00080000, 0x000a0000 },     /* iCE40 bitstream */
-	{ 0x000a0000, 0x000c0000 },     /* RISC-V firmware */
-	{ 0x00040000, 0x00060000 },     /* Bootloader bitstream */
-	{ 0x00060000, 0x00080000 },     /* Bootloader firmware  */
+	{ 0x00080000, 0x000a0000, USB_DFU_ZONE_F_PREERASE | USB_DFU_ZONE_F_LZ },	/* iCE40 bitstream */
+	{ 0x000a0000, 0x000c0000, USB_DFU_ZONE_F_COMPARE  | USB_DFU_ZONE_F_LZ },	/* RISC-V firmware */
+	{ 0x00040000, 0x00060000, USB_DFU_ZONE_F_PREERASE },	/* Bootloader bitstream */
+	{ 0x00060000, 0x00080000, USB_DFU_ZONE_F_COMPARE },	/* Bootloader firmware  */
 };
 
+#ifdef MSC_UF2
+static const char msc_info[] =
+	"UF2 Bootloader no2bootloader\r\n"
+	"Model: iCE40 USB device\r\n"
+	"Zones (UF2 target address):\r\n"
+	"  0x00080000 iCE40 bitstream\r\n"
+	"  0x000a0000 RISC-V firmware\r\n"
+	"Eject the drive to boot\r\n";
+#endif
+
 
 // ---------------------------------------------------------------------------
 // Main
@@ -164,9 +247,12 @@ void main()
 
 	/* SPI */
 	spi_init();
+	flash_init();
+	spi_train();
+	xip_init();
 
 	/* Should be allow boot loader upgrad ? */
-	bl_upgrade = ((flash_read_sr(1) & 0x7c) == 0);
+	bl_upgrade = flash_unprotected();
 
 	if (bl_upgrade)
 		led_color(64, 0, 16);
@@ -174,13 +260,18 @@ void main()
 		led_color(0, 16, 64);
 
 	set_single_led(bl_upgrade);
-	patch_descriptors(bl_upgrade);
+	dfu_desc_patch(bl_upgrade);
 
 	/* Enable USB directly */
 	serial_no_init();
 	usb_init(&dfu_stack_desc);
 	usb_dfu_init(dfu_zones, 4);
-	usb_msos20_init(NULL);
+	usb_dfu_bulk_init(bl_upgrade ? 4 : 2);
+#ifdef MSC_UF2
+	usb_msc_uf2_init(msc_info, bl_upgrade ? 4 : 2);
+#endif
+	flash_info_init();
+	usb_msos20_init(dfu_msos20_desc);
 	usb_connect();
 
 	/* Main loop */
@@ -205,6 +296,13 @@ void main()
 			case 'b':
 				boot_app();
 				break;
+			case 'x':
+				{
+					uint32_t hits, misses;
+					xip_stats(&hits, &misses, true);
+					printf("XIP cache : %d hits / %d misses\n", hits, misses);
+				}
+				break;
 			default:
 				break;
 			}
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+#
+# Prepends the image header the boot code expects to a raw firmware
+# binary, so that it only copies (and checks) what's actually there :
+#
+#  magic       'NO2I'
+#  length      Payload length in bytes (padded to a multiple of 4)
+#  load_addr   Where the payload is copied, and jumped to
+#  checksum    Sum of the payload 32 bits words, modulo 2^32
+#
+# All fields are 32 bits little endian.
+#
+# With --compress, the magic is 'NO2Z' and the payload is a LZ stream
+# (same format as the DFU LZ payloads, without their header). The boot
+# code loads it at the end of the application area and decompresses it
+# in place from there, which is checked to be safe here.
+#
+# The load address must be word aligned and within the application area
+# (as the boot code checks), and the payload must fit there from it.
+#
+# With --xip, code executed in place from flash (the .xip section, see
+# soc.lds) is added at a fixed offset in the image, after the part the
+# boot code copies.
+#
+# Copyright (C) 2026 agent <agent@local>
+# SPDX-License-Identifier: MIT
+#
+
+import argparse
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'utils'))
+from dfu_pack import pack_lz
+
+
+IMG_MAGIC    = 0x49324f4e	# 'NO2I'
+IMG_MAGIC_LZ = 0x5a324f4e	# 'NO2Z'
+
+
+def lz_lag(stream):
+	# Decodes the stream and returns the maximum number of bytes the
+	# output gets ahead of the consumed input (plus the decoded data)
+	out = bytearray()
+	pos = 0
+	lag = 0
+
+	def ext(n):
+		nonlocal pos
+		while True:
+			b = stream[pos]
+			pos += 1
+			n += b
+			if b != 255:
+				return n
+
+	while True:
+		tok = stream[pos]
+		pos += 1
+
+		n = tok >> 4
+		if n == 15:
+			n = ext(n)
+		for i in range(n):
+			out.append(stream[pos])
+			pos += 1
+			lag = max(lag, len(out) - pos)
+
+		ofs = stream[pos] | (stream[pos+1] << 8)
+		pos += 2
+		if ofs == 0:
+			return lag, bytes(out)
+
+		n = tok & 15
+		if n == 15:
+			n = ext(n)
+		for i in range(n + 4):
+			out.append(out[-ofs])
+			lag = max(lag, len(out) - pos)
+
+
+def mkimage(data, load_addr, compress=False, area_start=0x00020000, area_size=0x10000):
+	magic = IMG_MAGIC
+
+	# Space from the load address to the end of the area
+	ofs = load_addr - area_start
+	if (load_addr & 3) or not (0 <= ofs < area_size):
+		raise RuntimeError('Load address not word aligned within the application area')
+
+	avail = area_size - ofs
+
+	if compress:
+		payload = pack_lz(data)[8:]
+		lag, check = lz_lag(payload)
+		if check != data:
+			raise RuntimeError('LZ stream check failed')
+
+		# Stream is loaded at the end of the area, output (starting at
+		# the load address) must stay behind
+		room = avail - ((len(payload) + 3) & ~3)
+		if (len(data) > avail) or (lag >= room):
+			raise RuntimeError('Image too large to be decompressed in place')
+
+		data  = payload
+		magic = IMG_MAGIC_LZ
+
+	# Pad to full words
+	if len(data) & 3:
+		data += b'\x00' * (4 - (len(data) & 3))
+
+	if len(data) > avail:
+		raise RuntimeError('Image too large for the application area')
+
+	csum = sum(struct.unpack('<%dI' % (len(data) // 4), data)) & 0xffffffff
+
+	return struct.pack('<IIII', magic, len(data), load_addr, csum) + data
+
+
+def main(argv0, *args):
+	parser = argparse.ArgumentParser(description='Add boot image header to a firmware binary')
+	parser.add_argument('-l', '--load-addr', type=lambda x: int(x, 0), default=0x00020000,
+		help='Load (and entry) address')
+	parser.add_argument('-z', '--compress', action='store_true',
+		help='LZ compress the payload')
+	parser.add_argument('-a', '--area-start', type=lambda x: int(x, 0), default=0x00020000,
+		help='Start of the application area')
+	parser.add_argument('-s', '--area-size', type=lambda x: int(x, 0), default=0x10000,
+		help='Size of the application area (default: 64k)')
+	parser.add_argument('-x', '--xip',
+		help='Execute in place section binary, added at the XIP offset')
+	parser.add_argument('-o', '--xip-offset', type=lambda x: int(x, 0), default=0x10000,
+		help='Offset of the XIP section in the image (default: 64k, must match soc.lds)')
+	parser.add_argument('input')
+	parser.add_argument('output')
+	args = parser.parse_args(args)
+
+	with open(args.input, 'rb') as fh:
+		data = fh.read()
+
+	img = mkimage(data, args.load_addr, args.compress, args.area_start, args.area_size)
+
+	if args.xip:
+		with open(args.xip, 'rb') as fh:
+			xip = fh.read()
+
+		if xip:
+			if len(img) > args.xip_offset:
+				raise RuntimeError('Image overlaps the XIP section')
+			img += b'\xff' * (args.xip_offset - len(img)) + xip
+
+	with open(args.output, 'wb') as fh:
+		fh.write(img)
+
+	print(f"{len(data):d} bytes -> {len(img):d} bytes image", file=sys.stderr)
+
+
+if __name__ == '__main__':
+	main(*sys.argv)
@@ -7,87 +7,153 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "config.h"
 #include "spi.h"
 
 
 struct spi {
-	uint32_t _rsvd0[6];
-	uint32_t irq;		/* 0110 - SPIIRQ   - Interrupt Status Register  */
-	uint32_t irqen;		/* 0111 - SPIIRQEN - Interrupt Control Register */
-	uint32_t cr0;		/* 1000 - CR0      - Control Register 0 */
-	uint32_t cr1;		/* 1001 - CR1      - Control Register 1 */
-	uint32_t cr2;		/* 1010 - CR2      - Control Register 2 */
-	uint32_t br;		/* 1011 - BR       - Baud Rate Register */
-	uint32_t sr;		/* 1100 - SR       - Status Register    */
-	uint32_t txdr;		/* 1101 - TXDR     - Transmit Data Register */
-	uint32_t rxdr;		/* 1110 - RXDR     - Receive Data Register  */
-	uint32_t csr;		/* 1111 - CSR      - Chip Select Register   */
+	uint32_t csr;		/* 00 - CSR  - Control / Status Register */
+	uint32_t cmd;		/* 04 - CMD  - Command Register */
+	uint32_t data;		/* 08 - DATA - TX / RX FIFO */
+	uint32_t seq;		/* 0C - SEQ  - Flash sequencer */
 } __attribute__((packed,aligned(4)));
 
-#define SPI_CR0_TIDLE(xcnt)	(((xcnt) & 3) << 6)
-#define SPI_CR0_TTRAIL(xcnt)	(((xcnt) & 7) << 3)
-#define SPI_CR0_TLEAD(xcnt)	(((xcnt) & 7) << 0)
+#define SPI_CSR_BUSY		(1 << 31)
+#define SPI_CSR_RX_EMPTY	(1 << 30)
+#define SPI_CSR_TX_FULL		(1 << 29)
+#define SPI_CSR_TX_EMPTY	(1 << 28)
+#define SPI_CSR_QUAD		(1 << 24)
+#define SPI_CSR_CS(n)		(1 << (16 + (n)))
+#define SPI_CSR_DIV(d)		((d) & 0xff)
+#define SPI_CSR_DIV_MSK		0xff
+
+#define SPI_CMD_RX		(1 << 31)
+#define SPI_CMD_TX		(1 << 30)
+#define SPI_CMD_IO(w)		(((w) & 3) << 28)
+#define SPI_CMD_LEN(l)		(((l) - 1) & 0xffff)
+#define SPI_CMD_MAX_LEN		65536
+
+#define SPI_SEQ_WREN		(1 << 31)
+#define SPI_SEQ_POLL		(1 << 30)
+#define SPI_SEQ_LEN(l)		(((l) - 1) & 0xffff)
+#define SPI_SEQ_BUSY		(1 << 31)
+#define SPI_SEQ_DONE		(1 << 30)
+#define SPI_SEQ_REJECTED	(1 << 29)
 
-#define SPI_CR1_ENABLE		(1 << 7)
-#define SPI_CR1_WKUPEN_USER	(1 << 6)
-#define SPI_CR1_TXEDGE		(1 << 4)
 
-#define SPI_CR2_MASTER		(1 << 7)
-#define SPI_CR2_MCSH		(1 << 6)
-#define SPI_CR2_SDBRE		(1 << 5)
-#define SPI_CR2_CPOL		(1 << 2)
-#define SPI_CR2_CPHA		(1 << 1)
-#define SPI_CR2_LSBF		(1 << 0)
-
-#define SPI_SR_TIP		(1 << 7)
-#define SPI_SR_BUSY		(1 << 6)
-#define SPI_SR_TRDY		(1 << 4)
-#define SPI_SR_RRDY		(1 << 3)
-#define SPI_SR_TOE		(1 << 2)
-#define SPI_SR_ROE		(1 << 1)
-#define SPI_SR_MDF		(1 << 0)
+static volatile struct spi * const spi_regs = (void*)(SPI_BASE);
 
 
-static volatile struct spi * const spi_regs = (void*)(SPI_BASE);
+/* CSR / CMD / SEQ writes are ignored while a sequence runs */
+static inline void
+_spi_seq_wait(void)
+{
+	while (spi_regs->seq & SPI_SEQ_BUSY);
+}
 
 
 void
 spi_init(void)
 {
-	spi_regs->cr0 = SPI_CR0_TIDLE(3) |
-	                SPI_CR0_TTRAIL(7) |
-	                SPI_CR0_TLEAD(7);
-	spi_regs->cr1 = SPI_CR1_ENABLE;
-	spi_regs->cr2 = SPI_CR2_MASTER | SPI_CR2_MCSH;
-	spi_regs->br  = 3;
-	spi_regs->csr = 0xf;
+	/* Safe clock until flash_train() is done */
+	spi_set_div(SPI_DIV_DEFAULT);
+}
+
+void
+spi_set_div(unsigned div)
+{
+	_spi_seq_wait();
+	spi_regs->csr = SPI_CSR_DIV(div);
+}
+
+unsigned
+spi_get_div(void)
+{
+	return spi_regs->csr & SPI_CSR_DIV_MSK;
+}
+
+static inline uint32_t
+_spi_word_get(const uint8_t *data, unsigned len)
+{
+	uint32_t w = 0;
+
+	if (!((uintptr_t)data & 3) && (len == 4))
+		return *(const uint32_t *)data;
+
+	for (int i=0; i<len; i++)
+		w |= data[i] << (8 * i);
+
+	return w;
+}
+
+static inline void
+_spi_word_put(uint8_t *data, unsigned len, uint32_t w)
+{
+	if (!((uintptr_t)data & 3) && (len == 4)) {
+		*(uint32_t *)data = w;
+		return;
+	}
+
+	for (int i=0; i<len; i++)
+		data[i] = w >> (8 * i);
+}
+
+static void
+_spi_chunk(struct spi_xfer_chunk *xfer)
+{
+	uint8_t *data = xfer->data;
+	unsigned len = xfer->len;
+
+	while (len)
+	{
+		unsigned cl = (len > SPI_CMD_MAX_LEN) ? SPI_CMD_MAX_LEN : len;
+
+		/* Start command (waits for the previous one to be done) */
+		spi_regs->cmd =
+			(xfer->read  ? SPI_CMD_RX : 0) |
+			(xfer->write ? SPI_CMD_TX : 0) |
+			SPI_CMD_IO(xfer->io) |
+			SPI_CMD_LEN(cl);
+
+		/* Move data, one word at a time */
+		if (xfer->read || xfer->write) {
+			for (unsigned i=0; i<cl; i+=4) {
+				unsigned wl = ((cl - i) > 4) ? 4 : (cl - i);
+				if (xfer->write)
+					spi_regs->data = _spi_word_get(&data[i], wl);
+				if (xfer->read)
+					_spi_word_put(&data[i], wl, spi_regs->data);
+			}
+		}
+
+		data += cl;
+		len  -= cl;
+	}
 }
 
 void
 spi_xfer(unsigned cs, struct spi_xfer_chunk *xfer, unsigned n)
 {
-	uint8_t rxd;
+	uint32_t csr;
+
+	/* Sequencer must be done */
+	_spi_seq_wait();
 
 	/* Setup CS */
-	spi_regs->csr = 0xf ^ (1 << cs);
+	csr = spi_regs->csr & SPI_CSR_DIV_MSK;
+	spi_regs->csr = csr | SPI_CSR_CS(cs);
 
 	/* Run the chunks */
-	while (n--) {
-		for (int i=0; i<xfer->len; i++)
-		{
-			spi_regs->txdr = xfer->write ? xfer->data[i] : 0x00;
-			while (!(spi_regs->sr & SPI_SR_RRDY));
-			rxd = spi_regs->rxdr;
-			if (xfer->read)
-				xfer->data[i] = rxd;
-		}
-		xfer++;
-	}
+	while (n--)
+		_spi_chunk(xfer++);
+
+	/* Wait for the last one to complete and clear CS */
+	while (spi_regs->csr & SPI_CSR_BUSY);
 
-	/* Clear CS */
-	spi_regs->csr = 0xf;
+	spi_regs->csr = csr;
 }
 
 
@@ -99,6 +165,7 @@ spi_xfer(unsigned cs, struct spi_xfer_chunk *xfer, unsigned n)
 
 #define FLASH_CMD_READ_MANUF_ID		0x9f
 #define FLASH_CMD_READ_UNIQUE_ID	0x4b
+#define FLASH_CMD_READ_SFDP		0x5a
 
 #define FLASH_CMD_READ_SR1		0x05
 #define FLASH_CMD_READ_SR2		0x35
@@ -108,11 +175,261 @@ spi_xfer(unsigned cs, struct spi_xfer_chunk *xfer, unsigned n)
 #define FLASH_CMD_WRITE_SR3		0x11
 
 #define FLASH_CMD_READ_DATA		0x03
+#define FLASH_CMD_FAST_READ		0x0b
+#define FLASH_CMD_FAST_READ_DUAL_OUT	0x3b
+#define FLASH_CMD_FAST_READ_QUAD_OUT	0x6b
 #define FLASH_CMD_PAGE_PROGRAM		0x02
 #define FLASH_CMD_CHIP_ERASE		0x60
 #define FLASH_CMD_SECTOR_ERASE		0x20
 #define FLASH_CMD_BLOCK_ERASE_32k	0x52
 #define FLASH_CMD_BLOCK_ERASE_64k	0xd8
+#define FLASH_CMD_ERASE_SUSPEND		0x75
+#define FLASH_CMD_ERASE_RESUME		0x7a
+
+#define FLASH_SR1_WIP			(1 << 0)
+
+#define FLASH_SR1_QE			(1 << 6)
+#define FLASH_SR2_QE			(1 << 1)
+
+#define SFDP_SIGNATURE			0x50444653	/* 'SFDP' */
+#define SFDP_BFPT_MAX_DW		16
+
+/* Winbond style defaults, used when there is no SFDP */
+static struct flash_info g_flash = {
+	.page_size    = 256,
+	.prog_time_us = 700,
+	.erase = {
+		{ FLASH_CMD_SECTOR_ERASE,     45000 },
+		{ FLASH_CMD_BLOCK_ERASE_32k, 120000 },
+		{ FLASH_CMD_BLOCK_ERASE_64k, 150000 },
+	},
+	.read = { SPI_IO_X1, FLASH_CMD_FAST_READ, 8 },
+	.erase_sus = { FLASH_CMD_ERASE_SUSPEND, FLASH_CMD_ERASE_RESUME },
+};
+
+static void
+_flash_sfdp_read(void *dst, uint32_t addr, unsigned len)
+{
+	uint8_t cmd[5] = { FLASH_CMD_READ_SFDP, ((addr >> 16) & 0xff), ((addr >> 8) & 0xff), (addr & 0xff), 0x00 };
+	struct spi_xfer_chunk xfer[2] = {
+		{ .data = (void*)cmd, .len = 5,   .read = false, .write = true,  },
+		{ .data = (void*)dst, .len = len, .read = true,  .write = false, },
+	};
+	spi_xfer(SPI_CS_FLASH, xfer, 2);
+}
+
+static uint32_t
+_flash_sfdp_erase_time(uint32_t dw10, int type)
+{
+	static const uint16_t unit_ms[] = { 1, 16, 128, 1000 };
+	uint32_t v = dw10 >> (4 + 7 * type);
+	return ((v & 0x1f) + 1) * unit_ms[(v >> 5) & 3] * 1000;
+}
+
+/* Parses the Basic Flash Parameter Table. Returns the Quad Enable
+ * Requirements field, or -1 if the table is too old to have it */
+static int
+_flash_sfdp_parse(uint32_t *bfpt, int n_dw, uint8_t *read_op, uint8_t *read_dummy)
+{
+	int qer = -1;
+
+	/* Density */
+	if (bfpt[1] & (1 << 31))
+		g_flash.size = ((bfpt[1] & 0x7fffffff) < 35) ? (1 << ((bfpt[1] & 0x7fffffff) - 3)) : 0;
+	else
+		g_flash.size = (bfpt[1] >> 3) + 1;
+
+	/* Fast read modes (1-1-2 and 1-1-4), dummy clocks include mode ones */
+	read_op[SPI_IO_X2]    = (bfpt[0] & (1 << 16)) ? ((bfpt[3] >> 8) & 0xff) : 0;
+	read_dummy[SPI_IO_X2] = ((bfpt[3] >> 0) & 0x1f) + ((bfpt[3] >> 5) & 0x7);
+
+	read_op[SPI_IO_X4]    = (bfpt[0] & (1 << 22)) ? ((bfpt[2] >> 24) & 0xff) : 0;
+	read_dummy[SPI_IO_X4] = ((bfpt[2] >> 16) & 0x1f) + ((bfpt[2] >> 21) & 0x7);
+
+	/* Erase types (4k one must exist, the DFU relies on it) */
+	if (n_dw < 9)
+		return qer;
+
+	for (int i=1; i<3; i++)
+		g_flash.erase[i].opcode = 0;
+
+	for (int t=0; t<4; t++) {
+		uint32_t v = bfpt[7 + (t >> 1)] >> ((t & 1) << 4);
+		int i;
+
+		switch (v & 0xff) {
+		case 12: i = 0; break;
+		case 15: i = 1; break;
+		case 16: i = 2; break;
+		default: continue;
+		}
+
+		g_flash.erase[i].opcode = (v >> 8) & 0xff;
+		if (n_dw >= 10)
+			g_flash.erase[i].time_us = _flash_sfdp_erase_time(bfpt[9], t);
+	}
+
+	/* Page size and program time */
+	if (n_dw >= 11) {
+		g_flash.page_size    = 1 << ((bfpt[10] >> 4) & 0xf);
+		g_flash.prog_time_us = (((bfpt[10] >> 8) & 0x1f) + 1) << ((bfpt[10] & (1 << 13)) ? 6 : 3);
+	}
+
+	/* Erase Suspend / Resume opcodes (0x00 / 0xff means not filled),
+	 * only if DWORD 12 doesn't flag them as unsupported */
+	if ((n_dw >= 13) && !(bfpt[11] & (1u << 31))) {
+		uint8_t sus = (bfpt[12] >> 24) & 0xff;
+		uint8_t res = (bfpt[12] >> 16) & 0xff;
+
+		if ((sus != 0x00) && (sus != 0xff) && (res != 0x00) && (res != 0xff)) {
+			g_flash.erase_sus.suspend = sus;
+			g_flash.erase_sus.resume  = res;
+		}
+	}
+
+	/* Quad Enable Requirements */
+	if (n_dw >= 15)
+		qer = (bfpt[14] >> 20) & 7;
+
+	return qer;
+}
+
+static bool
+_flash_quad_enabled(int qer)
+{
+	uint8_t sr;
+
+	switch (qer) {
+	case 0:		/* No QE bit */
+		return true;
+	case 2:		/* SR1[6] */
+		return !!(flash_read_sr(1) & FLASH_SR1_QE);
+	case 3:		/* SR2[7], with non standard commands */
+	case 7:
+		return false;
+	default:
+		/* SR2[1] (or unknown), read back with 0x35. Parts that claim
+		 * not to have that command often do, 0xff means it's absent */
+		sr = flash_read_sr(2);
+		return (sr != 0xff) && (sr & FLASH_SR2_QE);
+	}
+}
+
+void
+flash_init(void)
+{
+	uint32_t buf[SFDP_BFPT_MAX_DW];
+	uint8_t read_op[3]    = { FLASH_CMD_FAST_READ, FLASH_CMD_FAST_READ_DUAL_OUT, FLASH_CMD_FAST_READ_QUAD_OUT };
+	uint8_t read_dummy[3] = { 8, 8, 8 };
+	int qer = -1;
+
+	/* SFDP header and first parameter header, always the BFPT */
+	_flash_sfdp_read(buf, 0, 16);
+
+	if ((buf[0] == SFDP_SIGNATURE) && ((buf[2] & 0xff) == 0x00) && ((buf[3] >> 24) == 0xff)) {
+		int n_dw = (buf[2] >> 24) & 0xff;
+
+		if (n_dw > SFDP_BFPT_MAX_DW)
+			n_dw = SFDP_BFPT_MAX_DW;
+
+		_flash_sfdp_read(buf, buf[3] & 0xffffff, n_dw * 4);
+
+		qer = _flash_sfdp_parse(buf, n_dw, read_op, read_dummy);
+		g_flash.sfdp = true;
+	}
+
+	/* Pick the fastest read mode. Dual output reads only need IO0/IO1,
+	 * quad ones need IO2/IO3 wired and the QE bit set (else they're
+	 * WP#/HOLD#). Dummy clocks must fill whole bytes. */
+	for (int io=SPI_IO_X4; io>=SPI_IO_X1; io--)
+	{
+		if (!read_op[io] || (read_dummy[io] & ((8 >> io) - 1)))
+			continue;
+
+		if ((io == SPI_IO_X4) && (!(spi_regs->csr & SPI_CSR_QUAD) || !_flash_quad_enabled(qer)))
+			continue;
+
+		g_flash.read.io     = io;
+		g_flash.read.opcode = read_op[io];
+		g_flash.read.dummy  = read_dummy[io];
+		break;
+	}
+}
+
+/* Reads the training pattern : JEDEC ID, unique ID and some of the
+ * array using the selected read mode, since the multi IO paths are the
+ * ones most likely to fail first */
+#define FLASH_TRAIN_LEN		(4 + 8 + 64)
+#define FLASH_TRAIN_ITER	16
+
+static void
+_flash_train_read(uint8_t *buf)
+{
+	buf[3] = 0x00;
+	flash_manuf_id(&buf[0]);
+	flash_unique_id(&buf[4]);
+	flash_read(&buf[12], 0, 64);
+}
+
+static bool
+_flash_train_check(const uint8_t *ref)
+{
+	uint8_t buf[FLASH_TRAIN_LEN];
+
+	for (int n=0; n<FLASH_TRAIN_ITER; n++) {
+		_flash_train_read(buf);
+		if (memcmp(buf, ref, FLASH_TRAIN_LEN))
+			return false;
+	}
+
+	return true;
+}
+
+/* Finds the fastest SPI clock that reads back the same data as a slow
+ * reference one and selects the next slower one, as margin for voltage
+ * and temperature drift. Returns the selected divider, or -1 if the
+ * flash didn't answer anything usable (current divider is kept) */
+int
+flash_train(void)
+{
+	uint8_t ref[FLASH_TRAIN_LEN];
+	unsigned prev = spi_get_div();
+	int div;
+
+	/* Reference at low speed */
+	spi_set_div(SPI_DIV_TRAIN_REF);
+	_flash_train_read(ref);
+
+	/* Missing or stuck flash, all bits at the same level */
+	if ((ref[0] == 0x00 && ref[1] == 0x00 && ref[2] == 0x00) ||
+	    (ref[0] == 0xff && ref[1] == 0xff && ref[2] == 0xff)) {
+		spi_set_div(prev);
+		return -1;
+	}
+
+	/* Fastest first, reference one always works */
+	for (div=0; div<SPI_DIV_TRAIN_REF; div++) {
+		spi_set_div(div);
+		if (_flash_train_check(ref))
+			break;
+	}
+
+	if (div < SPI_DIV_TRAIN_REF)
+		div++;
+
+	spi_set_div(div);
+
+	/* Garbled commands can't be writes without a WREN, make sure */
+	flash_write_disable();
+
+	return div;
+}
+
+const struct flash_info *
+flash_get_info(void)
+{
+	return &g_flash;
+}
 
 void
 flash_cmd(uint8_t cmd)
@@ -212,15 +529,111 @@ flash_write_sr(int srno, uint8_t srval)
 	spi_xfer(SPI_CS_FLASH, xfer, 1);
 }
 
+/*
+ * Erase scheduling
+ *
+ * Erases are started by the sequencer but without its WIP polling, which
+ * would lock the SPI bus for the whole erase. Completion is polled by
+ * software in flash_seq_busy() instead, and this lets reads get in :
+ *
+ *  - Reads (flash_read / flash_raw) have priority over a running erase :
+ *    it gets suspended, the read is done and the erase is left suspended
+ *    so a burst of reads (e.g. an UPLOAD) only costs a single suspend.
+ *  - The erase is resumed by the next flash_seq_busy() call, so as soon
+ *    as the caller is back to waiting for it.
+ *  - After a resume, an erase is guaranteed FLASH_ES_MIN_RUN status polls
+ *    before it can be suspended again, reads wait for that. Flashes need
+ *    some time after a resume to make progress, without this a steady
+ *    stream of reads could keep an erase from ever completing.
+ *  - Programs are short and are never suspended, reads simply wait for
+ *    them. New programs / erases wait for the pending erase to finish.
+ *
+ * Each status poll is a full SPI transaction plus the caller loop around
+ * it, so the poll count gives a lower bound of the time the erase ran.
+ */
+
+#define FLASH_ES_MIN_RUN	256
+
+static struct {
+	bool     active;	/* Erase started and not seen completed */
+	bool     suspended;
+	unsigned run;		/* Status polls since the last resume */
+} g_flash_es;
+
+/* Polls a pending erase, resuming it if needed. Returns true if still busy */
+static bool
+_flash_es_poll(void)
+{
+	if (!g_flash_es.active)
+		return false;
+
+	if (g_flash_es.suspended) {
+		flash_cmd(g_flash.erase_sus.resume);
+		g_flash_es.suspended = false;
+		g_flash_es.run = 0;
+		return true;
+	}
+
+	if (flash_read_sr(1) & FLASH_SR1_WIP) {
+		g_flash_es.run++;
+		return true;
+	}
+
+	g_flash_es.active = false;
+	return false;
+}
+
+/* Makes the array readable : waits for any running sequence and gets
+ * a pending erase out of the way (suspended or completed) */
+static void
+_flash_es_read_prepare(void)
+{
+	/* Program sequences (or the start of an erase) */
+	_spi_seq_wait();
+
+	if (!g_flash_es.active || g_flash_es.suspended)
+		return;
+
+	/* No suspend support, just wait */
+	if (!g_flash.erase_sus.suspend) {
+		while (_flash_es_poll());
+		return;
+	}
+
+	/* Let the erase run its minimum time since the last resume */
+	while (g_flash_es.run < FLASH_ES_MIN_RUN)
+		if (!_flash_es_poll())
+			return;
+
+	/* Suspend and wait for it to be effective. If the erase completed
+	 * in the mean time, the resume will be ignored by the flash. */
+	flash_cmd(g_flash.erase_sus.suspend);
+	while (flash_read_sr(1) & FLASH_SR1_WIP);
+	g_flash_es.suspended = true;
+}
+
 void
 flash_read(void *dst, uint32_t addr, unsigned len)
 {
-	uint8_t cmd[4] = { FLASH_CMD_READ_DATA, ((addr >> 16) & 0xff), ((addr >> 8) & 0xff), (addr & 0xff)  };
-	struct spi_xfer_chunk xfer[2] = {
-		{ .data = (void*)cmd, .len = 4,   .read = false, .write = true,  },
-		{ .data = (void*)dst, .len = len, .read = true,  .write = false, },
+	uint8_t io = g_flash.read.io;
+	uint8_t cmd[4] = { g_flash.read.opcode, ((addr >> 16) & 0xff), ((addr >> 8) & 0xff), (addr & 0xff)  };
+	struct spi_xfer_chunk xfer[3] = {
+		{ .data = (void*)cmd, .len = 4, .read = false, .write = true,  },
+		{ .data = (void*)0,   .len = g_flash.read.dummy >> (3 - io), .read = false, .write = false, .io = io },
+		{ .data = (void*)dst, .len = len, .read = true,  .write = false, .io = io },
 	};
-	spi_xfer(SPI_CS_FLASH, xfer, 2);
+	_flash_es_read_prepare();
+	spi_xfer(SPI_CS_FLASH, xfer, g_flash.read.dummy ? 3 : 2);
+}
+
+void
+flash_raw(void *data, unsigned len)
+{
+	struct spi_xfer_chunk xfer[1] = {
+		{ .data = data, .len = len, .read = true, .write = true, },
+	};
+	_flash_es_read_prepare();
+	spi_xfer(SPI_CS_FLASH, xfer, 1);
 }
 
 void
@@ -244,6 +657,68 @@ _flash_erase(uint8_t cmd_byte, uint32_t addr)
 	spi_xfer(SPI_CS_FLASH, xfer, 1);
 }
 
+static void
+_flash_seq(uint8_t cmd_byte, uint32_t addr, const uint8_t *data, unsigned len, bool poll)
+{
+	/* Pending erase must be done (resumes it if suspended) */
+	while (_flash_es_poll());
+
+	/* Start sequence once the previous one is done */
+	_spi_seq_wait();
+	spi_regs->seq = SPI_SEQ_WREN | (poll ? SPI_SEQ_POLL : 0) | SPI_SEQ_LEN(4 + len);
+
+	/* Command / Address, sent LSB first */
+	spi_regs->data =
+		(cmd_byte) |
+		(((addr >> 16) & 0xff) <<  8) |
+		(((addr >>  8) & 0xff) << 16) |
+		(((addr >>  0) & 0xff) << 24);
+
+	/* Data (if any) */
+	for (unsigned i=0; i<len; i+=4) {
+		unsigned wl = ((len - i) > 4) ? 4 : (len - i);
+		spi_regs->data = _spi_word_get(&data[i], wl);
+	}
+}
+
+void
+flash_seq_page_program(const void *src, uint32_t addr, unsigned len)
+{
+	_flash_seq(FLASH_CMD_PAGE_PROGRAM, addr, src, len, true);
+}
+
+void
+flash_seq_erase(uint32_t addr, unsigned size)
+{
+	int i;
+
+	switch (size) {
+	case 4096:  i = 0; break;
+	case 32768: i = 1; break;
+	case 65536: i = 2; break;
+	default: return;
+	}
+
+	if (!g_flash.erase[i].opcode)
+		return;
+
+	/* No hardware polling, see erase scheduling above */
+	_flash_seq(g_flash.erase[i].opcode, addr, NULL, 0, false);
+
+	g_flash_es.active    = true;
+	g_flash_es.suspended = false;
+	g_flash_es.run       = 0;
+}
+
+bool
+flash_seq_busy(void)
+{
+	if (spi_regs->seq & SPI_SEQ_BUSY)
+		return true;
+
+	return _flash_es_poll();
+}
+
 void
 flash_sector_erase(uint32_t addr)
 {
@@ -14,14 +14,62 @@ struct spi_xfer_chunk {
 	unsigned len;
 	bool write;
 	bool read;
+	uint8_t io;
 };
 
+/* Data lines used by a chunk (default is x1) */
+#define SPI_IO_X1	0
+#define SPI_IO_X2	1
+#define SPI_IO_X4	2
+
 #define SPI_CS_FLASH	0
 #define SPI_CS_SRAM	1
 
+/* SCK = 24 MHz / (2 * (div + 1)) */
+#define SPI_DIV_DEFAULT		1	/* Until trained */
+#define SPI_DIV_TRAIN_REF	7	/* Reference for training */
+
+/* Trained divider, as stored in flash for the boot code : magic,
+ * inverted copy and divider, one byte each (bits 31:16, 15:8, 7:0) */
+#define SPI_CFG_MAGIC		0x5c1c
+#define SPI_CFG_WORD(div)	((SPI_CFG_MAGIC << 16) | ((~(div) & 0xff) << 8) | ((div) & 0xff))
+
+/* Read mode the boot code uses, stored after it : magic, dummy bytes in
+ * the data lines width, data lines (SPI_IO_Xn) and opcode (bits 31:16,
+ * 15:12, 9:8, 7:0) */
+#define SPI_CFG_MODE_MAGIC	0x5c1d
+#define SPI_CFG_MODE(io, op, dummy) \
+	((SPI_CFG_MODE_MAGIC << 16) | (((dummy) >> (3 - (io))) << 12) | ((io) << 8) | (op))
+
+/* Flash parameters, from SFDP when available */
+struct flash_info {
+	bool     sfdp;			/* Found SFDP */
+	uint32_t size;			/* Bytes (0 if unknown) */
+	unsigned page_size;
+	unsigned prog_time_us;		/* Typical page program time */
+	struct {
+		uint8_t  opcode;	/* 0 if not supported */
+		uint32_t time_us;	/* Typical erase time */
+	} erase[3];			/* 4k, 32k, 64k */
+	struct {
+		uint8_t io;		/* SPI_IO_Xn */
+		uint8_t opcode;
+		uint8_t dummy;		/* Dummy clocks */
+	} read;				/* Fastest usable read mode */
+	struct {
+		uint8_t suspend;	/* 0 if not supported */
+		uint8_t resume;
+	} erase_sus;			/* Erase Suspend / Resume opcodes */
+};
+
 void spi_init(void);
+void spi_set_div(unsigned div);
+unsigned spi_get_div(void);
 void spi_xfer(unsigned cs, struct spi_xfer_chunk *xfer, unsigned n);
 
+void flash_init(void);
+int  flash_train(void);
+const struct flash_info *flash_get_info(void);
 void flash_cmd(uint8_t cmd);
 void flash_deep_power_down(void);
 void flash_wake_up(void);
@@ -36,3 +84,11 @@ void flash_page_program(const void *src, uint32_t addr, unsigned len);
 void flash_sector_erase(uint32_t addr);
 void flash_block_erase_32k(uint32_t addr);
 void flash_block_erase_64k(uint32_t addr);
+
+/* Hardware sequenced WREN + command + wait, return as soon as queued */
+void flash_seq_page_program(const void *src, uint32_t addr, unsigned len);
+void flash_seq_erase(uint32_t addr, unsigned size);	/* 4k, 32k, 64k */
+bool flash_seq_busy(void);
+
+/* Raw transaction (command + data, both ways), scheduled like a read */
+void flash_raw(void *data, unsigned len);
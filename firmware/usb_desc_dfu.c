@@ -5,13 +5,22 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
 #include <no2usb/usb_proto.h>
 #include <no2usb/usb_dfu_proto.h>
 #include <no2usb/usb_msos20.h>
+#include <no2usb/usb_msos20_proto.h>
 #include <no2usb/usb.h>
+#include <no2usb/usb_dfu.h>
+#include <no2usb/usb_dfu_bulk.h>
+#include <no2usb/usb_msc_proto.h>
 
 
-static const struct {
+/* Not const, patched at init (see dfu_desc_patch) */
+static struct {
 	struct usb_conf_desc conf;
 	struct usb_intf_desc if_fpga;
 	struct usb_dfu_func_desc dfu_fpga;
@@ -21,12 +30,24 @@ static const struct {
 	struct usb_dfu_func_desc dfu_bl_fpga;
 	struct usb_intf_desc if_bl_riscv;
 	struct usb_dfu_func_desc dfu_bl_riscv;
+	struct usb_intf_desc if_bulk;
+	struct usb_ep_desc ep_bulk_out;
+	struct usb_ep_desc ep_bulk_in;
+#ifdef MSC_UF2
+	struct usb_intf_desc if_msc;
+	struct usb_ep_desc ep_msc_out;
+	struct usb_ep_desc ep_msc_in;
+#endif
 } __attribute__ ((packed)) _dfu_conf_desc = {
 	.conf = {
 		.bLength                = sizeof(struct usb_conf_desc),
 		.bDescriptorType        = USB_DT_CONF,
 		.wTotalLength           = sizeof(_dfu_conf_desc),
-		.bNumInterfaces         = 1,
+#ifdef MSC_UF2
+		.bNumInterfaces         = 3,
+#else
+		.bNumInterfaces         = 2,
+#endif
 		.bConfigurationValue    = 1,
 		.iConfiguration         = 4,
 		.bmAttributes           = 0x80,
@@ -48,7 +69,7 @@ static const struct {
 		.bDescriptorType	= USB_DFU_DT_FUNC,
 		.bmAttributes		= 0x0f,
 		.wDetachTimeOut		= 0,
-		.wTransferSize		= 4096,
+		.wTransferSize		= USB_DFU_TRANSFER_SIZE,
 		.bcdDFUVersion		= 0x0101,
 	},
 	.if_riscv = {
@@ -67,7 +88,7 @@ static const struct {
 		.bDescriptorType	= USB_DFU_DT_FUNC,
 		.bmAttributes		= 0x0f,
 		.wDetachTimeOut		= 0,
-		.wTransferSize		= 4096,
+		.wTransferSize		= USB_DFU_TRANSFER_SIZE,
 		.bcdDFUVersion		= 0x0101,
 	},
 	.if_bl_fpga = {
@@ -86,7 +107,7 @@ static const struct {
 		.bDescriptorType	= USB_DFU_DT_FUNC,
 		.bmAttributes		= 0x0f,
 		.wDetachTimeOut		= 0,
-		.wTransferSize		= 4096,
+		.wTransferSize		= USB_DFU_TRANSFER_SIZE,
 		.bcdDFUVersion		= 0x0101,
 	},
 	.if_bl_riscv = {
@@ -105,15 +126,89 @@ static const struct {
 		.bDescriptorType	= USB_DFU_DT_FUNC,
 		.bmAttributes		= 0x0f,
 		.wDetachTimeOut		= 0,
-		.wTransferSize		= 4096,
+		.wTransferSize		= USB_DFU_TRANSFER_SIZE,
 		.bcdDFUVersion		= 0x0101,
 	},
+	.if_bulk = {
+		.bLength		= sizeof(struct usb_intf_desc),
+		.bDescriptorType	= USB_DT_INTF,
+		.bInterfaceNumber	= 1,
+		.bAlternateSetting	= 0,
+		.bNumEndpoints		= 2,
+		.bInterfaceClass	= USB_DFU_BULK_INTF_CLASS,
+		.bInterfaceSubClass	= USB_DFU_BULK_INTF_SUBCLASS,
+		.bInterfaceProtocol	= USB_DFU_BULK_INTF_PROTOCOL,
+		.iInterface		= 0,
+	},
+	.ep_bulk_out = {
+		.bLength		= sizeof(struct usb_ep_desc),
+		.bDescriptorType	= USB_DT_EP,
+		.bEndpointAddress	= 0x01,
+		.bmAttributes		= 0x02,
+		.wMaxPacketSize		= 64,
+		.bInterval		= 0x00,
+	},
+	.ep_bulk_in = {
+		.bLength		= sizeof(struct usb_ep_desc),
+		.bDescriptorType	= USB_DT_EP,
+		.bEndpointAddress	= 0x81,
+		.bmAttributes		= 0x02,
+		.wMaxPacketSize		= 64,
+		.bInterval		= 0x00,
+	},
+#ifdef MSC_UF2
+	.if_msc = {
+		.bLength		= sizeof(struct usb_intf_desc),
+		.bDescriptorType	= USB_DT_INTF,
+		.bInterfaceNumber	= 2,
+		.bAlternateSetting	= 0,
+		.bNumEndpoints		= 2,
+		.bInterfaceClass	= 0x08,
+		.bInterfaceSubClass	= USB_MSC_SCLS_SCSI,
+		.bInterfaceProtocol	= USB_MSC_PROTO_BOT,
+		.iInterface		= 0,
+	},
+	.ep_msc_out = {
+		.bLength		= sizeof(struct usb_ep_desc),
+		.bDescriptorType	= USB_DT_EP,
+		.bEndpointAddress	= 0x02,
+		.bmAttributes		= 0x02,
+		.wMaxPacketSize		= 64,
+		.bInterval		= 0x00,
+	},
+	.ep_msc_in = {
+		.bLength		= sizeof(struct usb_ep_desc),
+		.bDescriptorType	= USB_DT_EP,
+		.bEndpointAddress	= 0x82,
+		.bmAttributes		= 0x02,
+		.wMaxPacketSize		= 64,
+		.bInterval		= 0x00,
+	},
+#endif
 };
 
 static const struct usb_conf_desc * const _conf_desc_array[] = {
 	&_dfu_conf_desc.conf,
 };
 
+#define DFU_CONF_OFS(m)		offsetof(__typeof__(_dfu_conf_desc), m)
+
+/* Drops the boot loader alt settings of the DFU interface when they
+ * can't be used, moving the following interfaces down */
+void
+dfu_desc_patch(bool bl_upgrade)
+{
+	uint8_t *d = (void*)&_dfu_conf_desc;
+	const size_t ofs = DFU_CONF_OFS(if_bl_fpga);
+	const size_t len = DFU_CONF_OFS(if_bulk) - ofs;
+
+	if (bl_upgrade)
+		return;
+
+	memmove(&d[ofs], &d[ofs + len], sizeof(_dfu_conf_desc) - (ofs + len));
+	_dfu_conf_desc.conf.wTotalLength = sizeof(_dfu_conf_desc) - len;
+}
+
 static const struct usb_dev_desc _dev_desc = {
 	.bLength		= sizeof(struct usb_dev_desc),
 	.bDescriptorType	= USB_DT_DEV,
@@ -148,11 +243,91 @@ static const struct usb_dev_desc _dev_desc = {
 	.bNumConfigurations	= num_elem(_conf_desc_array),
 };
 
+/* WinUSB for the DFU and bulk functions only : this is a composite
+ * device, a device wide compatible ID would also take the mass storage
+ * interface away from its class driver */
+static const struct {
+	struct msos20_desc_set_hdr hdr;
+	struct msos20_conf_subset_hdr conf;
+	struct msos20_func_subset_hdr func_dfu;
+	struct msos20_feat_compat_id_desc feat_dfu;
+	struct msos20_func_subset_hdr func_bulk;
+	struct msos20_feat_compat_id_desc feat_bulk;
+} __attribute__ ((packed)) _dfu_msos20_desc = {
+	.hdr = {
+		.wLength		= sizeof(struct msos20_desc_set_hdr),
+		.wDescriptorType	= MSOS20_SET_HEADER_DESCRIPTOR,
+		.dwWindowsVersion	= MSOS20_WIN_VER_8_1,
+		.wTotalLength		= sizeof(_dfu_msos20_desc),
+	},
+	.conf = {
+		.wLength		= sizeof(struct msos20_conf_subset_hdr),
+		.wDescriptorType	= MSOS20_SUBSET_HEADER_CONFIGURATION,
+		.bConfigurationValue	= 0,	/* Windows actually uses the index */
+		.bReserved		= 0,
+		.wTotalLength		= sizeof(_dfu_msos20_desc) - sizeof(struct msos20_desc_set_hdr),
+	},
+	.func_dfu = {
+		.wLength		= sizeof(struct msos20_func_subset_hdr),
+		.wDescriptorType	= MSOS20_SUBSET_HEADER_FUNCTION,
+		.bFirstInterface	= 0,
+		.bReserved		= 0,
+		.wSubsetLength		= sizeof(struct msos20_func_subset_hdr) + sizeof(struct msos20_feat_compat_id_desc),
+	},
+	.feat_dfu = {
+		.wLength		= sizeof(struct msos20_feat_compat_id_desc),
+		.wDescriptorType	= MSOS20_FEATURE_COMPATBLE_ID,
+		.CompatibleID		= { 'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00 },
+		.SubCompatibleID	= { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	},
+	.func_bulk = {
+		.wLength		= sizeof(struct msos20_func_subset_hdr),
+		.wDescriptorType	= MSOS20_SUBSET_HEADER_FUNCTION,
+		.bFirstInterface	= 1,
+		.bReserved		= 0,
+		.wSubsetLength		= sizeof(struct msos20_func_subset_hdr) + sizeof(struct msos20_feat_compat_id_desc),
+	},
+	.feat_bulk = {
+		.wLength		= sizeof(struct msos20_feat_compat_id_desc),
+		.wDescriptorType	= MSOS20_FEATURE_COMPATBLE_ID,
+		.CompatibleID		= { 'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00 },
+		.SubCompatibleID	= { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	},
+};
+
+static const struct {
+	struct usb_bos_desc bos;
+	struct usb_bos_plat_cap_hdr cap_hdr;
+	struct usb_bos_msos20_desc_set cap_data;
+} __attribute__ ((packed)) _dfu_bos_desc = {
+	.bos = {
+		.bLength		= sizeof(struct usb_bos_desc),
+		.bDescriptorType	= USB_DT_BOS,
+		.wTotalLength		= sizeof(_dfu_bos_desc),
+		.bNumDeviceCaps		= 1,
+	},
+	.cap_hdr = {
+		.bLength		= sizeof(struct usb_bos_plat_cap_hdr) + sizeof(struct usb_bos_msos20_desc_set),
+		.bDescriptorType	= USB_DT_DEV_CAP,
+		.bDevCapabilityType	= 5, /* PLATFORM */
+		.bReserved		= 0,
+		.PlatformCapabilityUUID	= MSOS20_PLAT_CAP_UUID,
+	},
+	.cap_data = {
+		.dwWindowsVersion		= MSOS20_WIN_VER_8_1,
+		.wMSOSDescriptorSetTotalLength	= sizeof(_dfu_msos20_desc),
+		.bMS_VendorCode			= MSOS20_MS_VENDOR_CODE,
+		.bAltEnumCode			= 0x00,
+	},
+};
+
+const struct msos20_desc_set_hdr * const dfu_msos20_desc = &_dfu_msos20_desc.hdr;
+
 #include "usb_str_dfu.gen.h"
 
 const struct usb_stack_descriptors dfu_stack_desc = {
 	.dev    = &_dev_desc,
-	.bos    = &msos20_winusb_bos,
+	.bos    = &_dfu_bos_desc.bos,
 	.conf   = _conf_desc_array,
 	.n_conf = num_elem(_conf_desc_array),
 	.str    = _str_desc_array,
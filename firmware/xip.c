@@ -0,0 +1,65 @@
+/*
+ * xip.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "spi.h"
+#include "xip.h"
+
+
+struct xip {
+	uint32_t cfg;
+	uint32_t hits;
+	uint32_t misses;
+} __attribute__((packed,aligned(4)));
+
+#define XIP_CFG_FLUSH		(1 << 31)
+#define XIP_CFG_DUMMY(n)	((n) << 12)
+#define XIP_CFG_IO(io)		((io) << 8)
+#define XIP_CFG_OPCODE(op)	((op) << 0)
+
+/* Registers are in the upper half of the window */
+static volatile struct xip * const xip_regs = (void*)(XIP_BASE + (1 << 23));
+
+
+void
+xip_init(void)
+{
+	const struct flash_info *fi = flash_get_info();
+
+	/* Same read mode as flash_read(), dummy counted in bytes */
+	xip_regs->cfg =
+		XIP_CFG_FLUSH |
+		XIP_CFG_DUMMY(fi->read.dummy >> (3 - fi->read.io)) |
+		XIP_CFG_IO(fi->read.io) |
+		XIP_CFG_OPCODE(fi->read.opcode);
+
+	xip_stats(NULL, NULL, true);
+}
+
+void
+xip_flush(void)
+{
+	xip_regs->cfg |= XIP_CFG_FLUSH;
+}
+
+void
+xip_stats(uint32_t *hits, uint32_t *misses, bool clear)
+{
+	if (hits)
+		*hits = xip_regs->hits;
+	if (misses)
+		*misses = xip_regs->misses;
+
+	if (clear) {
+		xip_regs->hits   = 0;
+		xip_regs->misses = 0;
+	}
+}
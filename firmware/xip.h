@@ -0,0 +1,28 @@
+/*
+ * xip.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Flash contents, read only, through the cache. The SPI master is shared
+ * with the cache refills : code using spi.c (or the boot DMA) must not
+ * run from there, and the flash must not be busy (program / erase) when
+ * it's accessed. */
+#define XIP_FLASH(addr)		((const void *)(XIP_BASE + (addr)))
+#define XIP_FLASH_SIZE		(8 << 20)
+
+/* Code run from flash to spare SPRAM, same constraints. Only for cold
+ * code not touching the flash itself (init, reports, ...) */
+#define __xip			__attribute__((section(".xip.text"), noinline))
+
+void xip_init(void);
+void xip_flush(void);
+void xip_stats(uint32_t *hits, uint32_t *misses, bool clear);
@@ -15,7 +15,7 @@ ICE40_LIBS ?= $(shell yosys-config --datdir/ice40/cells_sim.v)
 
 
 # Must be first rule and call it 'all' by convention
-all: sim
+all: sim check
 
 # Base directories
 ifeq ($(origin NO2BUILD_DIR), undefined)
@@ -62,8 +62,16 @@ $(BUILD_TMP)/%_tb: sim/%_tb.v $(ICE40_LIBS) $(CORE_ALL_PREREQ) $(CORE_ALL_RTL_SR
 # Action targets
 sim: $(addprefix $(BUILD_TMP)/, $(TESTBENCHES_$(THIS_CORE)))
 
+# Self checking testbenches, they print PASS when all went well
+check: $(addprefix $(BUILD_TMP)/, $(CHECKS_$(THIS_CORE)))
+	@for tb in $(CHECKS_$(THIS_CORE)); do \
+		echo -n "$$tb : "; \
+		( cd $(BUILD_TMP) && ./$$tb > $$tb.log ) && grep -q '^PASS' $(BUILD_TMP)/$$tb.log && echo OK || \
+			{ echo FAIL; cat $(BUILD_TMP)/$$tb.log; exit 1; }; \
+	done
+
 clean:
 	@rm -Rf $(BUILD_TMP)
 
 
-.PHONY: all sim clean
+.PHONY: all sim check clean
@@ -12,6 +12,7 @@ RTL_SRCS_no2misc = $(addprefix rtl/, \
 	pdm.v \
 	pwm.v \
 	ram_sdp.v \
+	spi_master_wb.v \
 	stream2wb.v \
 	uart2wb.v \
 	uart_rx.v \
@@ -24,6 +25,10 @@ RTL_SRCS_no2misc = $(addprefix rtl/, \
 TESTBENCHES_no2misc := \
 	fifo_tb \
 	pdm_tb \
+	spi_master_tb \
 	uart_tb \
 
+CHECKS_no2misc := \
+	spi_master_tb \
+
 include $(NO2BUILD_DIR)/core-magic.mk
@@ -0,0 +1,510 @@
+/*
+ * spi_master_wb.v
+ *
+ * vim: ts=4 sw=4
+ *
+ * SPI master (mode 0, MSB first) with 32 bits wide TX/RX FIFOs so that
+ * each bus access moves four bytes, and a command register to run
+ * transfers of up to 64k bytes without CPU intervention.
+ *
+ * Each command can use 1, 2 or 4 data lines, which allows the fast
+ * dual / quad read modes of SPI flash to be used.
+ *
+ * A flash sequencer can also run a full "WREN + command + poll WIP"
+ * write / erase sequence on CS 0 without any CPU intervention.
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: CERN-OHL-P-2.0
+ */
+
+`default_nettype none
+
+module spi_master_wb #(
+	parameter integer N_CS = 1,
+	parameter integer FIFO_DEPTH = 256,
+	parameter integer QUAD_IO = 0,
+
+	// auto
+	parameter integer CL = N_CS - 1
+)(
+	// SPI
+	output wire [ 3:0] spi_io_o,
+	output wire [ 3:0] spi_io_oe,
+	input  wire [ 3:0] spi_io_i,
+	output wire        spi_clk,
+	output wire [CL:0] spi_csn,
+
+	// Bus interface
+	input  wire [ 1:0] wb_addr,
+	output wire [31:0] wb_rdata,
+	input  wire [31:0] wb_wdata,
+	input  wire        wb_we,
+	input  wire        wb_cyc,
+	output wire        wb_ack,
+
+	// Clock / Reset
+	input  wire clk,
+	input  wire rst
+);
+
+	// Signals
+	// -------
+
+	// TX fifo
+	wire [31:0] tf_wdata;
+	wire        tf_wren;
+	wire        tf_full;
+	wire [31:0] tf_rdata;
+	wire        tf_rden;
+	wire        tf_empty;
+
+	// RX fifo
+	wire [31:0] rf_wdata;
+	wire        rf_wren;
+	wire        rf_full;
+	wire [31:0] rf_rdata;
+	wire        rf_rden;
+	wire        rf_empty;
+	reg         rf_pend;
+
+	// Config
+	reg  [ 7:0] cfg_div;
+	reg  [CL:0] cfg_cs;
+
+	// Command
+	reg  [16:0] cmd_cnt;	// Bytes left to start
+	reg         cmd_tx;
+	reg         cmd_rx;
+	reg  [ 1:0] cmd_w;
+	reg         cmd_ib;		// Bytes from the sequencer
+	wire        cmd_start;
+	wire [31:0] cmd_word;
+	wire        cmd_last;
+
+	// Flash sequencer
+	localparam [2:0]
+		SS_IDLE = 0,
+		SS_WREN = 1,
+		SS_OP   = 2,
+		SS_POLL = 3,
+		SS_WAIT = 4,
+		SS_GAP  = 5;
+
+	reg  [ 2:0] seq_state;
+	reg  [ 2:0] seq_next;
+	reg         seq_poll;
+	reg  [15:0] seq_len;
+	reg  [ 7:0] seq_byte;
+	reg  [ 7:0] seq_sr;
+	reg  [ 1:0] seq_gap;
+	reg  [CL:0] seq_cs;
+	reg         seq_done;
+	reg         seq_rej;
+	wire        seq_run;
+	wire        seq_start;
+	wire        seq_cmd_start;
+	reg  [31:0] seq_cmd_word;
+
+	// Shifter
+	reg         sh_run;
+	reg         sh_last;
+	reg  [ 7:0] sh_div;
+	reg         sh_phase;
+	reg  [ 2:0] sh_bit;
+	wire [ 2:0] sh_bit_last;
+	reg  [ 7:0] sh_out;
+	reg  [ 7:0] sh_in;
+	wire        sh_tick;
+	wire        sh_load;
+	wire        sh_end;
+
+	reg  [ 1:0] tx_bsel;
+	reg  [ 1:0] rx_bsel;
+	reg  [31:0] rx_word;
+
+	wire        busy;
+
+	reg  [ 3:0] io_o;
+	reg  [ 3:0] io_oe;
+
+	// Bus IF
+	reg         bus_rdy;
+	reg         bus_ack;
+	reg  [31:0] bus_rdata;
+	reg         bus_rd_data;
+	reg         bus_wr_data;
+	reg         bus_wr_cmd;
+	reg         bus_wr_csr;
+	reg         bus_wr_seq;
+
+
+	// FIFOs
+	// -----
+
+	fifo_sync_ram #(
+		.DEPTH(FIFO_DEPTH),
+		.WIDTH(32)
+	) tx_fifo_I (
+		.wr_data  (tf_wdata),
+		.wr_ena   (tf_wren),
+		.wr_full  (tf_full),
+		.rd_data  (tf_rdata),
+		.rd_ena   (tf_rden),
+		.rd_empty (tf_empty),
+		.clk      (clk),
+		.rst      (rst)
+	);
+
+	fifo_sync_ram #(
+		.DEPTH(FIFO_DEPTH),
+		.WIDTH(32)
+	) rx_fifo_I (
+		.wr_data  (rf_wdata),
+		.wr_ena   (rf_wren),
+		.wr_full  (rf_full),
+		.rd_data  (rf_rdata),
+		.rd_ena   (rf_rden),
+		.rd_empty (rf_empty),
+		.clk      (clk),
+		.rst      (rst)
+	);
+
+
+	// Command
+	// -------
+
+	// Commands come either from the bus or from the sequencer, never both
+	// at once since bus commands are dropped while the sequencer runs
+	assign cmd_start = (bus_ack & bus_wr_cmd & ~seq_run) | seq_cmd_start;
+	assign cmd_word  = seq_cmd_start ? seq_cmd_word : wb_wdata;
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			cmd_cnt <= 17'd0;
+		else if (cmd_start)
+			cmd_cnt <= { 1'b0, cmd_word[15:0] } + 17'd1;
+		else if (sh_load)
+			cmd_cnt <= cmd_cnt - 1;
+
+	always @(posedge clk or posedge rst)
+		if (rst) begin
+			cmd_tx <= 1'b0;
+			cmd_rx <= 1'b0;
+			cmd_w  <= 2'b00;
+			cmd_ib <= 1'b0;
+		end else if (cmd_start) begin
+			cmd_tx <= cmd_word[30];
+			cmd_rx <= cmd_word[31];
+			cmd_w  <= cmd_word[29:28];
+			cmd_ib <= seq_cmd_start & ~cmd_word[30];
+		end
+
+	assign cmd_last = (cmd_cnt == 17'd1);
+
+	assign busy = (cmd_cnt != 17'd0) | sh_run;
+
+
+	// Shifter
+	// -------
+
+	// Start next byte when data (or room for it) is available. Don't
+	// start in the same cycle a word is pushed to the RX FIFO so that
+	// the full flag is up to date.
+	assign sh_load = (cmd_cnt != 17'd0) & (~sh_run | sh_end) &
+		(~cmd_tx | ~tf_empty) &
+		(~cmd_rx | (~rf_full & ~rf_wren));
+
+	// Each half bit lasts 'div + 1' cycles
+	assign sh_tick = (sh_div == 8'h00);
+
+	always @(posedge clk)
+		if (sh_load | ~sh_run | sh_tick)
+			sh_div <= cfg_div;
+		else
+			sh_div <= sh_div - 1;
+
+	// Phase 0: SCK low, phase 1: SCK high
+	// A byte is 8 (x1), 4 (x2) or 2 (x4) clocks
+	assign sh_bit_last = { (cmd_w == 2'b00), ~cmd_w[1], 1'b1 };
+	assign sh_end = sh_run & sh_tick & sh_phase & (sh_bit == sh_bit_last);
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			sh_run <= 1'b0;
+		else
+			sh_run <= sh_load | (sh_run & ~sh_end);
+
+	always @(posedge clk)
+		if (sh_load) begin
+			sh_phase <= 1'b0;
+			sh_bit   <= 3'b000;
+			sh_last  <= cmd_last;
+		end else if (sh_run & sh_tick) begin
+			sh_phase <= ~sh_phase;
+			sh_bit   <= sh_bit + sh_phase;
+		end
+
+	// Data out changes on falling edge, data in sampled on rising edge
+	// (sequencer commands only send their first byte, then 0x00)
+	always @(posedge clk)
+		if (sh_load)
+			sh_out <= cmd_tx ? tf_rdata[8*tx_bsel+:8] :
+				((cmd_ib & (tx_bsel == 2'b00)) ? seq_byte : 8'h00);
+		else if (sh_run & sh_tick & sh_phase)
+			case (cmd_w)
+				2'b01:   sh_out <= { sh_out[5:0], 2'b00 };
+				2'b10:   sh_out <= { sh_out[3:0], 4'h0 };
+				default: sh_out <= { sh_out[6:0], 1'b0 };
+			endcase
+
+	always @(posedge clk)
+		if (sh_run & sh_tick & ~sh_phase)
+			case (cmd_w)
+				2'b01:   sh_in <= { sh_in[5:0], spi_io_i[1:0] };
+				2'b10:   sh_in <= { sh_in[3:0], spi_io_i[3:0] };
+				default: sh_in <= { sh_in[6:0], spi_io_i[1] };
+			endcase
+
+	// TX words are consumed LSB first
+	always @(posedge clk)
+		if (cmd_start)
+			tx_bsel <= 2'b00;
+		else if (sh_load)
+			tx_bsel <= tx_bsel + 1;
+
+	assign tf_rden = sh_load & cmd_tx & ((tx_bsel == 2'b11) | cmd_last);
+
+	// RX words are assembled LSB first
+	always @(posedge clk)
+		if (cmd_start)
+			rx_bsel <= 2'b00;
+		else if (sh_end)
+			rx_bsel <= rx_bsel + 1;
+
+	always @(posedge clk)
+		if (sh_end)
+			rx_word[8*rx_bsel+:8] <= sh_in;
+
+	assign rf_wdata = {
+		(rx_bsel == 2'b11) ? sh_in : rx_word[31:24],
+		(rx_bsel == 2'b10) ? sh_in : rx_word[23:16],
+		(rx_bsel == 2'b01) ? sh_in : rx_word[15: 8],
+		(rx_bsel == 2'b00) ? sh_in : rx_word[ 7: 0]
+	};
+
+	assign rf_wren = sh_end & cmd_rx & ((rx_bsel == 2'b11) | sh_last);
+
+	// A word written to the RX FIFO only shows up at its output two
+	// cycles later, after 'busy' already dropped for the last one
+	always @(posedge clk or posedge rst)
+		if (rst)
+			rf_pend <= 1'b0;
+		else
+			rf_pend <= rf_wren | (rf_pend & rf_empty);
+
+
+	// Flash sequencer
+	// ---------------
+
+	// Runs (optionally) WREN, then the command whose bytes are in the
+	// TX FIFO, then (optionally) polls SR1 until WIP is clear. Each step
+	// is its own transaction on CS 0, with a few cycles of CS high
+	// between them.
+	always @(posedge clk or posedge rst)
+		if (rst) begin
+			seq_state <= SS_IDLE;
+			seq_next  <= SS_IDLE;
+			seq_cs    <= 0;
+			seq_done  <= 1'b0;
+		end else begin
+			case (seq_state)
+				SS_IDLE:
+					if (seq_start) begin
+						seq_state <= wb_wdata[31] ? SS_WREN : SS_OP;
+						seq_done  <= 1'b0;
+					end
+
+				SS_WREN: begin
+					seq_state <= SS_WAIT;
+					seq_next  <= SS_OP;
+					seq_cs    <= 1;
+				end
+
+				SS_OP: begin
+					seq_state <= SS_WAIT;
+					seq_next  <= seq_poll ? SS_POLL : SS_IDLE;
+					seq_cs    <= 1;
+				end
+
+				SS_POLL: begin
+					seq_state <= SS_WAIT;
+					seq_next  <= SS_POLL;
+					seq_cs    <= 1;
+				end
+
+				SS_WAIT:
+					if (~busy) begin
+						seq_state <= SS_GAP;
+						seq_cs    <= 0;
+						if ((seq_next == SS_POLL) & cmd_ib & ~seq_sr[0])
+							seq_next <= SS_IDLE;
+					end
+
+				SS_GAP:
+					if (seq_gap == 2'b00) begin
+						seq_state <= seq_next;
+						seq_done  <= (seq_next == SS_IDLE);
+					end
+
+				default:
+					seq_state <= SS_IDLE;
+			endcase
+		end
+
+	always @(posedge clk)
+		if (seq_state != SS_GAP)
+			seq_gap <= 2'b11;
+		else
+			seq_gap <= seq_gap - 1;
+
+	always @(posedge clk)
+		if (seq_start) begin
+			seq_poll <= wb_wdata[30];
+			seq_len  <= wb_wdata[15:0];
+		end
+
+	always @(posedge clk)
+		if (seq_state == SS_WREN)
+			seq_byte <= 8'h06;
+		else if (seq_state == SS_POLL)
+			seq_byte <= 8'h05;
+
+	// SR1 is the second byte of the poll command
+	always @(posedge clk or posedge rst)
+		if (rst)
+			seq_sr <= 8'h00;
+		else if (sh_end & cmd_ib & (rx_bsel == 2'b01))
+			seq_sr <= sh_in;
+
+	always @(*)
+		case (seq_state)
+			SS_WREN: seq_cmd_word = 32'h00000000;				// 1 byte
+			SS_OP:   seq_cmd_word = { 16'h4000, seq_len };		// TX from FIFO
+			SS_POLL: seq_cmd_word = 32'h00000001;				// 2 bytes, SR1 in the 2nd
+			default: seq_cmd_word = 32'hxxxxxxxx;
+		endcase
+
+	assign seq_cmd_start = (seq_state == SS_WREN) | (seq_state == SS_OP) | (seq_state == SS_POLL);
+	assign seq_run = (seq_state != SS_IDLE);
+
+	// Register writes that had to be dropped because a sequence was
+	// running, until the next sequence starts
+	always @(posedge clk or posedge rst)
+		if (rst)
+			seq_rej <= 1'b0;
+		else if (seq_start)
+			seq_rej <= 1'b0;
+		else if (bus_ack & (bus_wr_csr | bus_wr_cmd | bus_wr_seq) & seq_run)
+			seq_rej <= 1'b1;
+
+
+	// IOs
+	// ---
+
+	// The mode of the last command is kept when idle so that lines
+	// released for a dummy / read phase stay released until the next
+	// command. IO2 / IO3 (WP# / HOLD#) are held high outside of x4.
+	always @(*)
+		case (cmd_w)
+			2'b01: begin
+				io_o  = { 2'b11, sh_out[7:6] };
+				io_oe = { 2'b11, cmd_tx, cmd_tx };
+			end
+
+			2'b10: begin
+				io_o  = sh_out[7:4];
+				io_oe = { 4{cmd_tx} };
+			end
+
+			default: begin
+				io_o  = { 2'b11, 1'b0, sh_out[7] };
+				io_oe = 4'b1101;
+			end
+		endcase
+
+	assign spi_io_o  = io_o;
+	assign spi_io_oe = io_oe;
+	assign spi_clk   = sh_run & sh_phase;
+	assign spi_csn   = ~(seq_run ? seq_cs : cfg_cs);
+
+
+	// Bus interface
+	// -------------
+
+	// Commands wait for the previous one to be done, data writes for
+	// room in the TX FIFO and data reads for data in the RX FIFO (as
+	// long as a transfer is running or a word is on its way in). A sequence can run for as long as
+	// an erase, so nothing waits for it : CSR, command and sequencer
+	// writes are acked right away and dropped while it runs (flagged in
+	// the sequencer status), software must poll for it to be done.
+	always @(*)
+		case (wb_addr)
+			2'b00:   bus_rdy = 1'b1;
+			2'b01:   bus_rdy = ~busy | seq_run;
+			2'b10:   bus_rdy = wb_we ? ~tf_full : (~rf_empty | (~busy & ~rf_pend) | seq_run);
+			2'b11:   bus_rdy = ~wb_we | ~busy | seq_run;
+			default: bus_rdy = 1'b1;
+		endcase
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			bus_ack <= 1'b0;
+		else
+			bus_ack <= wb_cyc & ~bus_ack & bus_rdy;
+
+	always @(posedge clk)
+		if (bus_ack) begin
+			bus_rd_data <= 1'b0;
+			bus_wr_data <= 1'b0;
+			bus_wr_cmd  <= 1'b0;
+			bus_wr_csr  <= 1'b0;
+			bus_wr_seq  <= 1'b0;
+		end else begin
+			bus_rd_data <= wb_cyc & ~wb_we & (wb_addr == 2'b10);
+			bus_wr_data <= wb_cyc &  wb_we & (wb_addr == 2'b10);
+			bus_wr_cmd  <= wb_cyc &  wb_we & (wb_addr == 2'b01);
+			bus_wr_csr  <= wb_cyc &  wb_we & (wb_addr == 2'b00);
+			bus_wr_seq  <= wb_cyc &  wb_we & (wb_addr == 2'b11);
+		end
+
+	always @(posedge clk)
+		if (bus_ack | wb_we | ~wb_cyc)
+			bus_rdata <= 32'h00000000;
+		else
+			case (wb_addr)
+				2'b00:   bus_rdata <= { busy, rf_empty, tf_full, tf_empty, 3'b000, (QUAD_IO != 0), { (8-N_CS){1'b0} }, cfg_cs, 8'h00, cfg_div };
+				2'b10:   bus_rdata <= rf_rdata;
+				2'b11:   bus_rdata <= { seq_run, seq_done, seq_rej, 21'h000000, seq_sr };
+				default: bus_rdata <= 32'h00000000;
+			endcase
+
+	always @(posedge clk or posedge rst)
+		if (rst) begin
+			cfg_div <= 8'h01;
+			cfg_cs  <= 0;
+		end else if (bus_ack & bus_wr_csr & ~seq_run) begin
+			cfg_div <= wb_wdata[7:0];
+			cfg_cs  <= wb_wdata[16+:N_CS];
+		end
+
+	assign seq_start = bus_ack & bus_wr_seq & ~seq_run;
+
+	assign tf_wdata = wb_wdata;
+	assign tf_wren  = bus_ack & bus_wr_data;
+
+	assign rf_rden  = bus_ack & bus_rd_data & ~rf_empty;
+
+	assign wb_rdata = bus_rdata;
+	assign wb_ack   = bus_ack;
+
+endmodule // spi_master_wb
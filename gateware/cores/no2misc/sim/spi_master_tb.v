@@ -0,0 +1,364 @@
+/*
+ * spi_master_tb.v
+ *
+ * vim: ts=4 sw=4
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: CERN-OHL-P-2.0
+ */
+
+`default_nettype none
+`timescale 1ns / 100ps
+
+module spi_master_tb;
+
+	// Signals
+	reg rst = 1'b1;
+	reg clk = 1'b0;
+
+	wire [3:0] spi_io_o;
+	wire [3:0] spi_io_oe;
+	wire [3:0] spi_io_i;
+	wire spi_clk;
+	wire spi_csn;
+
+	reg  [ 1:0] wb_addr;
+	wire [31:0] wb_rdata;
+	reg  [31:0] wb_wdata;
+	reg         wb_we;
+	reg         wb_cyc;
+	wire        wb_ack;
+
+	// Setup recording
+	initial begin
+		$dumpfile("spi_master_tb.vcd");
+		$dumpvars(0,spi_master_tb);
+	end
+
+	// Reset pulse
+	initial begin
+		# 200 rst = 0;
+		# 1000000 $display("FAIL: timeout");
+		$fatal(1);
+	end
+
+	// Clocks
+	always #10 clk = !clk;
+
+	// DUT
+	spi_master_wb #(
+		.N_CS(1),
+		.FIFO_DEPTH(4),
+		.QUAD_IO(1)
+	) dut_I (
+		.spi_io_o  (spi_io_o),
+		.spi_io_oe (spi_io_oe),
+		.spi_io_i  (spi_io_i),
+		.spi_clk   (spi_clk),
+		.spi_csn   (spi_csn),
+		.wb_addr   (wb_addr),
+		.wb_rdata  (wb_rdata),
+		.wb_wdata  (wb_wdata),
+		.wb_we     (wb_we),
+		.wb_cyc    (wb_cyc),
+		.wb_ack    (wb_ack),
+		.clk       (clk),
+		.rst       (rst)
+	);
+
+	// Loopback (MOSI to MISO in x1, each line to itself in x2 / x4),
+	// except for the flash status register reads
+	wire fm_miso;
+
+	assign spi_io_i = spi_io_oe[1] ? spi_io_o : { 2'b11, fm_miso, 1'b0 };
+
+	// Flash model : logs the bytes (x1) and timing of each transaction,
+	// and answers SR1 reads ('05') with WIP set for the first few ones
+	localparam integer SCK_PERIOD = 80;		// div = 1 : 4 clk cycles
+
+	reg  [ 7:0] fm_byte;
+	reg  [ 2:0] fm_bit;
+	reg  [ 7:0] fm_sr;
+	reg         fm_sr_on;
+	integer     fm_n;
+	integer     fm_xact  = 0;
+	integer     fm_log_n = 0;
+	integer     fm_busy  = 0;
+	reg  [ 7:0] fm_log[0:255];
+	integer     fm_len[0:31];
+	integer     fm_gap_min;
+	integer     fm_sck_err = 0;
+	time        fm_t_sck;
+	time        fm_t_cs;
+
+	assign fm_miso = fm_sr_on ? fm_sr[7] : spi_io_o[0];
+
+	always @(negedge spi_csn)
+	begin
+		if ((fm_xact > 0) && (($time - fm_t_cs) < fm_gap_min))
+			fm_gap_min = $time - fm_t_cs;
+		fm_bit   = 0;
+		fm_n     = 0;
+		fm_sr_on = 1'b0;
+	end
+
+	always @(posedge spi_csn)
+	begin
+		fm_len[fm_xact] = fm_n;
+		fm_xact = fm_xact + 1;
+		fm_t_cs = $time;
+	end
+
+	always @(posedge spi_clk)
+	begin
+		// Bits within a byte must come at the configured rate
+		if ((fm_bit != 0) && (($time - fm_t_sck) != SCK_PERIOD))
+			fm_sck_err = fm_sck_err + 1;
+		fm_t_sck = $time;
+
+		// Status bit was just sampled, move to the next
+		if (fm_sr_on)
+			fm_sr = { fm_sr[6:0], 1'b0 };
+
+		fm_byte = { fm_byte[6:0], spi_io_o[0] };
+		fm_bit  = fm_bit + 1;
+
+		if (fm_bit == 0) begin
+			fm_log[fm_log_n] = fm_byte;
+			fm_log_n = fm_log_n + 1;
+
+			if ((fm_n == 0) && (fm_byte == 8'h05)) begin
+				fm_sr_on = 1'b1;
+				fm_sr    = (fm_busy > 0) ? 8'h03 : 8'h00;
+				fm_busy  = fm_busy - 1;
+			end
+
+			fm_n = fm_n + 1;
+		end
+	end
+
+	// Bus access
+	integer wb_cycles;
+
+	task wb_write;
+		input [ 1:0] addr;
+		input [31:0] data;
+		begin
+			wb_addr  <= addr;
+			wb_wdata <= data;
+			wb_we    <= 1'b1;
+			wb_cyc   <= 1'b1;
+
+			wb_cycles = 1;
+			@(posedge clk);
+			while (~wb_ack) begin
+				wb_cycles = wb_cycles + 1;
+				@(posedge clk);
+			end
+
+			wb_addr  <= 2'bxx;
+			wb_wdata <= 32'hxxxxxxxx;
+			wb_we    <= 1'bx;
+			wb_cyc   <= 1'b0;
+		end
+	endtask
+
+	task wb_read;
+		input  [ 1:0] addr;
+		output [31:0] data;
+		begin
+			wb_addr  <= addr;
+			wb_we    <= 1'b0;
+			wb_cyc   <= 1'b1;
+
+			@(posedge clk);
+			while (~wb_ack)
+				@(posedge clk);
+
+			data = wb_rdata;
+
+			wb_addr  <= 2'bxx;
+			wb_we    <= 1'bx;
+			wb_cyc   <= 1'b0;
+		end
+	endtask
+
+	// Stimulus
+	reg [31:0] rv;
+	integer    x0, l0, i;
+	integer    n_err = 0;
+
+	// Expected sequence transactions : WREN, command, 3 polls
+	reg [7:0] seq_exp[0:14];
+
+	initial begin
+		seq_exp[ 0] = 8'h06;
+		seq_exp[ 1] = 8'h02; seq_exp[ 2] = 8'h00; seq_exp[ 3] = 8'h10; seq_exp[ 4] = 8'h00;
+		seq_exp[ 5] = 8'hef; seq_exp[ 6] = 8'hbe; seq_exp[ 7] = 8'had; seq_exp[ 8] = 8'hde;
+		seq_exp[ 9] = 8'h05; seq_exp[10] = 8'h00;
+		seq_exp[11] = 8'h05; seq_exp[12] = 8'h00;
+		seq_exp[13] = 8'h05; seq_exp[14] = 8'h00;
+	end
+
+	initial begin
+		// Defaults
+		wb_addr  <= 2'bxx;
+		wb_wdata <= 32'hxxxxxxxx;
+		wb_we    <= 1'bx;
+		wb_cyc   <= 1'b0;
+
+		@(negedge rst);
+		@(posedge clk);
+
+		// Select, div = 1
+		wb_write(2'b00, 32'h00010001);
+
+		// 6 bytes, TX + RX, looped back
+		wb_write(2'b01, 32'hc0000005);
+		wb_write(2'b10, 32'h04030201);
+		wb_write(2'b10, 32'hxxxx0605);
+
+		wb_read(2'b10, rv);
+		if (rv != 32'h04030201) begin
+			$display("ERROR: RX word 0 mismatch: %08x", rv);
+			n_err = n_err + 1;
+		end
+
+		wb_read(2'b10, rv);
+		if (rv[15:0] != 16'h0605) begin
+			$display("ERROR: RX word 1 mismatch: %08x", rv);
+			n_err = n_err + 1;
+		end
+
+		// 8 bytes, TX + RX, x4, looped back
+		wb_write(2'b01, 32'he0000007);
+		wb_write(2'b10, 32'h89abcdef);
+		wb_write(2'b10, 32'h01234567);
+
+		wb_read(2'b10, rv);
+		if (rv != 32'h89abcdef) begin
+			$display("ERROR: RX x4 word 0 mismatch: %08x", rv);
+			n_err = n_err + 1;
+		end
+
+		wb_read(2'b10, rv);
+		if (rv != 32'h01234567) begin
+			$display("ERROR: RX x4 word 1 mismatch: %08x", rv);
+			n_err = n_err + 1;
+		end
+
+		// 16 bytes, TX only
+		wb_write(2'b01, 32'h4000000f);
+		wb_write(2'b10, 32'h11111111);
+		wb_write(2'b10, 32'h22222222);
+		wb_write(2'b10, 32'h33333333);
+		wb_write(2'b10, 32'h44444444);
+
+		// Wait for it to be done and release
+		wb_read(2'b00, rv);
+		while (rv[31])
+			wb_read(2'b00, rv);
+
+		wb_write(2'b00, 32'h00000001);
+
+		// Sequence : WREN, 8 bytes command, poll (WIP for 2 polls)
+		x0 = fm_xact;
+		l0 = fm_log_n;
+		fm_busy = 2;
+		fm_gap_min = 1000000;
+		fm_sck_err = 0;
+
+		wb_write(2'b11, 32'hc0000007);
+		wb_write(2'b10, 32'h00100002);
+		wb_write(2'b10, 32'hdeadbeef);
+
+		// Register writes while it runs : no bus stall, dropped and flagged
+		wb_read(2'b11, rv);
+		if (~rv[31]) begin
+			$display("ERROR: Sequence not running");
+			n_err = n_err + 1;
+		end
+
+		wb_write(2'b00, 32'h00010003);
+		if (wb_cycles > 2) begin
+			$display("ERROR: CSR write stalled %0d cycles during sequence", wb_cycles);
+			n_err = n_err + 1;
+		end
+
+		wb_write(2'b01, 32'h40000000);
+		if (wb_cycles > 2) begin
+			$display("ERROR: CMD write stalled %0d cycles during sequence", wb_cycles);
+			n_err = n_err + 1;
+		end
+
+		wb_read(2'b11, rv);
+		while (~rv[30])
+			wb_read(2'b11, rv);
+
+		if (~rv[29]) begin
+			$display("ERROR: Dropped writes not flagged");
+			n_err = n_err + 1;
+		end
+		if (rv[7:0] != 8'h00) begin
+			$display("ERROR: Sequence SR1 mismatch: %02x", rv[7:0]);
+			n_err = n_err + 1;
+		end
+
+		wb_read(2'b00, rv);
+		if ((rv[23:16] != 8'h00) || (rv[7:0] != 8'h01)) begin
+			$display("ERROR: CSR changed during sequence: %08x", rv);
+			n_err = n_err + 1;
+		end
+
+		// Check what went on the bus
+		if ((fm_xact - x0) != 5) begin
+			$display("ERROR: Sequence transaction count mismatch: %0d", fm_xact - x0);
+			n_err = n_err + 1;
+		end else if ((fm_len[x0] != 1) || (fm_len[x0+1] != 8) ||
+		         (fm_len[x0+2] != 2) || (fm_len[x0+3] != 2) || (fm_len[x0+4] != 2)) begin
+			$display("ERROR: Sequence transaction length mismatch");
+			n_err = n_err + 1;
+		end
+
+		if ((fm_log_n - l0) != 15) begin
+			$display("ERROR: Sequence byte count mismatch: %0d", fm_log_n - l0);
+			n_err = n_err + 1;
+		end else
+			for (i=0; i<15; i=i+1)
+				if (fm_log[l0+i] != seq_exp[i]) begin
+					$display("ERROR: Sequence byte %0d mismatch: %02x", i, fm_log[l0+i]);
+					n_err = n_err + 1;
+				end
+
+		if (fm_sck_err) begin
+			$display("ERROR: Sequence SCK period mismatch (%0d)", fm_sck_err);
+			n_err = n_err + 1;
+		end
+		if (fm_gap_min < (4 * 20)) begin
+			$display("ERROR: Sequence CS high gap too short: %0d ns", fm_gap_min);
+			n_err = n_err + 1;
+		end
+
+		// A new sequence clears the flag
+		wb_write(2'b11, 32'h00000000);
+		wb_write(2'b10, 32'h00000004);
+
+		wb_read(2'b11, rv);
+		if (rv[29]) begin
+			$display("ERROR: Dropped writes flag not cleared");
+			n_err = n_err + 1;
+		end
+
+		while (~rv[30])
+			wb_read(2'b11, rv);
+
+		if (n_err) begin
+			$display("FAIL: %0d error(s)", n_err);
+			$fatal(1);
+		end
+
+		$display("PASS");
+		$finish;
+	end
+
+endmodule // spi_master_tb
@@ -79,16 +79,31 @@
 /* Globals                                                                  */
 /* ------------------------------------------------------------------------ */
 
+/* Max BDs per EP */
+#if defined(NO2USB_BD_RING) && (NO2USB_BD_RING > 2)
+# define NO2USB_EP_BD_MAX NO2USB_BD_RING
+#else
+# define NO2USB_EP_BD_MAX 2
+#endif
+
 /* EP state */
 struct dcd_ep {
 	/* EP state / config */
 	uint16_t mps;		/* Max Packet Size */
 
 	bool busy;		/* xfer in progress */
-	bool dual;		/* dual bufferred */
+	bool ring;		/* BD ring mode */
+	bool xbd;		/* transfer mode BDs */
+	uint8_t nbd;		/* Number of BDs (0/1=single, 2=dual, or ring size) */
 	uint8_t bdi_fill;	/* Next buffer to fill */
 	uint8_t bdi_retire;	/* Next buffer to retire */
 
+	/* Buffer descriptors */
+	uint16_t bd_size;	/* Buffer size (mps, or more in transfer mode) */
+	uint16_t bd_ptr[NO2USB_EP_BD_MAX];	/* Buffer pointers */
+	uint16_t bd_len[NO2USB_EP_BD_MAX];	/* Length queued (OUT only) */
+	uint16_t bd_qlen;	/* Total length queued (OUT transfer mode only) */
+
 	/* Current transfer */
 	struct {
 		uint8_t *buf;	/* Buffer (NULL for ZLP) */
@@ -129,6 +144,25 @@ _ep_state(uint8_t epnum, uint8_t dir)
 	return &g_usb.ep[epnum][dir];
 }
 
+static inline volatile struct no2usb_bd *
+_ep_bd(uint8_t epnum, uint8_t dir, int bdi)
+{
+	volatile struct no2usb_ep_ring_pair *rp;
+
+	if (!g_usb.ep[epnum][dir].ring)
+		return &_ep_regs(epnum, dir)->bd[bdi];
+
+	rp = &no2usb_ep_ring_regs[((bdi >> 2) << 4) | epnum];
+	return (dir == TUSB_DIR_OUT) ? &rp->out.bd[bdi & 3] : &rp->in.bd[bdi & 3];
+}
+
+static inline uint8_t
+_ep_bdi_next(volatile struct dcd_ep *eps, uint8_t bdi)
+{
+	/* Wraps like the hardware does, without a modulo */
+	return (++bdi >= eps->nbd) ? 0 : bdi;
+}
+
 
 static void
 _usb_data_write(unsigned int dst_ofs, const void *src, int len)
@@ -211,8 +245,8 @@ _usb_hw_buf_alloc(uint8_t dir, int mps)
 static void
 _usb_ep_advance_xfer_in(const uint8_t epnum)
 {
-	volatile struct no2usb_ep *epr = _ep_regs(epnum, TUSB_DIR_IN);
 	volatile struct dcd_ep *eps = _ep_state(epnum, TUSB_DIR_IN);
+	volatile struct no2usb_bd *bd;
 
 	uint32_t bds;
 	int len;
@@ -221,20 +255,21 @@ _usb_ep_advance_xfer_in(const uint8_t epnum)
 	while (1)
 	{
 		/* Get BD status */
-		bds = epr->bd[eps->bdi_retire].csr;
+		bd  = _ep_bd(epnum, TUSB_DIR_IN, eps->bdi_retire);
+		bds = bd->csr;
 
 		/* Packet done ? */
 		if ((bds & NO2USB_BD_STATE_MSK) == NO2USB_BD_STATE_DONE_OK)
 		{
 			/* Reset the descriptor */
-			epr->bd[eps->bdi_retire].csr = 0;
+			bd->csr = 0;
 		}
 
 		/* Errors are not valid for TX. The HW will auto retry and never report this */
 		else if ((bds & NO2USB_BD_STATE_MSK) == NO2USB_BD_STATE_DONE_ERR)
 		{
 			/* So if it happens ... reset things and hope for the best ? */
-			epr->bd[eps->bdi_retire].csr = 0;
+			bd->csr = 0;
 
 			USB_DEBUG(L_ERROR, "NO2USB_BD_STATE_DONE_ERR on EP%d IN !", epnum);
 		}
@@ -246,7 +281,7 @@ _usb_ep_advance_xfer_in(const uint8_t epnum)
 		}
 
 		/* Next ! */
-		eps->bdi_retire ^= eps->dual;
+		eps->bdi_retire = _ep_bdi_next(eps, eps->bdi_retire);
 	}
 
 	/* If we don't have a transfer ... we have nothing to do ! */
@@ -257,24 +292,26 @@ _usb_ep_advance_xfer_in(const uint8_t epnum)
 	while (eps->busy)
 	{
 		/* Get BD status */
-		bds = epr->bd[eps->bdi_fill].csr;
+		bd  = _ep_bd(epnum, TUSB_DIR_IN, eps->bdi_fill);
+		bds = bd->csr;
 
 		/* If BD is not used, then re-fill */
 		if ((bds & NO2USB_BD_STATE_MSK) == NO2USB_BD_STATE_NONE)
 		{
 			/* Load packet in buffer */
 			if (eps->xfer.buf) {
-				/* Select packet size */
+				/* Select packet size (or chunk size in transfer mode) */
 				eps->xfer.plen = eps->xfer.len - eps->xfer.ofs;
-				if (eps->xfer.plen > eps->mps)
-					eps->xfer.plen = eps->mps;
+				if (eps->xfer.plen > eps->bd_size)
+					eps->xfer.plen = eps->bd_size;
 
 				/* Fill data buffer */
-				_usb_data_write(epr->bd[eps->bdi_fill].ptr, &eps->xfer.buf[eps->xfer.ofs], eps->xfer.plen);
+				_usb_data_write(eps->bd_ptr[eps->bdi_fill], &eps->xfer.buf[eps->xfer.ofs], eps->xfer.plen);
 			}
 
-			/* Submit packet */
-			epr->bd[eps->bdi_fill].csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->xfer.plen);
+			/* Submit packet (the core advances the pointer in transfer mode) */
+			bd->ptr = eps->bd_ptr[eps->bdi_fill];
+			bd->csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->xfer.plen);
 
 			/* Advance the transfer, and maybe finish it */
 			eps->xfer.ofs += eps->xfer.plen;
@@ -301,24 +338,26 @@ _usb_ep_advance_xfer_in(const uint8_t epnum)
 		}
 
 		/* Next ! */
-		eps->bdi_fill ^= eps->dual;
+		eps->bdi_fill = _ep_bdi_next(eps, eps->bdi_fill);
 	}
 }
 
 static void
 _usb_ep_advance_xfer_out(const uint8_t epnum)
 {
-	volatile struct no2usb_ep *epr = _ep_regs(epnum, TUSB_DIR_OUT);
 	volatile struct dcd_ep *eps = _ep_state(epnum, TUSB_DIR_OUT);
+	volatile struct no2usb_bd *bd;
 
 	uint32_t bds;
-	int len;
+	int len, rxlen;
+	bool rxshort;
 
 	/* Retire done descriptors */
 	while (1)
 	{
 		/* Get BD status */
-		bds = epr->bd[eps->bdi_retire].csr;
+		bd  = _ep_bd(epnum, TUSB_DIR_OUT, eps->bdi_retire);
+		bds = bd->csr;
 
 		/* Packet done ? */
 		if ((bds & NO2USB_BD_STATE_MSK) == NO2USB_BD_STATE_DONE_OK)
@@ -327,22 +366,32 @@ _usb_ep_advance_xfer_out(const uint8_t epnum)
 			if (!eps->busy)
 				break;
 
-			/* Get packet length */
-			eps->xfer.plen = (bds & NO2USB_BD_LEN_MSK) - 2;
+			/* Get received length. In transfer mode, the BD has the
+			 * length left and ends early on a short packet */
+			if (eps->xbd) {
+				rxlen   = eps->bd_len[eps->bdi_retire] - (bds & NO2USB_BD_LEN_MSK);
+				rxshort = rxlen < eps->bd_len[eps->bdi_retire];
+				eps->bd_qlen -= eps->bd_len[eps->bdi_retire];
+			} else {
+				rxlen   = (bds & NO2USB_BD_LEN_MSK) - 2;
+				rxshort = rxlen < eps->mps;
+			}
+
+			eps->xfer.plen = rxlen;
 			if (eps->xfer.plen > (eps->xfer.len - eps->xfer.ofs))
 				eps->xfer.plen = eps->xfer.len - eps->xfer.ofs;
 
 			/* Reset the descriptor */
-			epr->bd[eps->bdi_retire].csr = 0;
+			bd->csr = 0;
 
 			/* Grab data from buffer (if any) */
 			if (eps->xfer.plen) {
-				_usb_data_read(&eps->xfer.buf[eps->xfer.ofs], epr->bd[eps->bdi_retire].ptr, eps->xfer.plen);
+				_usb_data_read(&eps->xfer.buf[eps->xfer.ofs], eps->bd_ptr[eps->bdi_retire], eps->xfer.plen);
 				eps->xfer.ofs += eps->xfer.plen;
 			}
 
 			/* End of transfer when requested length is reached, or a short transfer from host */
-			if ((eps->xfer.plen < eps->mps) || (eps->xfer.len == eps->xfer.ofs))
+			if (rxshort || (eps->xfer.len == eps->xfer.ofs))
 			{
 				len = eps->xfer.ofs;
 
@@ -362,7 +411,7 @@ _usb_ep_advance_xfer_out(const uint8_t epnum)
 		else if ((bds & NO2USB_BD_STATE_MSK) == NO2USB_BD_STATE_DONE_ERR)
 		{
 			/* Just retry */
-			epr->bd[0].csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->mps);
+			bd->csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->bd_len[eps->bdi_retire]);
 		}
 
 		/* Ok, current BD was neither done or error, we stop here */
@@ -372,30 +421,50 @@ _usb_ep_advance_xfer_out(const uint8_t epnum)
 		}
 
 		/* Next ! */
-		eps->bdi_retire ^= eps->dual;
+		eps->bdi_retire = _ep_bdi_next(eps, eps->bdi_retire);
 	}
 
 	/* Prepare any descriptors that's not ready */
 	while (1)
 	{
 		/* Get BD status */
-		bds = epr->bd[eps->bdi_fill].csr;
+		bd  = _ep_bd(epnum, TUSB_DIR_OUT, eps->bdi_fill);
+		bds = bd->csr;
 
 		/* Refill only if not initialized. If there is something, we're done for now */
-		/* For EP0, we don't prefill, so only init if we have a transfer pending */
-		if (((bds & NO2USB_BD_STATE_MSK) == NO2USB_BD_STATE_NONE) &&
-		    (eps->busy || (epnum != 0)))
+		if ((bds & NO2USB_BD_STATE_MSK) != NO2USB_BD_STATE_NONE)
+			break;
+
+		if (eps->xbd)
 		{
-			epr->bd[eps->bdi_fill].csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->mps);
+			/* In transfer mode, only queue what the transfer needs (at
+			 * least one packet for a ZLP), so it completes on time */
+			if (!eps->busy)
+				break;
+
+			len = (eps->xfer.len ? eps->xfer.len : eps->mps) - eps->xfer.ofs - eps->bd_qlen;
+			if (len <= 0)
+				break;
+			if (len > eps->bd_size)
+				len = eps->bd_size;
+
+			eps->bd_qlen += len;
 		}
 		else
 		{
-			/* No buffer ready to fill, we're done for now */
-			break;
+			/* For EP0, we don't prefill, so only init if we have a transfer pending */
+			if (!eps->busy && (epnum == 0))
+				break;
+
+			len = eps->mps;
 		}
 
+		eps->bd_len[eps->bdi_fill] = len;
+		bd->ptr = eps->bd_ptr[eps->bdi_fill];
+		bd->csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(len);
+
 		/* Next ! */
-		eps->bdi_fill ^= eps->dual;
+		eps->bdi_fill = _ep_bdi_next(eps, eps->bdi_fill);
 	}
 }
 
@@ -423,6 +492,11 @@ _usb_ep0_configure(void)
 	/* EP DCD config */
 	g_usb.ep[0][TUSB_DIR_IN].mps  = mps;
 	g_usb.ep[0][TUSB_DIR_OUT].mps = mps;
+
+	g_usb.ep[0][TUSB_DIR_IN].bd_size   = mps;
+	g_usb.ep[0][TUSB_DIR_OUT].bd_size  = mps;
+	g_usb.ep[0][TUSB_DIR_IN].bd_ptr[0]  = ep0r->in.bd[0].ptr;
+	g_usb.ep[0][TUSB_DIR_OUT].bd_ptr[0] = ep0r->out.bd[0].ptr;
 }
 
 static void
@@ -685,7 +759,8 @@ dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const * desc_edpt)
 	volatile struct no2usb_ep *epr = _ep_regs(epnum, dir);
 	volatile struct dcd_ep *eps = _ep_state(epnum, dir);
 	int type = 0;
-	bool dual = false;
+	int nbd;
+	bool ring = false;
 
 	/* Type */
 	switch (desc_edpt->bmAttributes.xfer) {
@@ -706,30 +781,54 @@ dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const * desc_edpt)
 		return false;
 	}
 
-	USB_DEBUG(L_INFO, "Setting up %s endpoint EP%d. type=%d dual=%d",
+	/* Bulk uses dual BDs, or a ring if the core has them */
+	nbd = (type == NO2USB_EP_TYPE_BULK) ? 2 : 1;
+#ifdef NO2USB_BD_RING
+	ring = (type == NO2USB_EP_TYPE_BULK);
+	if (ring)
+		nbd = NO2USB_BD_RING;
+#endif
+
+	USB_DEBUG(L_INFO, "Setting up %s endpoint EP%d. type=%d nbd=%d ring=%d",
 		(dir == TUSB_DIR_OUT) ? "OUT" : "IN ",
-		epnum, type, dual
+		epnum, type, nbd, ring
 	);
 
-	dual = (type == NO2USB_EP_TYPE_BULK);
-
 	/* Setup EP DCD state */
 	memset((void*)eps, 0x00, sizeof(*eps));
-	eps->mps = desc_edpt->wMaxPacketSize.size;
-	eps->dual = dual;
+	eps->mps  = desc_edpt->wMaxPacketSize.size;
+	eps->ring = ring;
+	eps->nbd  = nbd;
+#ifdef NO2USB_XFER_PKTS
+	eps->xbd = (type == NO2USB_EP_TYPE_BULK);
+	eps->bd_size = eps->xbd ? (NO2USB_XFER_PKTS * eps->mps) : eps->mps;
+#else
+	eps->bd_size = eps->mps;
+#endif
 
 	/* Setup the BDs */
-	epr->bd[0].ptr =        _usb_hw_buf_alloc(dir, eps->mps);
-	epr->bd[1].ptr = dual ? _usb_hw_buf_alloc(dir, eps->mps) : 0;
 	epr->bd[0].csr = 0;
 	epr->bd[1].csr = 0;
 
-	if (dir == TUSB_DIR_OUT) {
-		epr->bd[0].csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->mps);
-		epr->bd[1].csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->mps);
+	for (int i=0; i<nbd; i++) {
+		volatile struct no2usb_bd *bd = _ep_bd(epnum, dir, i);
+
+		eps->bd_ptr[i] = _usb_hw_buf_alloc(dir, eps->bd_size);
+
+		bd->ptr = eps->bd_ptr[i];
+		bd->csr = 0;
+
+		/* OUT prefill (transfer mode waits for a transfer to size the BDs) */
+		if ((dir == TUSB_DIR_OUT) && !eps->xbd) {
+			eps->bd_len[i] = eps->mps;
+			bd->csr = NO2USB_BD_STATE_RDY_DATA | NO2USB_BD_LEN(eps->mps);
+		}
 	}
 
-	epr->status = type | (dual ? NO2USB_EP_BD_DUAL : 0);
+	/* Enable, this also resets the ring head */
+	epr->status = type |
+		(ring ? NO2USB_EP_BD_RING : ((nbd == 2) ? NO2USB_EP_BD_DUAL : 0)) |
+		(eps->xbd ? (NO2USB_EP_XFER | NO2USB_EP_MPS(eps->mps)) : 0);
 
 	return true;
 }
@@ -840,9 +939,11 @@ dcd_edpt_debug(uint8_t rhport, uint8_t ep_addr)
 		(unsigned int)epr->status,
 		(unsigned int)epr->bd[0].csr,
 		(unsigned int)epr->bd[1].csr);
-	printf(" eps: busy=%d, dual=%d, bdi_fill=%d, bdi_retire=%d, buf=%08x, len=%d, ofs=%d, plen=%d\n",
+	printf(" eps: busy=%d, nbd=%d, ring=%d, xbd=%d, bdi_fill=%d, bdi_retire=%d, buf=%08x, len=%d, ofs=%d, plen=%d\n",
 		eps->busy,
-		eps->dual,
+		eps->nbd,
+		eps->ring,
+		eps->xbd,
 		eps->bdi_fill,
 		eps->bdi_retire,
 		(unsigned int)eps->xfer.buf,
@@ -23,3 +23,16 @@
 	/* Only enable this if the core was configured with event FIFO
 	 * enabled with at least a depth of 4 */
 /* #define NO2USB_WITH_EVENT_FIFO 1 */
+
+/* Enable/Disable transfer mode buffer descriptors for bulk endpoints */
+	/* Each BD then covers up to that many packets and the core only
+	 * generates an event at the end. This needs as many times more EP
+	 * buffer memory and at most 1023 bytes per BD */
+/* #define NO2USB_XFER_PKTS 4 */
+
+/* Enable/Disable BD rings for bulk endpoints */
+	/* Only enable this if the core was configured with the same BD_RING
+	 * (4 or 8). Each bulk endpoint then uses that many BDs instead of 2
+	 * so the core can keep going while the CPU is busy. Can be combined
+	 * with NO2USB_XFER_PKTS */
+/* #define NO2USB_BD_RING 4 */
@@ -53,13 +53,15 @@ struct no2usb_core {
 #define NO2USB_IR_BUS_RST_PENDING	(1 <<  0)
 
 
+struct no2usb_bd {
+	uint32_t csr;
+	uint32_t ptr;
+} __attribute__((packed,aligned(4)));
+
 struct no2usb_ep {
 	uint32_t status;
 	uint32_t _rsvd[3];
-	struct {
-		uint32_t csr;
-		uint32_t ptr;
-	} bd[2];
+	struct no2usb_bd bd[2];
 } __attribute__((packed,aligned(4)));
 
 struct no2usb_ep_pair {
@@ -67,6 +69,15 @@ struct no2usb_ep_pair {
 	struct no2usb_ep in;
 } __attribute__((packed,aligned(4)));
 
+struct no2usb_ep_ring {
+	struct no2usb_bd bd[4];
+} __attribute__((packed,aligned(4)));
+
+struct no2usb_ep_ring_pair {
+	struct no2usb_ep_ring out;
+	struct no2usb_ep_ring in;
+} __attribute__((packed,aligned(4)));
+
 #define NO2USB_EP_TYPE_NONE		0x0000
 #define NO2USB_EP_TYPE_ISOC		0x0001
 #define NO2USB_EP_TYPE_INT		0x0002
@@ -76,10 +87,15 @@ struct no2usb_ep_pair {
 #define NO2USB_EP_TYPE_IS_BCI(x)	(((x) & 6) != 0)
 #define NO2USB_EP_TYPE(x)		((x) & 6)
 
+#define NO2USB_EP_XFER			0x8000	/* Transfer mode BDs, needs NO2USB_EP_MPS */
+#define NO2USB_EP_MPS(x)		(((x) & 0x7f) << 8)
+#define NO2USB_EP_MPS_MSK		0x7f00
 #define NO2USB_EP_DT_BIT		0x0080
 #define NO2USB_EP_BD_IDX		0x0040
 #define NO2USB_EP_BD_CTRL		0x0020
 #define NO2USB_EP_BD_DUAL		0x0010
+#define NO2USB_EP_BD_RING		0x0008	/* Needs a core built with BD_RING */
+#define NO2USB_EP_RING_HEAD(x)		(((x) >> 4) & 7)
 
 #define NO2USB_BD_STATE_MSK		0xe000
 #define NO2USB_BD_STATE_NONE		0x0000
@@ -92,6 +108,12 @@ struct no2usb_ep_pair {
 #define NO2USB_BD_LEN(l)		((l) & 0x3ff)
 #define NO2USB_BD_LEN_MSK		0x03ff
 
+#define NO2USB_BD_PTR_ZLP		0x8000	/* Transfer mode IN only */
+#define NO2USB_BD_PTR_MSK		0x07ff
+
 
 static volatile struct no2usb_core *    const no2usb_regs    = (void*) (NO2USB_CORE_BASE);
 static volatile struct no2usb_ep_pair * const no2usb_ep_regs = (void*)((NO2USB_CORE_BASE) + (1 << 13));
+
+/* Ring BD n of EP i is in no2usb_ep_ring_regs[(n / 4) * 16 + i].{in,out}.bd[n % 4] */
+static volatile struct no2usb_ep_ring_pair * const no2usb_ep_ring_regs = (void*)((NO2USB_CORE_BASE) + (1 << 13) + (1 << 10));
@@ -7,9 +7,13 @@ HEADERS_no2usb=$(addprefix $(CORE_no2usb_DIR)/fw/v0/include/, \
 	no2usb/usb_ac_proto.h \
 	no2usb/usb_cdc_proto.h \
 	no2usb/usb_dfu.h \
+	no2usb/usb_dfu_bulk.h \
+	no2usb/usb_dfu_priv.h \
 	no2usb/usb_dfu_proto.h \
 	no2usb/usb_dfu_rt.h \
 	no2usb/usb_hw.h \
+	no2usb/usb_msc_proto.h \
+	no2usb/usb_msc_uf2.h \
 	no2usb/usb_msos20.h \
 	no2usb/usb_msos20_proto.h \
 	no2usb/usb_priv.h \
@@ -21,8 +25,10 @@ SOURCES_no2usb=$(addprefix $(CORE_no2usb_DIR)/fw/v0/src/, \
 	usb_ctrl_ep0.c \
 	usb_ctrl_std.c \
 	usb_dfu.c \
+	usb_dfu_bulk.c \
 	usb_dfu_rt.c \
 	usb_dfu_vendor.c \
+	usb_msc_uf2.c \
 	usb_msos20.c \
 )
 
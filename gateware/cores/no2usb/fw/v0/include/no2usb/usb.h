@@ -46,6 +46,7 @@ enum usb_fnd_resp {
 };
 
 typedef void (*usb_fnd_sof_cb)(void);
+typedef void (*usb_fnd_poll_cb)(void);
 typedef void (*usb_fnd_bus_reset_cb)(void);
 typedef void (*usb_fnd_state_chg_cb)(enum usb_dev_state state);
 typedef enum usb_fnd_resp (*usb_fnd_ctrl_req_cb)(struct usb_ctrl_req *req, struct usb_xfer *xfer);
@@ -56,6 +57,7 @@ typedef enum usb_fnd_resp (*usb_fnd_get_intf_cb)(const struct usb_intf_desc *bas
 struct usb_fn_drv {
 	struct usb_fn_drv *next;
         usb_fnd_sof_cb		sof;
+        usb_fnd_poll_cb		poll;
         usb_fnd_bus_reset_cb	bus_reset;
         usb_fnd_state_chg_cb	state_chg;
         usb_fnd_ctrl_req_cb	ctrl_req;
@@ -74,11 +76,19 @@ struct usb_xfer {
 	int len;
 
 	/* Call backs */
-	usb_xfer_cb cb_data;	/* Data call back */
+	usb_xfer_cb cb_data;	/* Data call back (IN only, see below) */
 	usb_xfer_cb cb_done;	/* Completion call back */
 	void *cb_ctx;
 };
 
+/* For IN control transfers, 'cb_data' allows to stream data : it's
+ * called each time data at 'ofs' is about to be needed and must fill at
+ * least the next USB_XFER_STREAM_LEN bytes (or up to 'len') of 'data'
+ * starting there. This happens while the previous packet is being sent.
+ * Returning false aborts the transfer with a STALL.
+ */
+#define USB_XFER_STREAM_LEN	64
+
 
 /* API */
 void usb_init(const struct usb_stack_descriptors *stack_desc);
@@ -107,6 +117,7 @@ bool usb_ep_resume(uint8_t ep);
 	/* EP config */
 bool usb_ep_reconf(const struct usb_intf_desc *intf, uint8_t ep_addr);
 bool usb_ep_boot(const struct usb_intf_desc *intf, uint8_t ep_addr, bool dual_bd);
+bool usb_ep_boot_ring(const struct usb_intf_desc *intf, uint8_t ep_addr);
 
 	/* Descriptors */
 const void *usb_desc_find(const void *sod, const void *eod, uint8_t dt);
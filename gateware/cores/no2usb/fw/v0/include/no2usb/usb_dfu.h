@@ -7,12 +7,68 @@
 
 #pragma once
 
+/* DNLOAD/UPLOAD block size, to be used as wTransferSize in the DFU
+ * functional descriptors. Must be a multiple of 4k, up to 32k. Two
+ * buffers of that size are allocated */
+#ifndef USB_DFU_TRANSFER_SIZE
+#define USB_DFU_TRANSFER_SIZE	4096
+#endif
+
 struct usb_dfu_zone {
 	uint32_t start;
 	uint32_t end;
 	uint32_t flags;
 };
 
+#define USB_DFU_ZONE_F_PREERASE	(1 << 0)	/* Erase whole zone in background at download start */
+#define USB_DFU_ZONE_F_COMPARE	(1 << 1)	/* Compare with flash, skip unchanged sectors (excludes PREERASE) */
+#define USB_DFU_ZONE_F_LZ	(1 << 2)	/* Accept LZ compressed payloads */
+
+/* Packed DNLOAD payloads (see utils/dfu_pack.py) start with the magic
+ * word followed by the format word. Anything else is a raw image.
+ */
+#define USB_DFU_PACK_MAGIC	0x50324f4e	/* 'NO2P' */
+#define USB_DFU_PACK_SPARSE	0x00000001
+#define USB_DFU_PACK_LZ		0x00000002
+
+/* Sparse payload :
+ *  - A series of records, never crossing a block boundary, each
+ *    starting with a 32 bits LE header : bit 31 flags a blank run (no
+ *    data, flash just left erased) and bits 30..0 give the length.
+ *    Data records are followed by the data, padded to 32 bits.
+ */
+#define USB_DFU_SPARSE_BLANK	(1 << 31)
+#define USB_DFU_SPARSE_LEN_MSK	0x7fffffff
+
+/* LZ payload :
+ *  - A single LZ4 like stream, freely spanning blocks, made of
+ *    sequences starting with a token byte : bits 7..4 give the literal
+ *    count and bits 3..0 the match length minus 4. A value of 15 in
+ *    either means more bytes follow, added to it until one isn't 255.
+ *  - Token (and extra literal count bytes) is followed by the literals
+ *    then the 16 bits LE match offset (1 to 4095), followed by the
+ *    extra match length bytes if any.
+ *  - A zero offset ends the stream, anything after it is ignored.
+ */
+#define USB_DFU_LZ_WIN		4096
+
+/* Flash parameters (e.g. from SFDP), defaults are 256 bytes pages and
+ * all erase sizes supported with typical Winbond timings. An erase time
+ * of 0 means that size isn't supported, 4k erase is mandatory. */
+struct usb_dfu_flash_info {
+	uint32_t page_size;		/* Program page size (up to 256) */
+	uint32_t prog_time_us;		/* Typical page program time */
+	uint32_t erase_time_us[3];	/* Typical 4k / 32k / 64k erase times */
+};
+
+struct usb_dfu_stats {
+	uint32_t blocks;	/* DNLOAD blocks written since start of download */
+	uint32_t bytes;		/* Bytes written since start of download */
+	uint32_t blk_last_ms;	/* Flash time of the last block */
+	uint32_t blk_max_ms;	/* Flash time of the slowest block */
+	uint32_t blk_total_ms;	/* Cumulated flash time of all blocks */
+} __attribute__((packed,aligned(4)));
+
 void usb_dfu_cb_reboot(void);
 bool usb_dfu_cb_flash_busy(void);
 void usb_dfu_cb_flash_erase(uint32_t addr, unsigned size);			/* 4k, 32k, 64k */
@@ -20,4 +76,7 @@ void usb_dfu_cb_flash_program(const void *data, uint32_t addr, unsigned size);	/
 void usb_dfu_cb_flash_read(void *data, uint32_t addr, unsigned size);		/* any addr, any length */
 void usb_dfu_cb_flash_raw(void *data, unsigned len);
 
+const struct usb_dfu_stats *usb_dfu_get_stats(void);
+
 void usb_dfu_init(const struct usb_dfu_zone *zones, int n_zones);
+void usb_dfu_set_flash_info(const struct usb_dfu_flash_info *info);	/* After init */
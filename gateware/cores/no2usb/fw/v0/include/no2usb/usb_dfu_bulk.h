@@ -0,0 +1,38 @@
+/*
+ * usb_dfu_bulk.h
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Vendor interface with a bulk OUT / bulk IN endpoint pair, streaming
+ * downloads to the DFU zones (see usb_dfu_bulk.c for the protocol) */
+#define USB_DFU_BULK_INTF_CLASS		0xff
+#define USB_DFU_BULK_INTF_SUBCLASS	0xdf
+#define USB_DFU_BULK_INTF_PROTOCOL	0x01
+
+#define USB_DFU_BULK_MAGIC	0x42324f4e	/* 'NO2B' */
+
+#define USB_DFU_BULK_OP_STATUS	0x00000000
+#define USB_DFU_BULK_OP_DNLOAD	0x00000001
+#define USB_DFU_BULK_OP_HASH	0x00000002
+
+struct usb_dfu_bulk_cmd {
+	uint32_t magic;
+	uint32_t op;
+	uint32_t zone;		/* DFU zone (i.e. alt setting) */
+	uint32_t len;		/* Payload length (DNLOAD) / Length to hash (HASH) */
+} __attribute__((packed,aligned(4)));
+
+struct usb_dfu_bulk_resp {
+	uint32_t op;
+	uint32_t status;	/* enum dfu_status */
+	uint32_t value;		/* STATUS: block size, DNLOAD: bytes written, HASH: CRC32 */
+	uint32_t aux;		/* STATUS: zones,      DNLOAD: flash time ms,  HASH: time ms */
+} __attribute__((packed,aligned(4)));
+
+void usb_dfu_bulk_init(int n_zones);	/* After usb_dfu_init() */
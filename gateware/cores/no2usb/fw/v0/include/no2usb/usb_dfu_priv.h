@@ -0,0 +1,33 @@
+/*
+ * usb_dfu_priv.h
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb_dfu.h"
+#include "usb_dfu_proto.h"
+
+
+/* Downloads from other interfaces (bulk, UF2 mass storage) go through
+ * the DFU block queue, on a zone picked by the caller. The alt setting
+ * of the DFU interface isn't changed, control transfers started after
+ * it are back on the alt setting zone.
+ *
+ * Only the caller that got true from usb_dfu_dl_start() may use the
+ * other hooks, until usb_dfu_dl_done() returns true. Until then, other
+ * starts and DFU class requests changing the state are refused. */
+
+bool usb_dfu_dl_start(int zone);
+uint8_t *usb_dfu_dl_blk_get(unsigned len);	/* NULL if none free (yet) or on error */
+void usb_dfu_dl_blk_put(void);
+void usb_dfu_dl_finish(void);			/* No more data */
+bool usb_dfu_dl_done(void);			/* Everything written */
+enum dfu_status usb_dfu_dl_status(void);
+
+const struct usb_dfu_zone *usb_dfu_zone_get(int zone);
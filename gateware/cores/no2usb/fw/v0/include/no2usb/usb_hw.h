@@ -11,6 +11,11 @@
 
 #include "config.h"
 
+/* Ring BDs per EP, must match the core BD_RING parameter (0, 4 or 8) */
+#ifndef USB_BD_RING
+#define USB_BD_RING 0
+#endif
+
 
 struct usb_core {
 	uint32_t csr;
@@ -51,13 +56,16 @@ struct usb_core {
 #define USB_IR_BUS_RST_PENDING	(1 <<  0)
 
 
+struct usb_bd {
+	uint32_t csr;
+	uint32_t ptr;
+} __attribute__((packed,aligned(4)));
+
 struct usb_ep {
 	uint32_t status;
-	uint32_t _rsvd[3];
-	struct {
-		uint32_t csr;
-		uint32_t ptr;
-	} bd[2];
+	uint32_t _rsvd;
+	struct usb_bd bd_setup;	/* Double buffered control mode only */
+	struct usb_bd bd[2];
 } __attribute__((packed,aligned(4)));
 
 struct usb_ep_pair {
@@ -65,6 +73,15 @@ struct usb_ep_pair {
 	struct usb_ep in;
 } __attribute__((packed,aligned(4)));
 
+struct usb_ep_ring {
+	struct usb_bd bd[4];
+} __attribute__((packed,aligned(4)));
+
+struct usb_ep_ring_pair {
+	struct usb_ep_ring out;
+	struct usb_ep_ring in;
+} __attribute__((packed,aligned(4)));
+
 #define USB_EP_TYPE_NONE	0x0000
 #define USB_EP_TYPE_ISOC	0x0001
 #define USB_EP_TYPE_INT		0x0002
@@ -75,10 +92,15 @@ struct usb_ep_pair {
 #define USB_EP_TYPE(x)		((x) & 7)
 #define USB_EP_TYPE_MSK		0x0007
 
+#define USB_EP_XFER		0x8000	/* Transfer mode BDs, needs USB_EP_MPS */
+#define USB_EP_MPS(x)		(((x) & 0x7f) << 8)
+#define USB_EP_MPS_MSK		0x7f00
 #define USB_EP_DT_BIT		0x0080
 #define USB_EP_BD_IDX		0x0040
 #define USB_EP_BD_CTRL		0x0020
-#define USB_EP_BD_DUAL		0x0010
+#define USB_EP_BD_DUAL		0x0010	/* With BD_CTRL : data in bd[0/1], SETUP in bd_setup */
+#define USB_EP_BD_RING		0x0008	/* Ring of USB_BD_RING BDs, see usb_ep_ring_bd() */
+#define USB_EP_RING_HEAD(x)	(((x) >> 4) & 7)
 
 #define USB_BD_STATE_MSK	0xe000
 #define USB_BD_STATE_NONE	0x0000
@@ -91,6 +113,17 @@ struct usb_ep_pair {
 #define USB_BD_LEN(l)		((l) & 0x3ff)
 #define USB_BD_LEN_MSK		0x03ff
 
+#define USB_BD_PTR_ZLP		0x8000	/* Transfer mode IN only */
+#define USB_BD_PTR_MSK		0x07ff
+
 
 static volatile struct usb_core *    const usb_regs    = (void*) (USB_CORE_BASE);
 static volatile struct usb_ep_pair * const usb_ep_regs = (void*)((USB_CORE_BASE) + (1 << 13));
+static volatile struct usb_ep_ring_pair * const usb_ep_ring_regs = (void*)((USB_CORE_BASE) + (1 << 13) + (1 << 10));
+
+static inline volatile struct usb_bd *
+usb_ep_ring_bd(uint8_t ep_addr, int n)
+{
+	volatile struct usb_ep_ring_pair *rp = &usb_ep_ring_regs[((n >> 2) << 4) | (ep_addr & 0xf)];
+	return (ep_addr & 0x80) ? &rp->in.bd[n & 3] : &rp->out.bd[n & 3];
+}
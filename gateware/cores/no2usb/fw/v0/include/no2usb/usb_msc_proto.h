@@ -0,0 +1,91 @@
+/*
+ * usb_msc_proto.h
+ *
+ * See USB Mass Storage Class, Bulk-Only Transport, Revision 1.0
+ * and the SCSI Primary / Block Commands (only what's used here)
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+/* Interface (Class Specification Overview, Section 2) */
+
+#define USB_MSC_SCLS_SCSI	0x06	/* SCSI transparent command set */
+#define USB_MSC_PROTO_BOT	0x50	/* Bulk-Only Transport */
+
+
+/* Control requests (BOT Section 3) */
+
+#define USB_REQ_MSC_RESET	(0xff)
+#define USB_REQ_MSC_GET_MAX_LUN	(0xfe)
+
+#define USB_RT_MSC_RESET	((0xff << 8) | 0x21)
+#define USB_RT_MSC_GET_MAX_LUN	((0xfe << 8) | 0xa1)
+
+
+/* Command / Status wrappers (BOT Section 5) */
+
+#define USB_MSC_CBW_SIG		0x43425355	/* 'USBC' */
+#define USB_MSC_CSW_SIG		0x53425355	/* 'USBS' */
+
+#define USB_MSC_CBW_FLAG_IN	(1 << 7)
+
+struct usb_msc_cbw {
+	uint32_t dCBWSignature;
+	uint32_t dCBWTag;
+	uint32_t dCBWDataTransferLength;
+	uint8_t  bmCBWFlags;
+	uint8_t  bCBWLUN;
+	uint8_t  bCBWCBLength;
+	uint8_t  CBWCB[16];
+} __attribute__((packed));
+
+enum usb_msc_csw_status {
+	USB_MSC_CSW_PASSED	= 0x00,
+	USB_MSC_CSW_FAILED	= 0x01,
+	USB_MSC_CSW_PHASE_ERR	= 0x02,
+};
+
+struct usb_msc_csw {
+	uint32_t dCSWSignature;
+	uint32_t dCSWTag;
+	uint32_t dCSWDataResidue;
+	uint8_t  bCSWStatus;
+} __attribute__((packed));
+
+
+/* SCSI commands */
+
+enum usb_msc_scsi_op {
+	SCSI_TEST_UNIT_READY		= 0x00,
+	SCSI_REQUEST_SENSE		= 0x03,
+	SCSI_INQUIRY			= 0x12,
+	SCSI_MODE_SENSE_6		= 0x1a,
+	SCSI_START_STOP_UNIT		= 0x1b,
+	SCSI_PREVENT_ALLOW_REMOVAL	= 0x1e,
+	SCSI_READ_FORMAT_CAPACITIES	= 0x23,
+	SCSI_READ_CAPACITY_10		= 0x25,
+	SCSI_READ_10			= 0x28,
+	SCSI_WRITE_10			= 0x2a,
+	SCSI_VERIFY_10			= 0x2f,
+	SCSI_SYNCHRONIZE_CACHE_10	= 0x35,
+	SCSI_MODE_SENSE_10		= 0x5a,
+};
+
+enum usb_msc_scsi_sense_key {
+	SCSI_SK_NO_SENSE		= 0x00,
+	SCSI_SK_NOT_READY		= 0x02,
+	SCSI_SK_MEDIUM_ERROR		= 0x03,
+	SCSI_SK_ILLEGAL_REQUEST		= 0x05,
+};
+
+/* Additional sense codes (ASCQ is always 0 here) */
+#define SCSI_ASC_NONE			0x00
+#define SCSI_ASC_INVALID_OPCODE		0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE	0x21
+#define SCSI_ASC_INVALID_FIELD		0x24
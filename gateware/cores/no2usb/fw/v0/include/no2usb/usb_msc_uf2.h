@@ -0,0 +1,40 @@
+/*
+ * usb_msc_uf2.h
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* UF2 blocks (see https://github.com/microsoft/uf2). Only blocks with a
+ * 256 bytes payload are accepted, 'targetAddr' being the flash address
+ * of the zone plus the offset in the DNLOAD payload (see utils/uf2_pack.py)
+ */
+#define UF2_MAGIC_START0	0x0a324655	/* 'UF2\n' */
+#define UF2_MAGIC_START1	0x9e5d5157
+#define UF2_MAGIC_END		0x0ab16f30
+
+#define UF2_FLAG_NOT_MAIN_FLASH	0x00000001
+#define UF2_FLAG_FAMILY_ID	0x00002000
+
+#define UF2_FAMILY_ID_NO2	0x5d4c2f16	/* Only checked if present */
+
+#define UF2_PAYLOAD_SIZE	256
+
+struct uf2_block {
+	uint32_t magicStart0;
+	uint32_t magicStart1;
+	uint32_t flags;
+	uint32_t targetAddr;
+	uint32_t payloadSize;
+	uint32_t blockNo;
+	uint32_t numBlocks;
+	uint32_t familyID;	/* or fileSize */
+	uint8_t  data[476];
+	uint32_t magicEnd;
+} __attribute__((packed,aligned(4)));
+
+void usb_msc_uf2_init(const char *info, int n_zones);	/* After usb_dfu_init() */
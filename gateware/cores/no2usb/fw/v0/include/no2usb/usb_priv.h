@@ -31,6 +31,12 @@
 /* Internal functions */
 /* ------------------ */
 
+/* EP0 data BD size, in transfer mode (multiple of the 64 bytes packets).
+ * Each direction uses two of those in EP buffer memory */
+#ifndef USB_EP0_BD_LEN
+# define USB_EP0_BD_LEN		256
+#endif
+
 /* Stack */
 struct usb_stack {
 	/* Driver config */
@@ -63,6 +69,11 @@ struct usb_stack {
 
 		uint8_t buf[64];
 
+		/* Data BDs : next to queue and number in flight */
+		uint8_t in_bdi,  in_cnt;
+		uint8_t out_bdi, out_cnt;
+		uint16_t out_pend;	/* Bytes queued in OUT BDs */
+
 		struct usb_xfer xfer;
 		struct usb_ctrl_req req;
 	} ctrl;
@@ -79,6 +90,7 @@ void usb_data_read(void *dst, unsigned int src_ofs, int len);
 
 
 void usb_dispatch_sof(void);
+void usb_dispatch_poll(void);
 void usb_dipatch_bus_reset(void);
 void usb_dispatch_state_chg(enum usb_dev_state state);
 enum usb_fnd_resp usb_dispatch_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer);
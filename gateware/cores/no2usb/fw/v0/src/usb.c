@@ -141,6 +141,18 @@ usb_dispatch_sof(void)
 	}
 }
 
+void
+usb_dispatch_poll(void)
+{
+	struct usb_fn_drv *p = g_usb.fnd;
+
+	while (p) {
+		if (p->poll)
+			p->poll();
+		p = p->next;
+	}
+}
+
 void
 usb_dipatch_bus_reset(void)
 {
@@ -261,10 +273,19 @@ usb_debug_print_ep(int ep, int dir)
 
 	printf("EP%d %s\n", ep, dir ? "IN" : "OUT");
 	printf("\tS     %04x\n", ep_regs->status);
+	printf("\tBDS.0 %04x\n", ep_regs->bd_setup.csr);
+	printf("\tBDS.1 %04x\n", ep_regs->bd_setup.ptr);
 	printf("\tBD0.0 %04x\n", ep_regs->bd[0].csr);
 	printf("\tBD0.1 %04x\n", ep_regs->bd[0].ptr);
 	printf("\tBD1.0 %04x\n", ep_regs->bd[1].csr);
 	printf("\tBD1.1 %04x\n", ep_regs->bd[1].ptr);
+	if (ep_regs->status & USB_EP_BD_RING) {
+		for (int i=0; i<USB_BD_RING; i++) {
+			volatile struct usb_bd *bd = usb_ep_ring_bd(dir ? (ep | 0x80) : ep, i);
+			printf("\tRBD%d.0 %04x\n", i, bd->csr);
+			printf("\tRBD%d.1 %04x\n", i, bd->ptr);
+		}
+	}
 	printf("\n");
 }
 
@@ -341,8 +362,8 @@ usb_bus_reset(void)
 	_usb_hw_reset(true);
 
 	/* Reset memory alloc */
-	g_usb.ep_cfg.mem[0] = 0x80;	// 2 * 64b for EP0 OUT/SETUP
-	g_usb.ep_cfg.mem[1] = 0x40;	// 1 * 64b for EP0 IN
+	g_usb.ep_cfg.mem[0] = 2 * USB_EP0_BD_LEN + 64;	// 2 data BDs + 64b SETUP for EP0 OUT
+	g_usb.ep_cfg.mem[1] = 2 * USB_EP0_BD_LEN;	// 2 data BDs for EP0 IN
 
 	/* Reset EP0 */
 	usb_ep0_reset();
@@ -414,6 +435,9 @@ usb_poll(void)
 		usb_dispatch_sof();
 	}
 
+	/* Give function drivers a chance to run background work */
+	usb_dispatch_poll();
+
 	/* Check for activity */
 	if (!(csr & USB_CSR_EVT_PENDING))
 		return;
@@ -577,7 +601,7 @@ _usb_ep_conf(uint8_t ep_addr, const struct usb_ep_desc *ep)
 	ep_regs = _usb_hw_get_ep(ep_addr);
 
 	csr = ep_regs->status;
-	csr &= USB_EP_BD_DUAL;
+	csr &= (csr & USB_EP_BD_RING) ? (USB_EP_BD_RING | USB_EP_XFER) : (USB_EP_BD_DUAL | USB_EP_XFER);
 
 	ml = 0;
 
@@ -590,13 +614,20 @@ _usb_ep_conf(uint8_t ep_addr, const struct usb_ep_desc *ep)
 		};
 		csr |= types[ep->bmAttributes & 3];
 		ml   = ep->wMaxPacketSize;
+
+		if (USB_EP_TYPE_IS_BCI(csr))
+			csr |= USB_EP_MPS(ml);
 	}
 
 	ep_regs->status = csr;
-	ep_regs->_rsvd[3] = ml;
+	ep_regs->_rsvd = ml;
 	ep_regs->bd[0].csr = 0;
 	ep_regs->bd[1].csr = 0;
 
+	if (csr & USB_EP_BD_RING)
+		for (int i=0; i<USB_BD_RING; i++)
+			usb_ep_ring_bd(ep_addr, i)->csr = 0;
+
 	return true;
 }
 
@@ -619,8 +650,8 @@ usb_ep_reconf(const struct usb_intf_desc *intf, uint8_t ep_addr)
 	return false;
 }
 
-bool
-usb_ep_boot(const struct usb_intf_desc *intf, uint8_t ep_addr, bool dual_bd)
+static bool
+_usb_ep_boot(const struct usb_intf_desc *intf, uint8_t ep_addr, uint32_t bd_mode, int n_bd)
 {
 	const struct usb_conf_desc *conf = g_usb.conf;
 	const struct usb_intf_desc *intf_alt;
@@ -655,14 +686,31 @@ usb_ep_boot(const struct usb_intf_desc *intf, uint8_t ep_addr, bool dual_bd)
 	/* Allocate and setup BDs */
 	ep_regs = _usb_hw_get_ep(ep_addr);
 
-	ep_regs->status = dual_bd ? USB_EP_BD_DUAL : 0;
-	ep_regs->_rsvd[2] = wMaxPacketSize;
+	ep_regs->status = bd_mode;
 
-	for (int i=0; i<(dual_bd?2:1); i++) {
-		ep_regs->bd[i].csr = 0x0000;
-		ep_regs->bd[i].ptr = _usb_alloc_buf(wMaxPacketSize, (ep_addr & 0x80) ? true : false);
+	for (int i=0; i<n_bd; i++) {
+		volatile struct usb_bd *bd = (bd_mode & USB_EP_BD_RING) ?
+			usb_ep_ring_bd(ep_addr, i) : &ep_regs->bd[i];
+		bd->csr = 0x0000;
+		bd->ptr = _usb_alloc_buf(wMaxPacketSize, (ep_addr & 0x80) ? true : false);
 	}
 
 	/* Configure with the altsetting 0 config */
 	return _usb_ep_conf(ep_addr, ep_def);
 }
+
+bool
+usb_ep_boot(const struct usb_intf_desc *intf, uint8_t ep_addr, bool dual_bd)
+{
+	return _usb_ep_boot(intf, ep_addr, dual_bd ? USB_EP_BD_DUAL : 0, dual_bd ? 2 : 1);
+}
+
+bool
+usb_ep_boot_ring(const struct usb_intf_desc *intf, uint8_t ep_addr)
+{
+	/* Needs a core with ring BDs, and not for control EPs */
+	if (!USB_BD_RING || !(ep_addr & 0xf))
+		return false;
+
+	return _usb_ep_boot(intf, ep_addr, USB_EP_BD_RING, USB_BD_RING);
+}
@@ -14,103 +14,215 @@
 
 #include "console.h"
 
-#define EP0_PKT_LEN	64
+#define EP0_PKT_LEN	USB_XFER_STREAM_LEN
 
-/* Helpers to manipulate BDs */
+/* Helpers to manipulate BDs
+ *
+ * Both data directions are double buffered, with the SETUP packet landing
+ * in its own BD. Data BDs are in transfer mode, each covering up to
+ * USB_EP0_BD_LEN bytes. Buffer memory layout, in each direction, is one
+ * such buffer per data BD, followed by the SETUP buffer for OUT.
+ *
+ * For each direction we track the next BD to queue and how many are in
+ * flight, the oldest one (next to complete) is derived from those.
+ */
 
 	/* IN */
+static inline int
+usb_ep0_in_oldest(void)
+{
+	return g_usb.ctrl.in_bdi ^ (g_usb.ctrl.in_cnt & 1);
+}
+
 static inline uint32_t
 usb_ep0_in_peek(void)
 {
-	return usb_ep_regs[0].in.bd[0].csr;
+	return usb_ep_regs[0].in.bd[usb_ep0_in_oldest()].csr;
+}
+
+static inline void
+usb_ep0_in_release(void)
+{
+	usb_ep_regs[0].in.bd[usb_ep0_in_oldest()].csr = 0;
+	if (g_usb.ctrl.in_cnt)
+		g_usb.ctrl.in_cnt--;
 }
 
 static inline void
 usb_ep0_in_clear(void)
 {
 	usb_ep_regs[0].in.bd[0].csr = 0;
+	usb_ep_regs[0].in.bd[1].csr = 0;
+	g_usb.ctrl.in_bdi = 0;
+	g_usb.ctrl.in_cnt = 0;
+}
+
+static inline unsigned int
+usb_ep0_in_buf(void)
+{
+	return g_usb.ctrl.in_bdi * USB_EP0_BD_LEN;
 }
 
 static inline void
-usb_ep0_in_queue_data(unsigned int len)
+usb_ep0_in_queue_data(unsigned int len, bool zlp)
 {
-	usb_ep_regs[0].in.bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(len);
+	int bdi = g_usb.ctrl.in_bdi;
+
+	usb_ep_regs[0].in.bd[bdi].ptr = (bdi * USB_EP0_BD_LEN) | (zlp ? USB_BD_PTR_ZLP : 0);
+	usb_ep_regs[0].in.bd[bdi].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(len);
+
+	g_usb.ctrl.in_bdi ^= 1;
+	g_usb.ctrl.in_cnt++;
 }
 
 static inline void
 usb_ep0_in_queue_stall(void)
 {
 	usb_ep_regs[0].in.bd[0].csr = USB_BD_STATE_RDY_STALL;
+	usb_ep_regs[0].in.bd[1].csr = USB_BD_STATE_RDY_STALL;
 }
 
 	/* OUT */
+static inline int
+usb_ep0_out_oldest(void)
+{
+	return g_usb.ctrl.out_bdi ^ (g_usb.ctrl.out_cnt & 1);
+}
+
 static inline uint32_t
 usb_ep0_out_peek(void)
 {
-	return usb_ep_regs[0].out.bd[0].csr;
+	return usb_ep_regs[0].out.bd[usb_ep0_out_oldest()].csr;
+}
+
+static inline unsigned int
+usb_ep0_out_buf(void)
+{
+	return usb_ep0_out_oldest() * USB_EP0_BD_LEN;
+}
+
+static inline int
+usb_ep0_out_rx_len(void)
+{
+	/* Transfer mode : the pointer advanced by what was received */
+	return (usb_ep_regs[0].out.bd[usb_ep0_out_oldest()].ptr & USB_BD_PTR_MSK) - usb_ep0_out_buf();
+}
+
+static inline void
+usb_ep0_out_release(void)
+{
+	usb_ep_regs[0].out.bd[usb_ep0_out_oldest()].csr = 0;
+	if (g_usb.ctrl.out_cnt)
+		g_usb.ctrl.out_cnt--;
 }
 
 static inline void
 usb_ep0_out_clear(void)
 {
 	usb_ep_regs[0].out.bd[0].csr = 0;
+	usb_ep_regs[0].out.bd[1].csr = 0;
+	g_usb.ctrl.out_bdi = 0;
+	g_usb.ctrl.out_cnt = 0;
+	g_usb.ctrl.out_pend = 0;
 }
 
 static inline void
-usb_ep0_out_queue_data(void)
+usb_ep0_out_queue_data(unsigned int len)
 {
-	usb_ep_regs[0].out.bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(EP0_PKT_LEN);
+	int bdi = g_usb.ctrl.out_bdi;
+
+	usb_ep_regs[0].out.bd[bdi].ptr = bdi * USB_EP0_BD_LEN;
+	usb_ep_regs[0].out.bd[bdi].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(len);
+
+	g_usb.ctrl.out_bdi ^= 1;
+	g_usb.ctrl.out_cnt++;
 }
 
 static inline void
 usb_ep0_out_queue_stall(void)
 {
 	usb_ep_regs[0].out.bd[0].csr = USB_BD_STATE_RDY_STALL;
+	usb_ep_regs[0].out.bd[1].csr = USB_BD_STATE_RDY_STALL;
 }
 
 	/* SETUP */
 static inline uint32_t
 usb_ep0_setup_peek(void)
 {
-	return usb_ep_regs[0].out.bd[1].csr;
+	return usb_ep_regs[0].out.bd_setup.csr;
 }
 
 static inline void
-usb_ep0_setup_clear(void)
+usb_ep0_setup_queue_data(void)
 {
-	usb_ep_regs[0].out.bd[1].csr = 0;
+	usb_ep_regs[0].out.bd_setup.csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(EP0_PKT_LEN);
 }
 
+	/* EP status after SETUP : BD index reset, DT=1 both ways */
 static inline void
-usb_ep0_setup_queue_data(void)
+usb_ep0_status_reset(void)
 {
-	usb_ep_regs[0].out.bd[1].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(EP0_PKT_LEN);
+	const uint32_t xfer = USB_EP_XFER | USB_EP_MPS(EP0_PKT_LEN);
+	usb_ep_regs[0].out.status = xfer | USB_EP_TYPE_CTRL | USB_EP_BD_CTRL | USB_EP_BD_DUAL | USB_EP_DT_BIT;
+	usb_ep_regs[0].in.status  = xfer | USB_EP_TYPE_CTRL | USB_EP_BD_DUAL | USB_EP_DT_BIT;
 }
 
 
 /* Handle control transfers */
 
+static void
+usb_handle_control_stall(void)
+{
+	g_usb.ctrl.state = STALL;
+	usb_ep0_in_queue_stall();
+	usb_ep0_out_queue_stall();
+}
+
 static void
 usb_handle_control_data()
 {
 	/* Handle read requests */
-	if (g_usb.ctrl.state == DATA_IN) {
-		/* How much left to do ? */
-		int xflen = g_usb.ctrl.xfer.len - g_usb.ctrl.xfer.ofs;
-		if (xflen > EP0_PKT_LEN)
-			xflen = EP0_PKT_LEN;
+	while ((g_usb.ctrl.state == DATA_IN) && (g_usb.ctrl.in_cnt < 2)) {
+		unsigned int bd_len = 0;
+		int xflen;
+		bool zlp = false;
 
-		/* Setup descriptor for output */
-		if (xflen)
-			usb_data_write(0, &g_usb.ctrl.xfer.data[g_usb.ctrl.xfer.ofs], xflen);
-		usb_ep0_in_queue_data(xflen);
+		/* Fill the BD buffer, one packet worth at a time */
+		do {
+			/* How much left to do ? */
+			xflen = g_usb.ctrl.xfer.len - g_usb.ctrl.xfer.ofs;
+			if (xflen > EP0_PKT_LEN)
+				xflen = EP0_PKT_LEN;
+
+			if (xflen)
+				usb_data_write(usb_ep0_in_buf() + bd_len, &g_usb.ctrl.xfer.data[g_usb.ctrl.xfer.ofs], xflen);
+
+			/* Move on */
+			bd_len += xflen;
+			g_usb.ctrl.xfer.ofs += xflen;
 
-		/* Move on */
-		g_usb.ctrl.xfer.ofs += xflen;
+			/* Short packet ends the transfer, else it needs a ZLP */
+			if (xflen < EP0_PKT_LEN)
+				break;
+
+			if (g_usb.ctrl.xfer.ofs == g_usb.ctrl.xfer.len) {
+				zlp = true;
+				break;
+			}
+
+			/* Get next data while the other BD is sent */
+			if (g_usb.ctrl.xfer.cb_data && !g_usb.ctrl.xfer.cb_data(&g_usb.ctrl.xfer)) {
+				usb_handle_control_stall();
+				return;
+			}
+		} while (bd_len < USB_EP0_BD_LEN);
+
+		/* Setup descriptor for output */
+		usb_ep0_in_queue_data(bd_len, zlp);
 
 		/* If we're done, setup the OUT ack */
-		if (xflen < EP0_PKT_LEN) {
-			usb_ep0_out_queue_data();
+		if ((xflen < EP0_PKT_LEN) || zlp) {
+			usb_ep0_out_queue_data(EP0_PKT_LEN);
 			g_usb.ctrl.state = STATUS_DONE_OUT;
 		}
 	}
@@ -123,27 +235,37 @@ usb_handle_control_data()
 		if ((bds_out & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK)
 		{
 			/* Read data from USB buffer */
-			int xflen = (bds_out & USB_BD_LEN_MSK) - 2;
-			usb_data_read(&g_usb.ctrl.xfer.data[g_usb.ctrl.xfer.ofs], 0, xflen);
+			int xflen = usb_ep0_out_rx_len();
+			usb_data_read(&g_usb.ctrl.xfer.data[g_usb.ctrl.xfer.ofs], usb_ep0_out_buf(), xflen);
 
 			/* Move on */
 			g_usb.ctrl.xfer.ofs += xflen;
+			g_usb.ctrl.out_pend -= xflen + (bds_out & USB_BD_LEN_MSK);
 
 			/* Done with that buffer */
-			usb_ep0_out_clear();
+			usb_ep0_out_release();
 		}
 
 		/* Next ? */
 		if (g_usb.ctrl.xfer.ofs == g_usb.ctrl.xfer.len)
 		{
 			/* Done, ACK with a ZLP */
-			usb_ep0_in_queue_data(0);
+			usb_ep0_in_queue_data(0, false);
 			g_usb.ctrl.state = STATUS_DONE_IN;
 		}
-		else if ((bds_out & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_DATA)
+		else
 		{
-			/* Submit next BD to fill */
-			usb_ep0_out_queue_data();
+			/* Keep up to two BDs to fill, but not more than what's left */
+			while (g_usb.ctrl.out_cnt < 2) {
+				int xflen = g_usb.ctrl.xfer.len - g_usb.ctrl.xfer.ofs - g_usb.ctrl.out_pend;
+				if (xflen <= 0)
+					break;
+				if (xflen > USB_EP0_BD_LEN)
+					xflen = USB_EP0_BD_LEN;
+
+				usb_ep0_out_queue_data(xflen);
+				g_usb.ctrl.out_pend += xflen;
+			}
 		}
 	}
 }
@@ -189,6 +311,12 @@ usb_handle_control_request(struct usb_ctrl_req *req)
 		g_usb.ctrl.xfer.len = req->wLength;
 	}
 
+	/* Streamed data needs the first chunk now */
+	if (USB_REQ_IS_READ(req) && g_usb.ctrl.xfer.cb_data && g_usb.ctrl.xfer.len) {
+		if (!g_usb.ctrl.xfer.cb_data(&g_usb.ctrl.xfer))
+			goto error;
+	}
+
 	/* Handle the 'data' stage now */
 	g_usb.ctrl.state = USB_REQ_IS_READ(req) ? DATA_IN : DATA_OUT;
 	usb_handle_control_data();
@@ -197,9 +325,7 @@ usb_handle_control_request(struct usb_ctrl_req *req)
 
 	/* Error path */
 error:
-	g_usb.ctrl.state = STALL;
-	usb_ep0_in_queue_stall();
-	usb_ep0_out_queue_stall();
+	usb_handle_control_stall();
 	return;
 }
 
@@ -213,13 +339,14 @@ usb_ep0_reset(void)
 	g_usb.ctrl.state = IDLE;
 
 	/* Configure EP0 */
-	usb_ep_regs[0].out.status = USB_EP_TYPE_CTRL | USB_EP_BD_CTRL; /* Type=Control, control mode buffered */
-	usb_ep_regs[0].in.status  = USB_EP_TYPE_CTRL | USB_EP_DT_BIT;  /* Type=Control, single buffered, DT=1 */
+	usb_ep0_status_reset(); /* Type=Control, double buffered (+ SETUP BD for OUT), transfer mode, DT=1 */
 
 	/* Setup the BD pointers */
 	usb_ep_regs[0].in.bd[0].ptr  = 0;
+	usb_ep_regs[0].in.bd[1].ptr  = USB_EP0_BD_LEN;
 	usb_ep_regs[0].out.bd[0].ptr = 0;
-	usb_ep_regs[0].out.bd[1].ptr = EP0_PKT_LEN;
+	usb_ep_regs[0].out.bd[1].ptr = USB_EP0_BD_LEN;
+	usb_ep_regs[0].out.bd_setup.ptr = 2 * USB_EP0_BD_LEN;
 
 	/* Clear BD for IN/OUT */
 	usb_ep0_in_clear();
@@ -249,7 +376,7 @@ usb_ep0_poll(void)
 			if ((bds_in & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) {
 				/* Return to IDLE */
 				g_usb.ctrl.state = IDLE;
-				usb_ep0_in_clear();
+				usb_ep0_in_release();
 
 				/* Completion Callback */
 				if (g_usb.ctrl.xfer.cb_done)
@@ -263,20 +390,20 @@ usb_ep0_poll(void)
 		/* Check for status OUT stage finishing */
 		else if (g_usb.ctrl.state == STATUS_DONE_OUT) {
 			if ((bds_in & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) {
-				/* Done with the last IN BD of this transfer */
-				usb_ep0_in_clear();
+				/* Done with one of the last IN BDs of this transfer */
+				usb_ep0_in_release();
 
 				/* Next event */
 				acted = true;
 			}
 			if ((bds_out & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) {
 				/* Sanity check */
-				if ((bds_out & USB_BD_LEN_MSK) != 2)
+				if (usb_ep0_out_rx_len() != 0)
 					USB_LOG_ERR("[!] Got a non ZLP as a status stage packet ?!?\n");
 
 				/* Return to IDLE */
 				g_usb.ctrl.state = IDLE;
-				usb_ep0_out_clear();
+				usb_ep0_out_release();
 
 				/* Completion Callback */
 				if (g_usb.ctrl.xfer.cb_done)
@@ -289,11 +416,13 @@ usb_ep0_poll(void)
 
 		/* Check for STALL needing a refresh */
 		else if (g_usb.ctrl.state == STALL) {
-			if ((bds_in & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_STALL) {
+			if (((usb_ep_regs[0].in.bd[0].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_STALL) ||
+			    ((usb_ep_regs[0].in.bd[1].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_STALL)) {
 				usb_ep0_in_queue_stall();
 				acted = true;
 			}
-			if ((bds_out & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_STALL) {
+			if (((usb_ep_regs[0].out.bd[0].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_STALL) ||
+			    ((usb_ep_regs[0].out.bd[1].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_STALL)) {
 				usb_ep0_out_queue_stall();
 				acted = true;
 			}
@@ -312,8 +441,10 @@ usb_ep0_poll(void)
 		}
 
 		if ((bds_out & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_ERR) {
+			/* Transfer mode BDs shouldn't report those, but if they do,
+			 * just re-arm in place : pointer and length are still valid */
 			USB_LOG_ERR("[!] Retry OUT error\n");
-			usb_ep0_out_queue_data();
+			usb_ep_regs[0].out.bd[usb_ep0_out_oldest()].csr = USB_BD_STATE_RDY_DATA | (bds_out & USB_BD_LEN_MSK);
 			acted = true;
 			continue;
 		}
@@ -334,11 +465,13 @@ usb_ep0_poll(void)
 			usb_ep0_out_clear();
 			usb_ep0_in_clear();
 
-			/* Make sure DT=1 for IN endpoint after a SETUP */
-			usb_ep_regs[0].in.status = USB_EP_TYPE_CTRL | USB_EP_DT_BIT;  /* Type=Control, single buffered, DT=1 */
+			/* Make sure DT=1 and BD index is 0 after a SETUP. The CEL
+			 * lockout guarantees the hardware won't touch them until
+			 * we release it */
+			usb_ep0_status_reset();
 
 			/* We acked it, need to handle it */
-			usb_data_read(&g_usb.ctrl.req, EP0_PKT_LEN, sizeof(struct usb_ctrl_req));
+			usb_data_read(&g_usb.ctrl.req, usb_ep_regs[0].out.bd_setup.ptr, sizeof(struct usb_ctrl_req));
 			usb_handle_control_request(&g_usb.ctrl.req);
 
 			/* Release the lockout and allow new SETUP */
@@ -353,7 +486,7 @@ usb_ep0_poll(void)
 			/* Sanity check */
 			if (g_usb.ctrl.state != DATA_OUT) {
 				USB_LOG_ERR("[!] Got unexpected DATA !?!\n");
-				usb_ep0_out_clear();
+				usb_ep0_out_release();
 			} else {
 				/* Process data */
 				usb_handle_control_data();
@@ -368,9 +501,10 @@ usb_ep0_poll(void)
 			/* Sanity check */
 			if (g_usb.ctrl.state != DATA_IN) {
 				USB_LOG_ERR("[!] Got ack for DATA we didn't send !?!\n");
-				usb_ep0_in_clear();
+				usb_ep0_in_release();
 			} else {
-				/* Process data */
+				/* Done with that BD, queue more data */
+				usb_ep0_in_release();
 				usb_handle_control_data();
 			}
 
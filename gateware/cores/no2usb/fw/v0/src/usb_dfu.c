@@ -11,6 +11,7 @@
 
 #include <no2usb/usb.h>
 #include <no2usb/usb_dfu.h>
+#include <no2usb/usb_dfu_priv.h>
 #include <no2usb/usb_dfu_proto.h>
 
 
@@ -20,7 +21,17 @@ enum usb_fnd_resp dfu_vendor_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer
 #endif
 
 
-#define DFU_POLL_MS		10
+#define DFU_POLL_MS_MIN		1
+#define DFU_POLL_MS_MAX		1000
+
+#define DFU_BUF_SIZE		USB_DFU_TRANSFER_SIZE
+#define DFU_N_BUF		2
+
+#if (DFU_BUF_SIZE & 0xfff) || (DFU_BUF_SIZE > 32768)
+#error "USB_DFU_TRANSFER_SIZE must be a multiple of 4k, up to 32k"
+#endif
+
+#define DFU_LZ_BUDGET		512
 
 
 static const uint32_t dfu_valid_req[_DFU_MAX_STATE] = {
@@ -96,74 +107,758 @@ static struct {
 
 	uint8_t intf;	// Selected interface number
 	uint8_t alt;	// Selected alt setting
+	uint8_t zone;	// Zone in use (the alt setting one, unless picked by usb_dfu_dl_start)
 	bool    armed;	// Is it armed for reboot on usb reset ?
+	bool    ext;	// Download from another interface in progress
 
-	uint8_t buf[4096] __attribute__((aligned(4)));
+	uint8_t buf[DFU_N_BUF][DFU_BUF_SIZE] __attribute__((aligned(4)));
 
+	/* Received blocks waiting to be written */
 	struct {
-		uint32_t addr_read;
-		uint32_t addr_prog;
-		uint32_t addr_erase;
-		uint32_t addr_end;
+		uint32_t addr;	// Flash range covered by the block
+		uint32_t end;
+		int      len;	// Block length
+		int      ofs;	// Programming progress (in buffer)
+		uint32_t prog;	// Programming progress (in flash)
+		int      rec;	// Data left in current record
+		uint32_t tick;	// Time the block was received
+		uint32_t skip;	// Sectors found identical in flash (bitmask, 4k each)
+	} blk[DFU_N_BUF];
+
+	int  blk_wr;	// Index of the oldest queued block
+	int  blk_rx;	// Index of the block being received
+	int  blk_cnt;	// Number of queued blocks
+	bool flush;	// Short block received, wait for all data to be written
+
+	bool dl_first;	// Next block is the first of the download
+
+	enum {
+		DFU_FMT_RAW = 0,
+		DFU_FMT_SPARSE,
+		DFU_FMT_LZ,
+	} fmt;		// Payload format of the current download
 
-		int op_ofs;
-		int op_len;
+	struct {
+		uint32_t addr_read;	// Next address for UPLOAD
+		uint32_t addr_dl;	// Next address for DNLOAD
+		uint32_t addr_erase;	// Everything below is erased
+		uint32_t addr_erase_tgt;// Erase needed up to there
+		uint32_t addr_end;
+		uint32_t page;		// Program page size
+		uint32_t erase_ok;	// Supported erase ops (FL_OP_ERASE_* bitmask)
+	} flash;
 
+	/* Compare of the sector at the erase front */
+	struct {
+		int  ofs;	// Progress within the sector
+		bool same;	// Flash content identical so far
+		bool prog;	// Only 1->0 transitions needed so far
+		uint8_t buf[256] __attribute__((aligned(4)));
+	} cmp;
+
+	/* LZ decoder, output goes to a window indexed by flash address
+	 * and is programmed from there */
+	struct {
 		enum {
-			FL_IDLE = 0,
-			FL_ERASE,
-			FL_PROGRAM,
-		} op;
-	} flash;
+			LZ_TOKEN = 0,
+			LZ_LIT_EXT,
+			LZ_LIT,
+			LZ_OFS_LO,
+			LZ_OFS_HI,
+			LZ_MATCH_EXT,
+			LZ_MATCH,
+			LZ_END,
+		} st;
+		uint32_t lit;	// Literals left in sequence
+		uint32_t mlen;	// Match length left
+		uint32_t moff;	// Match offset
+		uint32_t out;	// Next address to decode to
+		uint32_t prog;	// Next address to program
+		uint8_t  win[USB_DFU_LZ_WIN] __attribute__((aligned(4)));
+	} lz;
+
+	/* Last issued flash operation and measured timings */
+	struct {
+		enum {
+			FL_OP_PROG = 0,
+			FL_OP_ERASE_4K,
+			FL_OP_ERASE_32K,
+			FL_OP_ERASE_64K,
+			FL_OP_NONE,
+		} type;
+		uint32_t tick;
+		uint32_t time_us[FL_OP_NONE];
+	} op;
+
+	struct usb_dfu_stats stats;
 } g_dfu;
 
+/* Typical datasheet values, refined with actual measurements */
+static const uint32_t dfu_op_time_default_us[] = {
+	[FL_OP_PROG]      =    700,
+	[FL_OP_ERASE_4K]  =  45000,
+	[FL_OP_ERASE_32K] = 120000,
+	[FL_OP_ERASE_64K] = 150000,
+};
+
+
+static void
+_dfu_stats_block(int len, uint32_t tick)
+{
+	uint32_t dt = usb_get_tick() - tick;
+
+	g_dfu.stats.blocks++;
+	g_dfu.stats.bytes += len;
+	g_dfu.stats.blk_last_ms = dt;
+	g_dfu.stats.blk_total_ms += dt;
+	if (dt > g_dfu.stats.blk_max_ms)
+		g_dfu.stats.blk_max_ms = dt;
+}
+
+static bool
+_dfu_lz_pending(void)
+{
+	return (g_dfu.fmt == DFU_FMT_LZ) &&
+		((g_dfu.lz.st != LZ_END) || (g_dfu.lz.prog < g_dfu.lz.out));
+}
+
+static bool
+_dfu_flash_busy(void)
+{
+	/* Anything left to write or erase (including a background erase
+	 * past the data), or an operation still in progress. This decides
+	 * when the download is complete, everywhere */
+	return g_dfu.blk_cnt || _dfu_lz_pending() ||
+		(g_dfu.flash.addr_erase < g_dfu.flash.addr_erase_tgt) ||
+		(g_dfu.op.type != FL_OP_NONE);
+}
+
+static bool
+_dfu_buf_busy(void)
+{
+	/* Queued blocks still need their buffer until written */
+	return g_dfu.blk_cnt != 0;
+}
+
+static bool
+_dfu_can_accept(void)
+{
+	/* After a short block, hold the host until everything is written
+	 * so that the final zero-length DNLOAD finds nothing pending */
+	if (g_dfu.flush)
+		return !_dfu_flash_busy();
+
+	return g_dfu.blk_cnt < DFU_N_BUF;
+}
+
+static int
+_dfu_erase_op(unsigned size)
+{
+	switch (size) {
+	case 65536: return FL_OP_ERASE_64K;
+	case 32768: return FL_OP_ERASE_32K;
+	default:    return FL_OP_ERASE_4K;
+	}
+}
+
+static unsigned
+_dfu_erase_size(uint32_t addr, uint32_t limit)
+{
+	static const unsigned sizes[] = { 65536, 32768, 4096 };
+
+	/* Largest supported aligned erase that doesn't go past 'limit',
+	 * the end of what needs erasing. Past that, flash holds data that
+	 * the download may never rewrite (e.g. a short image in a large
+	 * zone), so it must be left alone */
+	for (int i=0; i<2; i++)
+		if ((g_dfu.flash.erase_ok & (1 << _dfu_erase_op(sizes[i]))) &&
+		    !(addr & (sizes[i] - 1)) && ((addr + sizes[i]) <= limit))
+			return sizes[i];
+
+	return sizes[2];
+}
+
+static unsigned
+_dfu_page_left(uint32_t addr)
+{
+	return g_dfu.flash.page - (addr & (g_dfu.flash.page - 1));
+}
+
+static void
+_dfu_op_start(int type)
+{
+	g_dfu.op.type = type;
+	g_dfu.op.tick = usb_get_tick();
+}
+
+static void
+_dfu_op_done(void)
+{
+	int32_t dt_us;
+
+	if (g_dfu.op.type == FL_OP_NONE)
+		return;
+
+	/* SOF ticks are 1 ms, but averaged over many operations with
+	 * random phase it still converges on the real duration */
+	dt_us = (usb_get_tick() - g_dfu.op.tick) * 1000;
+	g_dfu.op.time_us[g_dfu.op.type] += (dt_us - (int32_t)g_dfu.op.time_us[g_dfu.op.type]) / 8;
+	g_dfu.op.type = FL_OP_NONE;
+}
+
+static uint32_t
+_dfu_write_time(uint32_t *addr_erase, uint32_t addr, uint32_t end)
+{
+	uint32_t t_us = 0;
+
+	/* Erase still needed before it */
+	while (*addr_erase < end) {
+		unsigned sz = _dfu_erase_size(*addr_erase, g_dfu.flash.addr_erase_tgt);
+		t_us += g_dfu.op.time_us[_dfu_erase_op(sz)];
+		*addr_erase += sz;
+	}
+
+	/* Pages to program */
+	while (addr < end) {
+		t_us += g_dfu.op.time_us[FL_OP_PROG];
+		addr += _dfu_page_left(addr);
+	}
+
+	return t_us;
+}
+
+static uint32_t
+_dfu_poll_timeout(int n_blk)
+{
+	uint32_t addr_erase = g_dfu.flash.addr_erase;
+	uint32_t t_us = 0;
+
+	/* Whatever is left of the operation in progress */
+	if (g_dfu.op.type != FL_OP_NONE) {
+		uint32_t dt_us = (usb_get_tick() - g_dfu.op.tick) * 1000;
+		if (dt_us < g_dfu.op.time_us[g_dfu.op.type])
+			t_us += g_dfu.op.time_us[g_dfu.op.type] - dt_us;
+	}
+
+	/* Estimate how long the 'n_blk' oldest blocks need to be written.
+	 * For LZ, only what's already decoded is known */
+	if (g_dfu.fmt == DFU_FMT_LZ)
+		t_us += _dfu_write_time(&addr_erase, g_dfu.lz.prog, g_dfu.lz.out);
+	else
+		for (int k=0; k<n_blk; k++) {
+			int i = (g_dfu.blk_wr + k) % DFU_N_BUF;
+			t_us += _dfu_write_time(&addr_erase, g_dfu.blk[i].prog, g_dfu.blk[i].end);
+		}
+
+	/* Waiting for everything, include the erase past the data */
+	if (n_blk >= g_dfu.blk_cnt)
+		t_us += _dfu_write_time(&addr_erase, g_dfu.flash.addr_erase_tgt, g_dfu.flash.addr_erase_tgt);
+
+	/* Convert and clamp */
+	t_us = (t_us + 999) / 1000;
+
+	if (t_us < DFU_POLL_MS_MIN)
+		return DFU_POLL_MS_MIN;
+	if (t_us > DFU_POLL_MS_MAX)
+		return DFU_POLL_MS_MAX;
+	return t_us;
+}
+
+static int
+_dfu_find_blk(uint32_t addr)
+{
+	for (int k=0; k<g_dfu.blk_cnt; k++) {
+		int i = (g_dfu.blk_wr + k) % DFU_N_BUF;
+		if ((addr >= g_dfu.blk[i].addr) && (addr < g_dfu.blk[i].end))
+			return i;
+	}
+	return -1;
+}
+
+static int
+_dfu_blk_sector(int i, uint32_t addr)
+{
+	return ((addr & ~0xfff) - (g_dfu.blk[i].addr & ~0xfff)) >> 12;
+}
+
+/* Compare the next chunk of the sector at the erase front with the
+ * data about to be written there. Returns true once it's decided
+ * the sector needs to be erased, false otherwise (i.e. either still
+ * undecided or the erase front could be moved without erasing) */
+static bool
+_dfu_compare_step(void)
+{
+	uint32_t sect = g_dfu.flash.addr_erase;
+	const uint8_t *data;
+	int i, l;
+
+	/* No plain data to compare to when decompressing */
+	if (g_dfu.fmt == DFU_FMT_LZ)
+		return true;
+
+	/* Find data for that sector, wait if not received yet */
+	i = _dfu_find_blk(sect);
+	if (i < 0)
+		return false;
+
+	/* Only compare sectors fully covered by a raw block. Partially
+	 * covered ones are just erased, no data was written to them yet */
+	if ((g_dfu.fmt != DFU_FMT_RAW) || (g_dfu.blk[i].end < (sect + 4096)))
+		return true;
+
+	/* Compare next chunk */
+	if (!g_dfu.cmp.ofs) {
+		g_dfu.cmp.same = true;
+		g_dfu.cmp.prog = true;
+	}
+
+	data = &g_dfu.buf[i][sect + g_dfu.cmp.ofs - g_dfu.blk[i].addr];
+	usb_dfu_cb_flash_read(g_dfu.cmp.buf, sect + g_dfu.cmp.ofs, sizeof(g_dfu.cmp.buf));
+
+	for (l=0; l<sizeof(g_dfu.cmp.buf); l++) {
+		if (g_dfu.cmp.buf[l] != data[l]) {
+			g_dfu.cmp.same = false;
+			if ((g_dfu.cmp.buf[l] & data[l]) != data[l]) {
+				g_dfu.cmp.prog = false;
+				break;
+			}
+		}
+	}
+
+	g_dfu.cmp.ofs += sizeof(g_dfu.cmp.buf);
+
+	/* Needs erase ? No point in comparing the rest */
+	if (!g_dfu.cmp.prog) {
+		g_dfu.cmp.ofs = 0;
+		return true;
+	}
+
+	/* Done ? */
+	if (g_dfu.cmp.ofs == 4096) {
+		if (g_dfu.cmp.same)
+			g_dfu.blk[i].skip |= (1 << _dfu_blk_sector(i, sect));
+
+		g_dfu.cmp.ofs = 0;
+		g_dfu.flash.addr_erase += 4096;
+	}
+
+	return false;
+}
+
+static bool
+_dfu_is_blank(const uint8_t *data, int len)
+{
+	while (len--)
+		if (*data++ != 0xff)
+			return false;
+	return true;
+}
+
+static uint32_t
+_dfu_sparse_hdr(int i, int ofs)
+{
+	/* Records are always 32 bits aligned */
+	return *(uint32_t *)&g_dfu.buf[i][ofs];
+}
+
+static bool
+_dfu_sparse_parse(int i)
+{
+	uint32_t addr = g_dfu.blk[i].addr;
+	int ofs = g_dfu.blk[i].ofs;
+
+	/* Walk all records to find the flash range of the block and
+	 * make sure they're all complete */
+	while (ofs < g_dfu.blk[i].len) {
+		uint32_t hdr, n;
+
+		if ((g_dfu.blk[i].len - ofs) < 4)
+			return false;
+
+		hdr = _dfu_sparse_hdr(i, ofs);
+		n   = hdr & USB_DFU_SPARSE_LEN_MSK;
+		ofs += 4;
+
+		if (!(hdr & USB_DFU_SPARSE_BLANK)) {
+			if (((n + 3) & ~3) > (g_dfu.blk[i].len - ofs))
+				return false;
+			ofs += (n + 3) & ~3;
+		}
+
+		/* Check against what's left so huge runs can't wrap around */
+		if (n > (g_dfu.flash.addr_end - addr))
+			return false;
+
+		addr += n;
+	}
+
+	g_dfu.blk[i].end = addr;
+
+	return ofs == g_dfu.blk[i].len;
+}
+
+static void
+_dfu_sparse_next(int i)
+{
+	/* Skip over blank records until we find data or the end */
+	while (!g_dfu.blk[i].rec && (g_dfu.blk[i].ofs < g_dfu.blk[i].len)) {
+		uint32_t hdr = _dfu_sparse_hdr(i, g_dfu.blk[i].ofs);
+		uint32_t n   = hdr & USB_DFU_SPARSE_LEN_MSK;
+
+		g_dfu.blk[i].ofs += 4;
+
+		if (hdr & USB_DFU_SPARSE_BLANK)
+			g_dfu.blk[i].prog += n;
+		else
+			g_dfu.blk[i].rec = n;
+	}
+}
+
+static void
+_dfu_blk_retire(uint32_t len)
+{
+	int i = g_dfu.blk_wr;
+
+	_dfu_stats_block(len, g_dfu.blk[i].tick);
+
+	g_dfu.blk_wr = (i + 1) % DFU_N_BUF;
+	g_dfu.blk_cnt--;
+	g_dfu.armed = true;
+}
+
+static void
+_dfu_flash_drop(void)
+{
+	/* Drop whatever wasn't written yet, an operation in progress
+	 * will still be waited for */
+	g_dfu.blk_cnt = 0;
+	g_dfu.flush   = false;
+	g_dfu.flash.addr_erase_tgt = g_dfu.flash.addr_erase;
+	g_dfu.cmp.ofs = 0;
+	g_dfu.lz.st   = LZ_END;
+	g_dfu.lz.prog = g_dfu.lz.out;
+}
+
+static void
+_dfu_error(enum dfu_status status)
+{
+	_dfu_flash_drop();
+	g_dfu.state  = dfuERROR;
+	g_dfu.status = status;
+}
+
+static int
+_dfu_lz_getc(void)
+{
+	int i = g_dfu.blk_wr;
+	uint8_t c;
+
+	/* Release blocks as soon as they're consumed */
+	while (g_dfu.blk_cnt && (g_dfu.blk[i].ofs >= g_dfu.blk[i].len)) {
+		_dfu_blk_retire(g_dfu.lz.out - g_dfu.flash.addr_dl);
+		g_dfu.flash.addr_dl = g_dfu.lz.out;
+		i = g_dfu.blk_wr;
+	}
+
+	if (!g_dfu.blk_cnt)
+		return -1;
+
+	c = g_dfu.buf[i][g_dfu.blk[i].ofs++];
+
+	if (g_dfu.blk[i].ofs >= g_dfu.blk[i].len) {
+		_dfu_blk_retire(g_dfu.lz.out - g_dfu.flash.addr_dl);
+		g_dfu.flash.addr_dl = g_dfu.lz.out;
+	}
+
+	return c;
+}
+
+static bool
+_dfu_lz_room(void)
+{
+	/* Window full of data not programmed yet ? */
+	if ((g_dfu.lz.out - g_dfu.lz.prog) >= USB_DFU_LZ_WIN)
+		return false;
+
+	/* Doesn't fit in the zone ? */
+	if (g_dfu.lz.out >= g_dfu.flash.addr_end) {
+		_dfu_error(errADDRESS);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+_dfu_lz_put(uint8_t c)
+{
+	g_dfu.lz.win[g_dfu.lz.out++ & (USB_DFU_LZ_WIN - 1)] = c;
+}
+
+static void
+_dfu_lz_decode(void)
+{
+	int budget = DFU_LZ_BUDGET;
+	int c;
+
+	/* Limit how much is done per call to not hold up USB */
+	while (budget)
+	{
+		switch (g_dfu.lz.st) {
+		case LZ_TOKEN:
+			if ((c = _dfu_lz_getc()) < 0)
+				goto starved;
+			g_dfu.lz.lit  = c >> 4;
+			g_dfu.lz.mlen = c & 0xf;
+			g_dfu.lz.st   = (g_dfu.lz.lit == 15) ? LZ_LIT_EXT : LZ_LIT;
+			break;
+
+		case LZ_LIT_EXT:
+			if ((c = _dfu_lz_getc()) < 0)
+				goto starved;
+			g_dfu.lz.lit += c;
+			if (c != 255)
+				g_dfu.lz.st = LZ_LIT;
+			break;
+
+		case LZ_LIT:
+			if (!g_dfu.lz.lit) {
+				g_dfu.lz.st = LZ_OFS_LO;
+				break;
+			}
+			if (!_dfu_lz_room())
+				return;
+			if ((c = _dfu_lz_getc()) < 0)
+				goto starved;
+			_dfu_lz_put(c);
+			g_dfu.lz.lit--;
+			budget--;
+			break;
+
+		case LZ_OFS_LO:
+			if ((c = _dfu_lz_getc()) < 0)
+				goto starved;
+			g_dfu.lz.moff = c;
+			g_dfu.lz.st   = LZ_OFS_HI;
+			break;
+
+		case LZ_OFS_HI:
+			if ((c = _dfu_lz_getc()) < 0)
+				goto starved;
+			g_dfu.lz.moff |= c << 8;
+
+			/* End of stream marker */
+			if (!g_dfu.lz.moff) {
+				g_dfu.lz.st = LZ_END;
+				break;
+			}
+
+			/* Must point within the window and the zone */
+			if ((g_dfu.lz.moff >= USB_DFU_LZ_WIN) ||
+			    (g_dfu.lz.moff > (g_dfu.lz.out - g_dfu.zones[g_dfu.zone].start))) {
+				_dfu_error(errFILE);
+				return;
+			}
+
+			if (g_dfu.lz.mlen == 15) {
+				g_dfu.lz.st = LZ_MATCH_EXT;
+			} else {
+				g_dfu.lz.mlen += 4;
+				g_dfu.lz.st = LZ_MATCH;
+			}
+			break;
+
+		case LZ_MATCH_EXT:
+			if ((c = _dfu_lz_getc()) < 0)
+				goto starved;
+			g_dfu.lz.mlen += c;
+			if (c != 255) {
+				g_dfu.lz.mlen += 4;
+				g_dfu.lz.st = LZ_MATCH;
+			}
+			break;
+
+		case LZ_MATCH:
+			if (!g_dfu.lz.mlen) {
+				g_dfu.lz.st = LZ_TOKEN;
+				break;
+			}
+			if (!_dfu_lz_room())
+				return;
+			_dfu_lz_put(g_dfu.lz.win[(g_dfu.lz.out - g_dfu.lz.moff) & (USB_DFU_LZ_WIN - 1)]);
+			g_dfu.lz.mlen--;
+			budget--;
+			break;
+
+		case LZ_END:
+			/* Ignore anything after the end marker */
+			while (g_dfu.blk_cnt)
+				_dfu_blk_retire(0);
+			return;
+		}
+	}
+
+	return;
+
+starved:
+	/* Everything was received but stream isn't complete */
+	if (g_dfu.flush || (g_dfu.state == dfuMANIFEST_SYNC))
+		_dfu_error(errFILE);
+}
+
+static void
+_dfu_lz_step(void)
+{
+	_dfu_lz_decode();
+
+	/* Erase ahead of the decoded data */
+	if (g_dfu.flash.addr_erase_tgt < g_dfu.lz.out)
+		g_dfu.flash.addr_erase_tgt = g_dfu.lz.out;
+}
+
+static void
+_dfu_flash_reset(uint32_t addr)
+{
+	g_dfu.blk_wr  = 0;
+	g_dfu.blk_cnt = 0;
+	g_dfu.flush   = false;
+	g_dfu.fmt     = DFU_FMT_RAW;
+
+	g_dfu.flash.addr_dl        = addr;
+	g_dfu.flash.addr_erase     = addr;
+	g_dfu.flash.addr_erase_tgt = addr;
+
+	g_dfu.cmp.ofs = 0;
+}
+
 
 static void
 _dfu_tick(void)
 {
+	/* Decompression doesn't need the flash */
+	if (g_dfu.fmt == DFU_FMT_LZ)
+		_dfu_lz_step();
 
 	/* Anything to do ? Is flash ready ? */
-	if ((g_dfu.flash.op == FL_IDLE) || usb_dfu_cb_flash_busy())
+	if (!_dfu_flash_busy() || usb_dfu_cb_flash_busy())
 		return;
 
-	/* Erase */
-	if (g_dfu.flash.op == FL_ERASE) {
-		/* Done ? */
-		if (g_dfu.flash.addr_erase >= (g_dfu.flash.addr_prog + g_dfu.flash.op_len)) {
-			/* Yes, move to programming */
-			g_dfu.flash.op = FL_PROGRAM;
-		} else{
-			/* No, issue the next command */
-			usb_dfu_cb_flash_erase(g_dfu.flash.addr_erase, 4096);
-			g_dfu.flash.addr_erase += 4096;
+	/* Account for the completed operation */
+	_dfu_op_done();
+
+	/* Retire oldest block if it's fully written (LZ decoder retires
+	 * them itself once consumed). Blank runs are skipped without
+	 * programming but still need the erase to go past them */
+	if (g_dfu.blk_cnt && (g_dfu.fmt != DFU_FMT_LZ)) {
+		int i = g_dfu.blk_wr;
+
+		if (g_dfu.fmt == DFU_FMT_SPARSE)
+			_dfu_sparse_next(i);
+
+		if ((g_dfu.blk[i].ofs >= g_dfu.blk[i].len) && (g_dfu.flash.addr_erase >= g_dfu.blk[i].end))
+			_dfu_blk_retire(g_dfu.blk[i].end - g_dfu.blk[i].addr);
+	}
+
+	/* Programming of decoded data that's already erased. Only full
+	 * pages unless it's the end of the stream */
+	if (g_dfu.fmt == DFU_FMT_LZ) {
+		uint32_t addr = g_dfu.lz.prog;
+		unsigned l  = g_dfu.lz.out - addr;
+		unsigned pl = _dfu_page_left(addr);
+
+		if (((l >= pl) || (l && (g_dfu.lz.st == LZ_END))) && (addr < g_dfu.flash.addr_erase)) {
+			/* Pages never wrap around in the window */
+			const uint8_t *data = &g_dfu.lz.win[addr & (USB_DFU_LZ_WIN - 1)];
+
+			if (l > pl)
+				l = pl;
+
+			if (!_dfu_is_blank(data, l)) {
+				_dfu_op_start(FL_OP_PROG);
+				usb_dfu_cb_flash_program(data, addr, l);
+			}
+
+			g_dfu.lz.prog += l;
+
+			return;
 		}
 	}
 
-	/* Programming */
-	if ((g_dfu.flash.op == FL_PROGRAM) && (g_dfu.state == dfuDNLOAD_SYNC)) {
-		/* Done ? */
-		if (g_dfu.flash.op_ofs == g_dfu.flash.op_len) {
-			/* Yes ! */
-			g_dfu.flash.op = FL_IDLE;
-			g_dfu.state = dfuDNLOAD_IDLE;
-			g_dfu.flash.addr_prog += g_dfu.flash.op_len;
-			g_dfu.armed = true;
-		} else {
+	/* Programming of data that's already erased */
+	if (g_dfu.blk_cnt && g_dfu.blk[g_dfu.blk_wr].rec) {
+		int i = g_dfu.blk_wr;
+		uint32_t addr = g_dfu.blk[i].prog;
+
+		if (addr < g_dfu.flash.addr_erase) {
+			const uint8_t *data = &g_dfu.buf[i][g_dfu.blk[i].ofs];
+			bool write = true;
+
 			/* Max len */
-			unsigned l = g_dfu.flash.op_len - g_dfu.flash.op_ofs;
-			unsigned pl = 256 - ((g_dfu.flash.addr_prog + g_dfu.flash.op_ofs) & 0xff);
+			unsigned l = g_dfu.blk[i].rec;
+			unsigned pl = _dfu_page_left(addr);
+
+			/* Sector already holds that data ? */
+			if (g_dfu.blk[i].skip & (1 << _dfu_blk_sector(i, addr))) {
+				pl = 4096 - (addr & 0xfff);
+				write = false;
+			}
+
 			if (l > pl)
 				l = pl;
 
+			/* Nothing to write for blank data, flash is erased */
+			if (write && _dfu_is_blank(data, l))
+				write = false;
+
 			/* Write page */
-			usb_dfu_cb_flash_program(&g_dfu.buf[g_dfu.flash.op_ofs], g_dfu.flash.addr_prog + g_dfu.flash.op_ofs, l);
+			if (write) {
+				_dfu_op_start(FL_OP_PROG);
+				usb_dfu_cb_flash_program(data, addr, l);
+			}
 
 			/* Next page */
-			g_dfu.flash.op_ofs += l;
+			g_dfu.blk[i].ofs  += l;
+			g_dfu.blk[i].prog += l;
+			g_dfu.blk[i].rec  -= l;
+
+			if (!g_dfu.blk[i].rec)
+				g_dfu.blk[i].ofs = (g_dfu.blk[i].ofs + 3) & ~3;
+
+			return;
+		}
+	}
+
+	/* Erase ahead */
+	if (g_dfu.flash.addr_erase < g_dfu.flash.addr_erase_tgt) {
+		unsigned sz;
+
+		if (g_dfu.zones[g_dfu.zone].flags & USB_DFU_ZONE_F_COMPARE) {
+			/* Only erase sectors whose content can't just be kept
+			 * or programmed over */
+			if (!_dfu_compare_step())
+				return;
+			sz = 4096;
+		} else {
+			sz = _dfu_erase_size(g_dfu.flash.addr_erase, g_dfu.flash.addr_erase_tgt);
 		}
+		_dfu_op_start(_dfu_erase_op(sz));
+		usb_dfu_cb_flash_erase(g_dfu.flash.addr_erase, sz);
+		g_dfu.flash.addr_erase += sz;
 	}
 }
 
+static void
+_dfu_zone_select(int zone)
+{
+	g_dfu.state = dfuIDLE;
+	g_dfu.zone  = zone;
+
+	g_dfu.flash.addr_read = g_dfu.zones[zone].start;
+	g_dfu.flash.addr_end  = g_dfu.zones[zone].end;
+
+	_dfu_flash_reset(g_dfu.zones[zone].start);
+}
+
 static void
 _dfu_bus_reset(void)
 {
@@ -174,8 +869,10 @@ _dfu_bus_reset(void)
 static void
 _dfu_state_chg(enum usb_dev_state state)
 {
-	if (state == USB_DS_CONFIGURED)
+	if (state == USB_DS_CONFIGURED) {
 		g_dfu.state = dfuIDLE;
+		g_dfu.ext   = false;
+	}
 }
 
 static bool
@@ -186,17 +883,153 @@ _dfu_detach_done_cb(struct usb_xfer *xfer)
 }
 
 static bool
-_dfu_dnload_done_cb(struct usb_xfer *xfer)
+_dfu_upload_data_cb(struct usb_xfer *xfer)
 {
+	int len = xfer->len - xfer->ofs;
+
+	if (len > USB_XFER_STREAM_LEN)
+		len = USB_XFER_STREAM_LEN;
+
+	usb_dfu_cb_flash_read(&xfer->data[xfer->ofs], g_dfu.flash.addr_read + xfer->ofs, len);
+
+	return true;
+}
+
+static bool
+_dfu_upload_done_cb(struct usb_xfer *xfer)
+{
+	g_dfu.flash.addr_read += xfer->len;
+	return true;
+}
+
+static uint8_t *
+_dfu_dl_blk_setup(unsigned len)
+{
+	int i;
+
+	/* New download ? */
+	if (g_dfu.state == dfuIDLE) {
+		memset(&g_dfu.stats, 0x00, sizeof(g_dfu.stats));
+
+		g_dfu.dl_first = true;
+		g_dfu.flush    = false;
+		g_dfu.fmt      = DFU_FMT_RAW;
+
+		/* Start erasing the whole zone right away if requested,
+		 * programming will follow the erase front */
+		if ((g_dfu.zones[g_dfu.zone].flags & (USB_DFU_ZONE_F_PREERASE | USB_DFU_ZONE_F_COMPARE)) == USB_DFU_ZONE_F_PREERASE)
+			g_dfu.flash.addr_erase_tgt = g_dfu.flash.addr_end;
+	}
+
+	/* Check length doesn't overflow (packed payloads are
+	 * checked once received / decoded) */
+	if ((g_dfu.fmt == DFU_FMT_RAW) && ((g_dfu.flash.addr_dl + len) > g_dfu.flash.addr_end))
+		return NULL;
+
+	/* Need a free buffer */
+	if ((len > DFU_BUF_SIZE) || !_dfu_can_accept())
+		return NULL;
+
+	/* Setup buffer for data */
+	i = g_dfu.blk_rx = (g_dfu.blk_wr + g_dfu.blk_cnt) % DFU_N_BUF;
+	g_dfu.blk[i].addr = g_dfu.flash.addr_dl;
+	g_dfu.blk[i].len  = len;
+	g_dfu.blk[i].skip = 0;
+
+	/* Start erasing while data comes in */
+	if ((g_dfu.fmt == DFU_FMT_RAW) && (g_dfu.flash.addr_erase_tgt < (g_dfu.flash.addr_dl + len)))
+		g_dfu.flash.addr_erase_tgt = g_dfu.flash.addr_dl + len;
+
+	return g_dfu.buf[i];
+}
+
+static void
+_dfu_dl_blk_queue(void)
+{
+	int i = g_dfu.blk_rx;
+
+	/* Packed payload ? */
+	g_dfu.blk[i].ofs  = 0;
+	g_dfu.blk[i].prog = g_dfu.blk[i].addr;
+
+	if (g_dfu.dl_first && (g_dfu.blk[i].len >= 8) &&
+	    (_dfu_sparse_hdr(i, 0) == USB_DFU_PACK_MAGIC))
+	{
+		switch (_dfu_sparse_hdr(i, 4)) {
+		case USB_DFU_PACK_SPARSE:
+			g_dfu.fmt = DFU_FMT_SPARSE;
+			break;
+
+		case USB_DFU_PACK_LZ:
+			if (g_dfu.zones[g_dfu.zone].flags & USB_DFU_ZONE_F_LZ) {
+				g_dfu.fmt = DFU_FMT_LZ;
+				break;
+			}
+			/* fall-through */
+
+		default:
+			_dfu_error(errFILE);
+			return;
+		}
+
+		g_dfu.blk[i].ofs = 8;
+
+		g_dfu.lz.st   = LZ_TOKEN;
+		g_dfu.lz.out  = g_dfu.blk[i].addr;
+		g_dfu.lz.prog = g_dfu.blk[i].addr;
+	}
+
+	g_dfu.dl_first = false;
+
+	switch (g_dfu.fmt) {
+	case DFU_FMT_SPARSE:
+		g_dfu.blk[i].rec = 0;
+
+		if (!_dfu_sparse_parse(i)) {
+			_dfu_error(errFILE);
+			return;
+		}
+
+		if (g_dfu.flash.addr_erase_tgt < g_dfu.blk[i].end)
+			g_dfu.flash.addr_erase_tgt = g_dfu.blk[i].end;
+		break;
+
+	case DFU_FMT_LZ:
+		/* Consumed by the decoder, doesn't map to flash directly */
+		g_dfu.blk[i].rec = 0;
+		g_dfu.blk[i].end = g_dfu.blk[i].addr;
+		break;
+
+	default:
+		g_dfu.blk[i].rec = g_dfu.blk[i].len;
+		g_dfu.blk[i].end = g_dfu.blk[i].addr + g_dfu.blk[i].len;
+	}
+
+	/* Queue the block for writing, flash time starts now */
+	g_dfu.blk[i].tick = usb_get_tick();
+
+	g_dfu.blk_cnt++;
+	g_dfu.flush = (g_dfu.blk[i].len < DFU_BUF_SIZE);
+
+	/* LZ blocks don't map to flash, the decoder moves it along */
+	if (g_dfu.fmt != DFU_FMT_LZ)
+		g_dfu.flash.addr_dl = g_dfu.blk[i].end;
+
 	/* State update */
 	g_dfu.state = dfuDNLOAD_SYNC;
+}
 
+static bool
+_dfu_dnload_done_cb(struct usb_xfer *xfer)
+{
+	_dfu_dl_blk_queue();
 	return true;
 }
 
 static enum usb_fnd_resp
 _dfu_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 {
+	uint32_t poll_ms = 0;
 	uint8_t state;
 
 	/* If this a class or vendor request for DFU interface ? */
@@ -205,9 +1038,12 @@ _dfu_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 
 #ifdef DFU_VENDOR_PROTO
 	if ((USB_REQ_TYPE(req) | USB_REQ_RCPT(req)) == (USB_REQ_TYPE_VENDOR | USB_REQ_RCPT_INTF)) {
-		/* Let vendor code use our large buffer */
-		xfer->data = g_dfu.buf;
-		xfer->len  = sizeof(g_dfu.buf);
+		/* Let vendor code use our large buffer, if it's free */
+		if (_dfu_buf_busy())
+			return USB_FND_ERROR;
+
+		xfer->data = g_dfu.buf[0];
+		xfer->len  = DFU_BUF_SIZE;
 
 		/* Call vendor code */
 		return dfu_vendor_ctrl_req(req, xfer);
@@ -217,10 +1053,21 @@ _dfu_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 	if ((USB_REQ_TYPE(req) | USB_REQ_RCPT(req)) != (USB_REQ_TYPE_CLASS | USB_REQ_RCPT_INTF))
 		return USB_FND_CONTINUE;
 
+	/* The state belongs to a download from another interface until
+	 * it's done, only let the host look at it */
+	if (g_dfu.ext && (req->bRequest != USB_REQ_DFU_GETSTATUS) && (req->bRequest != USB_REQ_DFU_GETSTATE))
+		return USB_FND_ERROR;
+
 	/* Check if this request is allowed in this state */
 	if ((dfu_valid_req[g_dfu.state] & (1 << req->bRequest)) == 0)
 		goto error;
 
+	/* A download from another interface may have used another zone,
+	 * transfers started here are on the alt setting one */
+	if ((g_dfu.state == dfuIDLE) && (g_dfu.zone != g_dfu.alt) &&
+	    ((req->bRequest == USB_REQ_DFU_DNLOAD) || (req->bRequest == USB_REQ_DFU_UPLOAD)))
+		_dfu_zone_select(g_dfu.alt);
+
 	/* Handle request */
 	switch (req->wRequestAndType)
 	{
@@ -233,64 +1080,65 @@ _dfu_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 	case USB_RT_DFU_DNLOAD:
 		/* Check for last block */
 		if (req->wLength) {
-			/* Check length doesn't overflow */
-			if ((g_dfu.flash.addr_erase + req->wLength) > g_dfu.flash.addr_end)
+			/* Setup buffer for data */
+			xfer->data = _dfu_dl_blk_setup(req->wLength);
+			if (!xfer->data)
 				goto error;
 
-			/* Setup buffer for data */
 			xfer->len     = req->wLength;
-			xfer->data    = g_dfu.buf;
 			xfer->cb_done = _dfu_dnload_done_cb;
-
-			/* Prepare flash */
-			g_dfu.flash.op_ofs = 0;
-			g_dfu.flash.op_len = req->wLength;
-			g_dfu.flash.op     = FL_ERASE;
 		} else {
-			/* Last xfer */
-			g_dfu.state = dfuIDLE;
+			/* Last xfer, wait for pending blocks if any */
+			g_dfu.state = _dfu_flash_busy() ? dfuMANIFEST_SYNC : dfuIDLE;
 		}
 		break;
 
 	case USB_RT_DFU_UPLOAD:
-		/* Current USB API doesn't have option to defer data, so read
-		 * flash synchronously here, not a big deal since we have
-		 * nothing better to do anyway */
+		/* Buffer can't be used as scratch while blocks are queued */
+		if (_dfu_buf_busy())
+			goto error;
 
 		/* Setup buffer for data */
 		xfer->len  = req->wLength;
-		xfer->data = g_dfu.buf;
+		xfer->data = g_dfu.buf[0];
 
 		/* Check length doesn't overflow */
+		if (xfer->len > DFU_BUF_SIZE)
+			xfer->len = DFU_BUF_SIZE;
+
 		if ((g_dfu.flash.addr_read + xfer->len) > g_dfu.flash.addr_end)
 			xfer->len = g_dfu.flash.addr_end - g_dfu.flash.addr_read;
 
-		/* Read */
-		if (xfer->len) {
-			usb_dfu_cb_flash_read(xfer->data, g_dfu.flash.addr_read, xfer->len);
-			g_dfu.flash.addr_read += xfer->len;
-		}
+		/* Flash is read packet by packet as they're sent out */
+		xfer->cb_data = _dfu_upload_data_cb;
+		xfer->cb_done = _dfu_upload_done_cb;
 		break;
 
 	case USB_RT_DFU_GETSTATUS:
 		/* Update state */
 		if (g_dfu.state == dfuDNLOAD_SYNC) {
-			if (g_dfu.flash.op == FL_IDLE) {
+			if (_dfu_can_accept()) {
 				g_dfu.state = state = dfuDNLOAD_IDLE;
 			} else {
 				state = dfuDNBUSY;
+				poll_ms = _dfu_poll_timeout(g_dfu.flush ? g_dfu.blk_cnt : 1);
 			}
 		} else if (g_dfu.state == dfuMANIFEST_SYNC) {
-			g_dfu.state = state = dfuIDLE;
+			if (!_dfu_flash_busy()) {
+				g_dfu.state = state = dfuIDLE;
+			} else {
+				state = dfuMANIFEST;
+				poll_ms = _dfu_poll_timeout(g_dfu.blk_cnt);
+			}
 		} else {
 			state = g_dfu.state;
 		}
 
 		/* Return data */
 		xfer->data[0] = g_dfu.status;
-		xfer->data[1] = (DFU_POLL_MS >>  0) & 0xff;
-		xfer->data[2] = (DFU_POLL_MS >>  8) & 0xff;
-		xfer->data[3] = (DFU_POLL_MS >> 16) & 0xff;
+		xfer->data[1] = (poll_ms >>  0) & 0xff;
+		xfer->data[2] = (poll_ms >>  8) & 0xff;
+		xfer->data[3] = (poll_ms >> 16) & 0xff;
 		xfer->data[4] = state;
 		xfer->data[5] = 0;
 		break;
@@ -307,7 +1155,8 @@ _dfu_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 		break;
 
 	case USB_RT_DFU_ABORT:
-		/* Go to IDLE */
+		/* Drop whatever wasn't written yet and go to IDLE */
+		_dfu_flash_drop();
 		g_dfu.state = dfuIDLE;
 		break;
 
@@ -334,14 +1183,12 @@ _dfu_set_intf(const struct usb_intf_desc *base, const struct usb_intf_desc *sel)
 	if (sel->bAlternateSetting >= g_dfu.n_zones)
 		return USB_FND_ERROR;
 
-	g_dfu.state = dfuIDLE;
-	g_dfu.intf  = sel->bInterfaceNumber;
-	g_dfu.alt   = sel->bAlternateSetting;
+	g_dfu.intf = sel->bInterfaceNumber;
+	g_dfu.alt  = sel->bAlternateSetting;
 
-	g_dfu.flash.addr_read  = g_dfu.zones[g_dfu.alt].start;
-	g_dfu.flash.addr_prog  = g_dfu.zones[g_dfu.alt].start;
-	g_dfu.flash.addr_erase = g_dfu.zones[g_dfu.alt].start;
-	g_dfu.flash.addr_end   = g_dfu.zones[g_dfu.alt].end;
+	/* Zone switch is deferred to the next transfer if busy */
+	if (!g_dfu.ext)
+		_dfu_zone_select(g_dfu.alt);
 
 	return USB_FND_SUCCESS;
 }
@@ -361,7 +1208,7 @@ _dfu_get_intf(const struct usb_intf_desc *base, uint8_t *alt)
 
 
 static struct usb_fn_drv _dfu_drv = {
-	.sof		= _dfu_tick,
+	.poll		= _dfu_tick,
 	.bus_reset      = _dfu_bus_reset,
 	.state_chg	= _dfu_state_chg,
 	.ctrl_req	= _dfu_ctrl_req,
@@ -370,12 +1217,101 @@ static struct usb_fn_drv _dfu_drv = {
 };
 
 
+/* Downloads from other interfaces (see usb_dfu_priv.h) go through the
+ * same block queue as DNLOAD requests. The caller picks the zone and
+ * then behaves like a host issuing DNLOADs of full blocks */
+
+bool
+usb_dfu_dl_start(int zone)
+{
+	/* Previous download must be completely written */
+	if ((zone < 0) || (zone >= g_dfu.n_zones) || g_dfu.ext || _dfu_flash_busy())
+		return false;
+
+	if ((g_dfu.state != dfuIDLE) && (g_dfu.state != dfuERROR))
+		return false;
+
+	g_dfu.status = OK;
+
+	_dfu_zone_select(zone);
+	g_dfu.ext = true;
+
+	return true;
+}
+
+uint8_t *
+usb_dfu_dl_blk_get(unsigned len)
+{
+	uint8_t *buf;
+
+	if ((g_dfu.state == dfuERROR) || !_dfu_can_accept())
+		return NULL;
+
+	/* Only fails now if it doesn't fit in the zone */
+	buf = _dfu_dl_blk_setup(len);
+	if (!buf)
+		_dfu_error(errADDRESS);
+
+	return buf;
+}
+
+void
+usb_dfu_dl_blk_put(void)
+{
+	/* Error while it was filled, already dropped */
+	if (g_dfu.state != dfuERROR)
+		_dfu_dl_blk_queue();
+}
+
+void
+usb_dfu_dl_finish(void)
+{
+	if (g_dfu.state != dfuERROR)
+		g_dfu.state = _dfu_flash_busy() ? dfuMANIFEST_SYNC : dfuIDLE;
+}
+
+bool
+usb_dfu_dl_done(void)
+{
+	if (g_dfu.state == dfuMANIFEST_SYNC) {
+		if (_dfu_flash_busy())
+			return false;
+		g_dfu.state = dfuIDLE;
+	}
+
+	g_dfu.ext = false;
+
+	return true;
+}
+
+enum dfu_status
+usb_dfu_dl_status(void)
+{
+	return (g_dfu.state == dfuERROR) ? g_dfu.status : OK;
+}
+
+const struct usb_dfu_zone *
+usb_dfu_zone_get(int zone)
+{
+	if ((zone < 0) || (zone >= g_dfu.n_zones))
+		return NULL;
+
+	return &g_dfu.zones[zone];
+}
+
+
 void __attribute__((weak))
 usb_dfu_cb_reboot(void)
 {
 	/* Nothing */
 }
 
+const struct usb_dfu_stats *
+usb_dfu_get_stats(void)
+{
+	return &g_dfu.stats;
+}
+
 void
 usb_dfu_init(const struct usb_dfu_zone *zones, int n_zones)
 {
@@ -385,5 +1321,34 @@ usb_dfu_init(const struct usb_dfu_zone *zones, int n_zones)
 	g_dfu.n_zones = n_zones;
 	g_dfu.state   = appDETACH;
 
+	g_dfu.lz.st   = LZ_END;
+	g_dfu.op.type = FL_OP_NONE;
+	memcpy(g_dfu.op.time_us, dfu_op_time_default_us, sizeof(g_dfu.op.time_us));
+
+	g_dfu.flash.page     = 256;
+	g_dfu.flash.erase_ok = (1 << FL_OP_ERASE_4K) | (1 << FL_OP_ERASE_32K) | (1 << FL_OP_ERASE_64K);
+
 	usb_register_function_driver(&_dfu_drv);
 }
+
+void
+usb_dfu_set_flash_info(const struct usb_dfu_flash_info *info)
+{
+	/* Largest power of 2 fitting in both the page and our 256 max */
+	g_dfu.flash.page = 256;
+	while (g_dfu.flash.page > info->page_size && g_dfu.flash.page > 1)
+		g_dfu.flash.page >>= 1;
+
+	if (info->prog_time_us)
+		g_dfu.op.time_us[FL_OP_PROG] = info->prog_time_us;
+
+	/* Typical times replace the defaults, 4k is always used */
+	g_dfu.flash.erase_ok = 1 << FL_OP_ERASE_4K;
+
+	for (int i=0; i<3; i++) {
+		if (!info->erase_time_us[i])
+			continue;
+		g_dfu.op.time_us[FL_OP_ERASE_4K + i] = info->erase_time_us[i];
+		g_dfu.flash.erase_ok |= 1 << (FL_OP_ERASE_4K + i);
+	}
+}
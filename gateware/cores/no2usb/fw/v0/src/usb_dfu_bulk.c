@@ -0,0 +1,416 @@
+/*
+ * usb_dfu_bulk.c
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+/*
+ * Bulk endpoints companion to the DFU driver. Control transfers move
+ * one 64 bytes packet per transaction and need a SETUP / status round
+ * trip for each block, while bulk gets as many packets per frame as the
+ * bus allows. Data goes through the same block queue as DNLOAD requests
+ * so zones, payload formats (raw / sparse / LZ) and flash scheduling are
+ * all shared with DFU.
+ *
+ * Protocol :
+ *  - The host writes a command (struct usb_dfu_bulk_cmd) as a single
+ *    16 bytes packet on the bulk OUT endpoint.
+ *  - For DNLOAD, it then writes 'len' bytes of payload (exactly like
+ *    the concatenation of DNLOAD blocks, with a block size given by
+ *    STATUS), ending with a short packet if needed.
+ *  - Each command is answered with a single struct usb_dfu_bulk_resp
+ *    on the bulk IN endpoint : right away for STATUS, once everything is
+ *    written to flash for DNLOAD and once done for HASH (CRC32, zlib
+ *    style, of the first 'len' bytes of the zone).
+ *
+ * Errors during a download are only reported in the final response,
+ * the host can send all the data without checking anything.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <no2usb/usb_hw.h>
+#include <no2usb/usb_priv.h>
+#include <no2usb/usb.h>
+#include <no2usb/usb_dfu.h>
+#include <no2usb/usb_dfu_bulk.h>
+#include <no2usb/usb_dfu_priv.h>
+#include <no2usb/usb_dfu_proto.h>
+
+
+#define BULK_PKT_LEN		64
+#define BULK_HASH_CHUNK		256
+
+/* OUT BDs, a ring when the core has one so the host never waits on us */
+#if USB_BD_RING
+# define BULK_OUT_BDS		USB_BD_RING
+#else
+# define BULK_OUT_BDS		2
+#endif
+
+static struct {
+	int  n_zones;
+	bool active;	// Interface configured
+	bool booted;	// EPs have their buffers since last bus reset
+
+	uint8_t ep_out;
+	uint8_t ep_in;
+	int     bdi;	// Next OUT BD to be filled by the hardware
+
+	enum {
+		BULK_IDLE = 0,	// Waiting for a command
+		BULK_DNLOAD,	// Receiving payload
+		BULK_DNLOAD_WAIT,	// Waiting for flash writes to complete
+		BULK_HASH,	// Hashing flash content
+		BULK_RESP,	// Response queued
+	} state;
+
+	struct usb_dfu_bulk_cmd  cmd;
+	struct usb_dfu_bulk_resp resp;
+	uint32_t tick;	// Command start time
+
+	/* Download */
+	bool     started;	// DFU download started, DFU state is ours
+	uint32_t left;		// Bytes left to receive (or to hash)
+	enum dfu_status err;	// First error, reported at the end
+	uint8_t *blk;		// Block being filled
+	unsigned blk_len;
+	unsigned blk_ofs;
+
+	/* Hash */
+	uint32_t addr;
+	uint32_t crc;
+	uint8_t  buf[BULK_HASH_CHUNK] __attribute__((aligned(4)));
+} g_bulk;
+
+static const uint32_t crc32_tab[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+
+static inline volatile struct usb_ep *
+_bulk_ep_out(void)
+{
+	return &usb_ep_regs[g_bulk.ep_out & 0xf].out;
+}
+
+static inline volatile struct usb_bd *
+_bulk_bd_out(int i)
+{
+#if USB_BD_RING
+	return usb_ep_ring_bd(g_bulk.ep_out, i);
+#else
+	return &_bulk_ep_out()->bd[i];
+#endif
+}
+
+static inline volatile struct usb_ep *
+_bulk_ep_in(void)
+{
+	return &usb_ep_regs[g_bulk.ep_in & 0xf].in;
+}
+
+static void
+_bulk_resp(enum dfu_status status, uint32_t value, uint32_t aux)
+{
+	volatile struct usb_ep *ep = _bulk_ep_in();
+
+	g_bulk.resp.op     = g_bulk.cmd.op;
+	g_bulk.resp.status = status;
+	g_bulk.resp.value  = value;
+	g_bulk.resp.aux    = aux;
+
+	usb_data_write(ep->bd[0].ptr, &g_bulk.resp, sizeof(g_bulk.resp));
+	ep->bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(sizeof(g_bulk.resp));
+
+	g_bulk.state = BULK_RESP;
+}
+
+static void
+_bulk_dl_end(void)
+{
+	/* Anything received is queued, wait for it to be written. If the
+	 * download was refused, the DFU state isn't ours to touch */
+	g_bulk.blk = NULL;
+	if (g_bulk.started)
+		usb_dfu_dl_finish();
+	g_bulk.state = BULK_DNLOAD_WAIT;
+}
+
+static bool
+_bulk_dl_data(unsigned ptr, unsigned len)
+{
+	/* A short packet ends the transfer, it has to be the last */
+	if ((len < BULK_PKT_LEN) && (len < g_bulk.left)) {
+		if (g_bulk.err == OK)
+			g_bulk.err = errNOTDONE;
+		g_bulk.left = len;
+	}
+
+	if (len > g_bulk.left)
+		len = g_bulk.left;
+
+	/* Get a block buffer, hold the packet until one is free */
+	if ((g_bulk.err == OK) && !g_bulk.blk) {
+		g_bulk.blk_len = (g_bulk.left < USB_DFU_TRANSFER_SIZE) ? g_bulk.left : USB_DFU_TRANSFER_SIZE;
+		g_bulk.blk_ofs = 0;
+		g_bulk.blk = usb_dfu_dl_blk_get(g_bulk.blk_len);
+		g_bulk.err = usb_dfu_dl_status();
+
+		if (!g_bulk.blk && (g_bulk.err == OK))
+			return false;
+	}
+
+	/* After an error, data is just dropped */
+	if (g_bulk.err == OK) {
+		usb_data_read(&g_bulk.blk[g_bulk.blk_ofs], ptr, len);
+		g_bulk.blk_ofs += len;
+
+		if (g_bulk.blk_ofs == g_bulk.blk_len) {
+			usb_dfu_dl_blk_put();
+			g_bulk.blk = NULL;
+		}
+	}
+
+	g_bulk.left -= len;
+	if (!g_bulk.left)
+		_bulk_dl_end();
+
+	return true;
+}
+
+static void
+_bulk_cmd(unsigned ptr, unsigned len)
+{
+	const struct usb_dfu_zone *zone;
+
+	/* Anything not looking like a command is ignored (e.g. leftover of
+	 * an interrupted download) */
+	if (len != sizeof(struct usb_dfu_bulk_cmd))
+		return;
+
+	usb_data_read(&g_bulk.cmd, ptr, len);
+
+	if (g_bulk.cmd.magic != USB_DFU_BULK_MAGIC)
+		return;
+
+	g_bulk.tick = usb_get_tick();
+
+	zone = (g_bulk.cmd.zone < g_bulk.n_zones) ? usb_dfu_zone_get(g_bulk.cmd.zone) : NULL;
+
+	switch (g_bulk.cmd.op)
+	{
+	case USB_DFU_BULK_OP_STATUS:
+		_bulk_resp(OK, USB_DFU_TRANSFER_SIZE, g_bulk.n_zones);
+		break;
+
+	case USB_DFU_BULK_OP_DNLOAD:
+		/* Payload follows no matter what, errors are reported after it */
+		g_bulk.state = BULK_DNLOAD;
+		g_bulk.left  = g_bulk.cmd.len;
+		g_bulk.blk   = NULL;
+		g_bulk.started = zone && usb_dfu_dl_start(g_bulk.cmd.zone);
+		g_bulk.err   = g_bulk.started ? OK : errTARGET;
+
+		if (!g_bulk.left)
+			_bulk_dl_end();
+		break;
+
+	case USB_DFU_BULK_OP_HASH:
+		if (!zone || (g_bulk.cmd.len > (zone->end - zone->start))) {
+			_bulk_resp(errADDRESS, 0, 0);
+			break;
+		}
+
+		g_bulk.state = BULK_HASH;
+		g_bulk.addr  = zone->start;
+		g_bulk.left  = g_bulk.cmd.len;
+		g_bulk.crc   = 0xffffffff;
+		break;
+
+	default:
+		_bulk_resp(errUNKNOWN, 0, 0);
+	}
+}
+
+static void
+_bulk_hash_step(void)
+{
+	unsigned len = (g_bulk.left < BULK_HASH_CHUNK) ? g_bulk.left : BULK_HASH_CHUNK;
+	uint32_t crc = g_bulk.crc;
+
+	/* One chunk per poll to not hold up USB */
+	usb_dfu_cb_flash_read(g_bulk.buf, g_bulk.addr, len);
+
+	for (int i=0; i<len; i++) {
+		crc ^= g_bulk.buf[i];
+		crc = (crc >> 4) ^ crc32_tab[crc & 15];
+		crc = (crc >> 4) ^ crc32_tab[crc & 15];
+	}
+
+	g_bulk.crc   = crc;
+	g_bulk.addr += len;
+	g_bulk.left -= len;
+
+	if (!g_bulk.left)
+		_bulk_resp(OK, ~g_bulk.crc, usb_get_tick() - g_bulk.tick);
+}
+
+static void
+_bulk_out_poll(void)
+{
+	/* BDs are filled in order, errors advance the index too */
+	while ((g_bulk.state == BULK_IDLE) || (g_bulk.state == BULK_DNLOAD))
+	{
+		volatile struct usb_bd *bd = _bulk_bd_out(g_bulk.bdi);
+		uint32_t csr = bd->csr;
+
+		if ((csr & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) {
+			unsigned ptr = bd->ptr;
+			unsigned len = (csr & USB_BD_LEN_MSK) - 2;
+
+			if (g_bulk.state == BULK_IDLE)
+				_bulk_cmd(ptr, len);
+			else if (!_bulk_dl_data(ptr, len))
+				break;
+		} else if ((csr & USB_BD_STATE_MSK) != USB_BD_STATE_DONE_ERR) {
+			break;
+		}
+
+		bd->csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(BULK_PKT_LEN);
+		g_bulk.bdi = (g_bulk.bdi + 1) % BULK_OUT_BDS;
+	}
+}
+
+static void
+_bulk_poll(void)
+{
+	const struct usb_dfu_stats *stats;
+
+	if (!g_bulk.active)
+		return;
+
+	switch (g_bulk.state)
+	{
+	case BULK_IDLE:
+	case BULK_DNLOAD:
+		_bulk_out_poll();
+		break;
+
+	case BULK_DNLOAD_WAIT:
+		if (!g_bulk.started) {
+			_bulk_resp(g_bulk.err, 0, 0);
+			break;
+		}
+
+		if (!usb_dfu_dl_done())
+			break;
+
+		if (g_bulk.err == OK)
+			g_bulk.err = usb_dfu_dl_status();
+
+		stats = usb_dfu_get_stats();
+		_bulk_resp(g_bulk.err, stats->bytes, stats->blk_total_ms);
+		break;
+
+	case BULK_HASH:
+		_bulk_hash_step();
+		break;
+
+	case BULK_RESP:
+		if ((_bulk_ep_in()->bd[0].csr & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) {
+			_bulk_ep_in()->bd[0].csr = 0;
+			g_bulk.state = BULK_IDLE;
+		}
+		break;
+	}
+}
+
+static void
+_bulk_bus_reset(void)
+{
+	g_bulk.active = false;
+	g_bulk.booted = false;
+}
+
+static void
+_bulk_state_chg(enum usb_dev_state state)
+{
+	/* Suspend doesn't lose the configuration */
+	if (state < USB_DS_CONFIGURED)
+		g_bulk.active = false;
+}
+
+static enum usb_fnd_resp
+_bulk_set_intf(const struct usb_intf_desc *base, const struct usb_intf_desc *sel)
+{
+	const struct usb_ep_desc *ep;
+	const void *eod;
+
+	if ((sel->bInterfaceClass != USB_DFU_BULK_INTF_CLASS) ||
+	    (sel->bInterfaceSubClass != USB_DFU_BULK_INTF_SUBCLASS) ||
+	    (sel->bInterfaceProtocol != USB_DFU_BULK_INTF_PROTOCOL))
+		return USB_FND_CONTINUE;
+
+	/* Find our EPs */
+	eod = ((uint8_t*)g_usb.conf) + g_usb.conf->wTotalLength;
+	ep  = (void*)sel;
+
+	for (int i=0; i<sel->bNumEndpoints; i++) {
+		ep = usb_desc_find(usb_desc_next(ep), eod, USB_DT_EP);
+		if (!ep)
+			return USB_FND_ERROR;
+
+		if (ep->bEndpointAddress & 0x80)
+			g_bulk.ep_in  = ep->bEndpointAddress;
+		else
+			g_bulk.ep_out = ep->bEndpointAddress;
+	}
+
+	/* Buffers are only allocated once, SET_CONFIGURATION may be repeated */
+	if (!g_bulk.booted) {
+#if USB_BD_RING
+		usb_ep_boot_ring(base, g_bulk.ep_out);
+#else
+		usb_ep_boot(base, g_bulk.ep_out, true);
+#endif
+		usb_ep_boot(base, g_bulk.ep_in,  false);
+		g_bulk.booted = true;
+	} else {
+		usb_ep_reconf(sel, g_bulk.ep_out);
+		usb_ep_reconf(sel, g_bulk.ep_in);
+	}
+
+	/* Start clean, all OUT buffers ready */
+	for (int i=0; i<BULK_OUT_BDS; i++)
+		_bulk_bd_out(i)->csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(BULK_PKT_LEN);
+
+	g_bulk.bdi    = 0;
+	g_bulk.state  = BULK_IDLE;
+	g_bulk.active = true;
+
+	return USB_FND_SUCCESS;
+}
+
+
+static struct usb_fn_drv _bulk_drv = {
+	.poll		= _bulk_poll,
+	.bus_reset	= _bulk_bus_reset,
+	.state_chg	= _bulk_state_chg,
+	.set_intf	= _bulk_set_intf,
+};
+
+
+void
+usb_dfu_bulk_init(int n_zones)
+{
+	memset(&g_bulk, 0x00, sizeof(g_bulk));
+	g_bulk.n_zones = n_zones;
+	usb_register_function_driver(&_bulk_drv);
+}
@@ -16,6 +16,7 @@
 #define USB_RT_DFU_VENDOR_VERSION	((0 << 8) | 0xc1)
 #define USB_RT_DFU_VENDOR_SPI_EXEC	((1 << 8) | 0x41)
 #define USB_RT_DFU_VENDOR_SPI_RESULT	((2 << 8) | 0xc1)
+#define USB_RT_DFU_VENDOR_STATS		((3 << 8) | 0xc1)
 
 
 static bool
@@ -33,7 +34,7 @@ dfu_vendor_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 	case USB_RT_DFU_VENDOR_VERSION:
 		xfer->len  = 2;
 		xfer->data[0] = 0x01;
-		xfer->data[1] = 0x00;
+		xfer->data[1] = 0x01;
 		break;
 
 	case USB_RT_DFU_VENDOR_SPI_EXEC:
@@ -45,6 +46,11 @@ dfu_vendor_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
 		 * whatever the host requested ... */
 		break;
 
+	case USB_RT_DFU_VENDOR_STATS:
+		xfer->len = sizeof(struct usb_dfu_stats);
+		memcpy(xfer->data, usb_dfu_get_stats(), xfer->len);
+		break;
+
 	default:
 		return USB_FND_ERROR;
 	}
@@ -0,0 +1,862 @@
+/*
+ * usb_msc_uf2.c
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+/*
+ * Mass storage (Bulk-Only Transport) companion to the DFU driver, for
+ * drag and drop flashing of UF2 files without any host tool.
+ *
+ * The volume is a FAT16 file system generated on the fly when read :
+ * only the boot sector, the first FAT sector, the root directory and a
+ * single INFO_UF2.TXT file have any content. Writes are ignored except
+ * for sectors holding a UF2 block, whose payload is appended to a
+ * download going through the same block queue as DFU DNLOAD requests.
+ *
+ * Each UF2 file is one download : its first block must target the start
+ * of a zone and blocks must then come in order (which is what hosts do
+ * when writing a file to an empty volume). Blocks already received are
+ * ignored if written again, anything else out of sequence aborts the
+ * download. The payload can be raw or packed (sparse / LZ), exactly like
+ * with DFU.
+ *
+ * Ejecting the volume (START STOP UNIT) reboots the device once
+ * everything is written.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <no2usb/usb_hw.h>
+#include <no2usb/usb_priv.h>
+#include <no2usb/usb.h>
+#include <no2usb/usb_dfu.h>
+#include <no2usb/usb_dfu_priv.h>
+#include <no2usb/usb_dfu_proto.h>
+#include <no2usb/usb_msc_proto.h>
+#include <no2usb/usb_msc_uf2.h>
+
+
+#define MSC_PKT_LEN		64
+#define MSC_SECTOR_SIZE		512
+
+/* FAT16 volume layout. 32 MB, so that hosts see plenty of free space */
+#define FAT_SECTORS		65535
+#define FAT_SPC			8		/* Sectors per cluster */
+#define FAT_RESERVED		1
+#define FAT_NUM			2
+#define FAT_SIZE		32		/* Sectors per FAT */
+#define FAT_ROOT_ENTRIES	64
+
+#define FAT_FAT_START		FAT_RESERVED
+#define FAT_ROOT_START		(FAT_FAT_START + FAT_NUM * FAT_SIZE)
+#define FAT_DATA_START		(FAT_ROOT_START + (FAT_ROOT_ENTRIES * 32) / MSC_SECTOR_SIZE)
+
+#define FAT_DATE		(((2021 - 1980) << 9) | (1 << 5) | 1)
+
+
+struct fat_boot_sector {
+	uint8_t  jump[3];
+	char     oem[8];
+	uint16_t bytes_per_sector;
+	uint8_t  sectors_per_cluster;
+	uint16_t reserved_sectors;
+	uint8_t  num_fats;
+	uint16_t root_entries;
+	uint16_t total_sectors;
+	uint8_t  media;
+	uint16_t sectors_per_fat;
+	uint16_t sectors_per_track;
+	uint16_t heads;
+	uint32_t hidden_sectors;
+	uint32_t total_sectors_32;
+	uint8_t  drive;
+	uint8_t  _rsvd;
+	uint8_t  ext_sig;
+	uint32_t serial;
+	char     label[11];
+	char     fs_type[8];
+} __attribute__((packed));
+
+struct fat_dir_entry {
+	char     name[11];
+	uint8_t  attr;
+	uint8_t  _rsvd[10];
+	uint16_t mtime;
+	uint16_t mdate;
+	uint16_t cluster;
+	uint32_t size;
+} __attribute__((packed));
+
+static const struct fat_boot_sector fat_boot = {
+	.jump			= { 0xeb, 0x3c, 0x90 },
+	.oem			= "NO2BOOT ",
+	.bytes_per_sector	= MSC_SECTOR_SIZE,
+	.sectors_per_cluster	= FAT_SPC,
+	.reserved_sectors	= FAT_RESERVED,
+	.num_fats		= FAT_NUM,
+	.root_entries		= FAT_ROOT_ENTRIES,
+	.total_sectors		= FAT_SECTORS,
+	.media			= 0xf8,
+	.sectors_per_fat	= FAT_SIZE,
+	.sectors_per_track	= 1,
+	.heads			= 1,
+	.drive			= 0x80,
+	.ext_sig		= 0x29,
+	.serial			= 0x00420042,
+	.label			= "NO2BOOT    ",
+	.fs_type		= "FAT16   ",
+};
+
+
+static struct {
+	const char *info;
+	unsigned int info_len;
+	int  n_zones;
+	bool active;	// Interface configured
+	bool booted;	// EPs have their buffers since last bus reset
+
+	const struct usb_intf_desc *intf;
+	uint8_t ep_out;
+	uint8_t ep_in;
+	int     bdi_out;	// Next OUT BD to be filled by the hardware
+	int     bdi_in;		// Next IN BD to be queued
+
+	enum {
+		MSC_CBW = 0,	// Waiting for a command
+		MSC_DATA_OUT,	// Receiving data (WRITE or discarded)
+		MSC_DATA_IN,	// Sending data
+		MSC_CSW,	// Status to be queued
+		MSC_CSW_WAIT,	// Status queued, waiting for it to be sent
+	} state;
+
+	/* Word aligned for usb_data_{read,write} */
+	struct usb_msc_cbw cbw __attribute__((aligned(4)));
+	struct usb_msc_csw csw __attribute__((aligned(4)));
+
+	/* Data stage */
+	uint32_t lba;		// Next sector for READ / WRITE
+	uint32_t left;		// Bytes left to transfer
+	unsigned int ofs;	// Position in buf
+	bool     sectors;	// buf holds sectors (READ / WRITE)
+	bool     pending;	// A written sector waits to be handled
+	bool     stall;		// Halt IN before the status
+	int      csw_bd;
+
+	/* Sense data */
+	uint8_t  sense_key;
+	uint8_t  sense_asc;
+
+	bool     eject;
+
+	/* UF2 download */
+	struct {
+		bool     active;
+		bool     finishing;
+		uint32_t addr;
+		uint32_t blk_no;
+		uint32_t n_blk;
+		uint8_t *blk;
+		unsigned int blk_ofs;
+		unsigned int blk_len;
+	} uf2;
+
+	union {
+		uint8_t buf[MSC_SECTOR_SIZE];
+		struct uf2_block uf2_blk;
+	} __attribute__((aligned(4)));
+} g_msc;
+
+
+static inline volatile struct usb_ep *
+_msc_ep_out(void)
+{
+	return &usb_ep_regs[g_msc.ep_out & 0xf].out;
+}
+
+static inline volatile struct usb_ep *
+_msc_ep_in(void)
+{
+	return &usb_ep_regs[g_msc.ep_in & 0xf].in;
+}
+
+static inline void
+_put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >>  8;
+	p[3] = v;
+}
+
+static inline uint32_t
+_get_be32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+// ---------------------------------------------------------------------------
+// Virtual FAT volume
+// ---------------------------------------------------------------------------
+
+static void
+_fat_read_sector(uint32_t lba, uint8_t *buf)
+{
+	memset(buf, 0x00, MSC_SECTOR_SIZE);
+
+	if (lba == 0) {
+		/* Boot sector */
+		memcpy(buf, &fat_boot, sizeof(fat_boot));
+		buf[510] = 0x55;
+		buf[511] = 0xaa;
+	} else if (lba < FAT_ROOT_START) {
+		/* FATs : media / reserved entries, then INFO_UF2.TXT */
+		if (((lba - FAT_FAT_START) % FAT_SIZE) == 0) {
+			uint16_t *fat = (void*)buf;
+			fat[0] = 0xfff8;
+			fat[1] = 0xffff;
+			fat[2] = 0xffff;
+		}
+	} else if (lba < FAT_DATA_START) {
+		/* Root directory */
+		if (lba == FAT_ROOT_START) {
+			struct fat_dir_entry *de = (void*)buf;
+
+			memcpy(de[0].name, fat_boot.label, 11);
+			de[0].attr  = 0x08;	/* Volume label */
+			de[0].mdate = FAT_DATE;
+
+			memcpy(de[1].name, "INFO_UF2TXT", 11);
+			de[1].attr    = 0x01;	/* Read only */
+			de[1].mdate   = FAT_DATE;
+			de[1].cluster = 2;
+			de[1].size    = g_msc.info_len;
+		}
+	} else if (lba == FAT_DATA_START) {
+		/* First sector of cluster 2 */
+		memcpy(buf, g_msc.info, g_msc.info_len);
+	}
+}
+
+
+// ---------------------------------------------------------------------------
+// UF2 download
+// ---------------------------------------------------------------------------
+
+static void
+_uf2_end(void)
+{
+	/* A partially filled block is just dropped */
+	g_msc.uf2.active    = false;
+	g_msc.uf2.blk       = NULL;
+	g_msc.uf2.finishing = true;
+	usb_dfu_dl_finish();
+}
+
+static bool
+_uf2_start(const struct uf2_block *b)
+{
+	const struct usb_dfu_zone *zone;
+	int z;
+
+	/* Zone starting at that address */
+	for (z=0; z<g_msc.n_zones; z++) {
+		zone = usb_dfu_zone_get(z);
+		if (zone && (zone->start == b->targetAddr))
+			break;
+	}
+
+	if (z == g_msc.n_zones)
+		return true;
+
+	/* Previous one must be fully written */
+	if (g_msc.uf2.active)
+		_uf2_end();
+
+	if (g_msc.uf2.finishing)
+		return false;
+
+	/* Busy with another download, the file is ignored (the DFU state
+	 * belongs to that download, not to be touched) */
+	if (!usb_dfu_dl_start(z))
+		return true;
+
+	g_msc.uf2.active = true;
+	g_msc.uf2.addr   = b->targetAddr;
+	g_msc.uf2.blk_no = 0;
+	g_msc.uf2.n_blk  = b->numBlocks;
+	g_msc.uf2.blk    = NULL;
+
+	return true;
+}
+
+static bool
+_uf2_sector(void)
+{
+	const struct uf2_block *b = &g_msc.uf2_blk;
+
+	/* Anything not a valid UF2 block for us is ignored */
+	if ((b->magicStart0 != UF2_MAGIC_START0) ||
+	    (b->magicStart1 != UF2_MAGIC_START1) ||
+	    (b->magicEnd    != UF2_MAGIC_END))
+		return true;
+
+	if ((b->flags & UF2_FLAG_NOT_MAIN_FLASH) ||
+	    ((b->flags & UF2_FLAG_FAMILY_ID) && (b->familyID != UF2_FAMILY_ID_NO2)) ||
+	    (b->payloadSize != UF2_PAYLOAD_SIZE) ||
+	    (b->blockNo >= b->numBlocks))
+		return true;
+
+	/* New file ? */
+	if (b->blockNo == 0) {
+		/* Unless it's a retry, waiting for a block buffer */
+		if (!g_msc.uf2.active || g_msc.uf2.blk_no || (g_msc.uf2.addr != b->targetAddr))
+			if (!_uf2_start(b))
+				return false;
+	}
+
+	if (!g_msc.uf2.active || (b->blockNo < g_msc.uf2.blk_no))
+		return true;
+
+	if ((b->blockNo    != g_msc.uf2.blk_no) ||
+	    (b->numBlocks  != g_msc.uf2.n_blk)  ||
+	    (b->targetAddr != g_msc.uf2.addr)) {
+		_uf2_end();
+		return true;
+	}
+
+	/* Get a block buffer, hold the sector until one is free */
+	if (!g_msc.uf2.blk) {
+		uint32_t left = (g_msc.uf2.n_blk - g_msc.uf2.blk_no) * UF2_PAYLOAD_SIZE;
+
+		g_msc.uf2.blk_len = (left < USB_DFU_TRANSFER_SIZE) ? left : USB_DFU_TRANSFER_SIZE;
+		g_msc.uf2.blk_ofs = 0;
+		g_msc.uf2.blk = usb_dfu_dl_blk_get(g_msc.uf2.blk_len);
+
+		if (!g_msc.uf2.blk) {
+			if (usb_dfu_dl_status() == OK)
+				return false;
+			_uf2_end();
+			return true;
+		}
+	}
+
+	memcpy(&g_msc.uf2.blk[g_msc.uf2.blk_ofs], b->data, UF2_PAYLOAD_SIZE);
+	g_msc.uf2.blk_ofs += UF2_PAYLOAD_SIZE;
+
+	if (g_msc.uf2.blk_ofs == g_msc.uf2.blk_len) {
+		usb_dfu_dl_blk_put();
+		g_msc.uf2.blk = NULL;
+	}
+
+	g_msc.uf2.blk_no++;
+	g_msc.uf2.addr += UF2_PAYLOAD_SIZE;
+
+	if (g_msc.uf2.blk_no == g_msc.uf2.n_blk)
+		_uf2_end();
+
+	return true;
+}
+
+
+// ---------------------------------------------------------------------------
+// SCSI commands
+// ---------------------------------------------------------------------------
+
+static void
+_msc_sense(uint8_t key, uint8_t asc)
+{
+	g_msc.sense_key = key;
+	g_msc.sense_asc = asc;
+}
+
+static void
+_msc_no_data(enum usb_msc_csw_status status)
+{
+	uint32_t hlen = g_msc.cbw.dCBWDataTransferLength;
+
+	g_msc.csw.bCSWStatus      = status;
+	g_msc.csw.dCSWDataResidue = hlen;
+
+	if (!hlen) {
+		g_msc.state = MSC_CSW;
+	} else if (g_msc.cbw.bmCBWFlags & USB_MSC_CBW_FLAG_IN) {
+		/* Host expects data we don't have */
+		g_msc.state = MSC_DATA_IN;
+		g_msc.left  = 0;
+		g_msc.stall = true;
+	} else {
+		/* Host sends data we don't want */
+		g_msc.state   = MSC_DATA_OUT;
+		g_msc.left    = hlen;
+		g_msc.sectors = false;
+	}
+}
+
+static void
+_msc_fail(uint8_t key, uint8_t asc)
+{
+	_msc_sense(key, asc);
+	_msc_no_data(USB_MSC_CSW_FAILED);
+}
+
+static void
+_msc_data_in(uint32_t len, bool sectors)
+{
+	uint32_t hlen = g_msc.cbw.dCBWDataTransferLength;
+
+	/* Host expects no data : fine only if there's none */
+	if (!hlen) {
+		_msc_no_data(len ? USB_MSC_CSW_PHASE_ERR : USB_MSC_CSW_PASSED);
+		return;
+	}
+
+	if (!(g_msc.cbw.bmCBWFlags & USB_MSC_CBW_FLAG_IN)) {
+		_msc_no_data(USB_MSC_CSW_PHASE_ERR);
+		return;
+	}
+
+	if (len > hlen)
+		len = hlen;
+
+	g_msc.state   = MSC_DATA_IN;
+	g_msc.left    = len;
+	g_msc.ofs     = sectors ? MSC_SECTOR_SIZE : 0;
+	g_msc.sectors = sectors;
+
+	/* Less than expected ends with a short packet, or a stall */
+	g_msc.csw.dCSWDataResidue = hlen - len;
+	g_msc.stall = (len < hlen) && !(len & (MSC_PKT_LEN - 1));
+}
+
+static bool
+_msc_rw_args(uint32_t *lba, uint32_t *n)
+{
+	*lba = _get_be32(&g_msc.cbw.CBWCB[2]);
+	*n   = (g_msc.cbw.CBWCB[7] << 8) | g_msc.cbw.CBWCB[8];
+
+	if ((*lba >= FAT_SECTORS) || (*n > (FAT_SECTORS - *lba))) {
+		_msc_fail(SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+_msc_scsi(void)
+{
+	const uint8_t *cb = g_msc.cbw.CBWCB;
+	uint8_t *buf = g_msc.buf;
+	uint32_t lba, n;
+
+	memset(buf, 0x00, 36);
+
+	switch (cb[0])
+	{
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_PREVENT_ALLOW_REMOVAL:
+	case SCSI_VERIFY_10:
+	case SCSI_SYNCHRONIZE_CACHE_10:
+		_msc_no_data(USB_MSC_CSW_PASSED);
+		break;
+
+	case SCSI_START_STOP_UNIT:
+		/* LoEj without Start : Eject */
+		if ((cb[4] & 3) == 2)
+			g_msc.eject = true;
+		_msc_no_data(USB_MSC_CSW_PASSED);
+		break;
+
+	case SCSI_REQUEST_SENSE:
+		buf[0]  = 0x70;		/* Current error, fixed format */
+		buf[2]  = g_msc.sense_key;
+		buf[7]  = 10;		/* Additional length */
+		buf[12] = g_msc.sense_asc;
+		_msc_sense(SCSI_SK_NO_SENSE, SCSI_ASC_NONE);
+		_msc_data_in((cb[4] < 18) ? cb[4] : 18, false);
+		break;
+
+	case SCSI_INQUIRY:
+		buf[1] = 0x80;		/* Removable */
+		buf[2] = 0x02;		/* SCSI-2 */
+		buf[3] = 0x02;		/* Response data format */
+		buf[4] = 31;		/* Additional length */
+		memcpy(&buf[8], "no2usb  UF2 Bootloader  0.1 ", 28);
+		_msc_data_in((cb[4] < 36) ? cb[4] : 36, false);
+		break;
+
+	case SCSI_MODE_SENSE_6:
+		buf[0] = 3;		/* Mode data length */
+		_msc_data_in((cb[4] < 4) ? cb[4] : 4, false);
+		break;
+
+	case SCSI_MODE_SENSE_10:
+		buf[1] = 6;		/* Mode data length */
+		_msc_data_in((cb[8] < 8) ? cb[8] : 8, false);
+		break;
+
+	case SCSI_READ_FORMAT_CAPACITIES:
+		buf[3] = 8;		/* Capacity list length */
+		_put_be32(&buf[4], FAT_SECTORS);
+		_put_be32(&buf[8], MSC_SECTOR_SIZE);
+		buf[8] = 0x02;		/* Formatted media */
+		_msc_data_in(12, false);
+		break;
+
+	case SCSI_READ_CAPACITY_10:
+		_put_be32(&buf[0], FAT_SECTORS - 1);
+		_put_be32(&buf[4], MSC_SECTOR_SIZE);
+		_msc_data_in(8, false);
+		break;
+
+	case SCSI_READ_10:
+		if (!_msc_rw_args(&lba, &n))
+			break;
+		g_msc.lba = lba;
+		_msc_data_in(n * MSC_SECTOR_SIZE, true);
+		break;
+
+	case SCSI_WRITE_10:
+		if (!_msc_rw_args(&lba, &n))
+			break;
+
+		/* Nothing coming, the next packet is a CBW */
+		if (!g_msc.cbw.dCBWDataTransferLength) {
+			_msc_no_data(n ? USB_MSC_CSW_PHASE_ERR : USB_MSC_CSW_PASSED);
+			break;
+		}
+
+		if (g_msc.cbw.bmCBWFlags & USB_MSC_CBW_FLAG_IN) {
+			_msc_no_data(USB_MSC_CSW_PHASE_ERR);
+			break;
+		}
+
+		n *= MSC_SECTOR_SIZE;
+
+		g_msc.state   = MSC_DATA_OUT;
+		g_msc.lba     = lba;
+		g_msc.left    = g_msc.cbw.dCBWDataTransferLength;
+		g_msc.ofs     = 0;
+		g_msc.sectors = true;
+		g_msc.csw.dCSWDataResidue = (g_msc.left > n) ? (g_msc.left - n) : 0;
+		break;
+
+	default:
+		_msc_fail(SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_INVALID_OPCODE);
+	}
+}
+
+
+// ---------------------------------------------------------------------------
+// Bulk-Only Transport
+// ---------------------------------------------------------------------------
+
+static void
+_msc_cbw(unsigned ptr, unsigned len)
+{
+	/* Anything not looking like a CBW is ignored (e.g. leftover data
+	 * of a command that was aborted) */
+	if (len != sizeof(struct usb_msc_cbw))
+		return;
+
+	usb_data_read(&g_msc.cbw, ptr, len);
+
+	if (g_msc.cbw.dCBWSignature != USB_MSC_CBW_SIG)
+		return;
+
+	g_msc.csw.dCSWSignature   = USB_MSC_CSW_SIG;
+	g_msc.csw.dCSWTag         = g_msc.cbw.dCBWTag;
+	g_msc.csw.dCSWDataResidue = 0;
+	g_msc.csw.bCSWStatus      = USB_MSC_CSW_PASSED;
+
+	g_msc.sectors = false;
+	g_msc.stall   = false;
+
+	/* Single LUN */
+	if (g_msc.cbw.bCBWLUN != 0) {
+		_msc_fail(SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD);
+		return;
+	}
+
+	_msc_scsi();
+}
+
+static bool
+_msc_data_out(unsigned ptr, unsigned len)
+{
+	/* Last sector not handled yet */
+	if (g_msc.pending)
+		return false;
+
+	/* Short packet ends the data early */
+	if ((len < MSC_PKT_LEN) && (len < g_msc.left)) {
+		g_msc.csw.dCSWDataResidue += g_msc.left - len;
+		g_msc.left = len;
+	}
+
+	if (len > g_msc.left)
+		len = g_msc.left;
+
+	if (g_msc.sectors && ((g_msc.ofs + len) <= MSC_SECTOR_SIZE)) {
+		usb_data_read(&g_msc.buf[g_msc.ofs], ptr, len);
+		g_msc.ofs += len;
+
+		if (g_msc.ofs == MSC_SECTOR_SIZE) {
+			g_msc.pending = !_uf2_sector();
+			g_msc.ofs = 0;
+			g_msc.lba++;
+		}
+	}
+
+	g_msc.left -= len;
+
+	if (!g_msc.left && !g_msc.pending)
+		g_msc.state = MSC_CSW;
+
+	return true;
+}
+
+static void
+_msc_out_poll(void)
+{
+	volatile struct usb_ep *ep = _msc_ep_out();
+
+	/* BDs are filled alternately, errors flip the index too */
+	while ((g_msc.state == MSC_CBW) || (g_msc.state == MSC_DATA_OUT))
+	{
+		int i = g_msc.bdi_out;
+		uint32_t csr = ep->bd[i].csr;
+
+		if ((csr & USB_BD_STATE_MSK) == USB_BD_STATE_DONE_OK) {
+			unsigned ptr = ep->bd[i].ptr;
+			unsigned len = (csr & USB_BD_LEN_MSK) - 2;
+
+			if (g_msc.state == MSC_CBW)
+				_msc_cbw(ptr, len);
+			else if (!_msc_data_out(ptr, len))
+				break;
+		} else if ((csr & USB_BD_STATE_MSK) != USB_BD_STATE_DONE_ERR) {
+			break;
+		}
+
+		ep->bd[i].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(MSC_PKT_LEN);
+		g_msc.bdi_out = i ^ 1;
+	}
+}
+
+static void
+_msc_in_poll(void)
+{
+	volatile struct usb_ep *ep = _msc_ep_in();
+
+	/* BDs are sent alternately, queue whatever is free */
+	while (1)
+	{
+		int i = g_msc.bdi_in;
+		unsigned len;
+
+		if ((ep->bd[i].csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+			break;
+
+		if ((g_msc.state == MSC_DATA_IN) && g_msc.left) {
+			/* Next packet, generating sectors as needed */
+			if (g_msc.sectors && (g_msc.ofs == MSC_SECTOR_SIZE)) {
+				_fat_read_sector(g_msc.lba++, g_msc.buf);
+				g_msc.ofs = 0;
+			}
+
+			len = (g_msc.left < MSC_PKT_LEN) ? g_msc.left : MSC_PKT_LEN;
+
+			usb_data_write(ep->bd[i].ptr, &g_msc.buf[g_msc.ofs], len);
+			ep->bd[i].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(len);
+
+			g_msc.ofs  += len;
+			g_msc.left -= len;
+		} else if (g_msc.state == MSC_DATA_IN) {
+			/* Stall must come after all the data */
+			if (g_msc.stall) {
+				if ((ep->bd[i^1].csr & USB_BD_STATE_MSK) == USB_BD_STATE_RDY_DATA)
+					break;
+				usb_ep_halt(g_msc.ep_in);
+			}
+
+			g_msc.state = MSC_CSW;
+			continue;
+		} else if (g_msc.state == MSC_CSW) {
+			usb_data_write(ep->bd[i].ptr, &g_msc.csw, sizeof(struct usb_msc_csw));
+			ep->bd[i].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(sizeof(struct usb_msc_csw));
+
+			g_msc.csw_bd = i;
+			g_msc.state  = MSC_CSW_WAIT;
+		} else {
+			break;
+		}
+
+		g_msc.bdi_in = i ^ 1;
+	}
+
+	/* Status sent, ready for next command */
+	if ((g_msc.state == MSC_CSW_WAIT) &&
+	    ((ep->bd[g_msc.csw_bd].csr & USB_BD_STATE_MSK) != USB_BD_STATE_RDY_DATA))
+		g_msc.state = MSC_CBW;
+}
+
+static void
+_msc_poll(void)
+{
+	if (!g_msc.active)
+		return;
+
+	/* Retry a sector waiting for a free block */
+	if (g_msc.pending && _uf2_sector()) {
+		g_msc.pending = false;
+		if (!g_msc.left)
+			g_msc.state = MSC_CSW;
+	}
+
+	/* Let the last download complete */
+	if (g_msc.uf2.finishing && usb_dfu_dl_done())
+		g_msc.uf2.finishing = false;
+
+	_msc_out_poll();
+	_msc_in_poll();
+
+	/* Eject : reboot once everything is written */
+	if (g_msc.eject && (g_msc.state == MSC_CBW)) {
+		if (g_msc.uf2.active)
+			_uf2_end();
+		if (!g_msc.uf2.finishing) {
+			g_msc.eject = false;
+			usb_dfu_cb_reboot();
+		}
+	}
+}
+
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+static void
+_msc_reset(void)
+{
+	volatile struct usb_ep *ep_out = _msc_ep_out();
+
+	/* Reconfigure to get the BD indexes back to 0 */
+	usb_ep_reconf(g_msc.intf, g_msc.ep_out);
+	usb_ep_reconf(g_msc.intf, g_msc.ep_in);
+
+	ep_out->bd[0].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(MSC_PKT_LEN);
+	ep_out->bd[1].csr = USB_BD_STATE_RDY_DATA | USB_BD_LEN(MSC_PKT_LEN);
+
+	g_msc.bdi_out = 0;
+	g_msc.bdi_in  = 0;
+	g_msc.state   = MSC_CBW;
+	g_msc.pending = false;
+}
+
+static void
+_msc_bus_reset(void)
+{
+	g_msc.active = false;
+	g_msc.booted = false;
+}
+
+static void
+_msc_state_chg(enum usb_dev_state state)
+{
+	/* Suspend doesn't lose the configuration */
+	if (state < USB_DS_CONFIGURED)
+		g_msc.active = false;
+}
+
+static enum usb_fnd_resp
+_msc_ctrl_req(struct usb_ctrl_req *req, struct usb_xfer *xfer)
+{
+	if (!g_msc.active || (req->wIndex != g_msc.intf->bInterfaceNumber))
+		return USB_FND_CONTINUE;
+
+	switch (req->wRequestAndType)
+	{
+	case USB_RT_MSC_RESET:
+		_msc_reset();
+		return USB_FND_SUCCESS;
+
+	case USB_RT_MSC_GET_MAX_LUN:
+		xfer->data[0] = 0;
+		xfer->len = 1;
+		return USB_FND_SUCCESS;
+	}
+
+	return USB_FND_CONTINUE;
+}
+
+static enum usb_fnd_resp
+_msc_set_intf(const struct usb_intf_desc *base, const struct usb_intf_desc *sel)
+{
+	const struct usb_ep_desc *ep;
+	const void *eod;
+
+	if ((sel->bInterfaceClass != 0x08) ||
+	    (sel->bInterfaceSubClass != USB_MSC_SCLS_SCSI) ||
+	    (sel->bInterfaceProtocol != USB_MSC_PROTO_BOT))
+		return USB_FND_CONTINUE;
+
+	/* Find our EPs */
+	eod = ((uint8_t*)g_usb.conf) + g_usb.conf->wTotalLength;
+	ep  = (void*)sel;
+
+	for (int i=0; i<sel->bNumEndpoints; i++) {
+		ep = usb_desc_find(usb_desc_next(ep), eod, USB_DT_EP);
+		if (!ep)
+			return USB_FND_ERROR;
+
+		if (ep->bEndpointAddress & 0x80)
+			g_msc.ep_in  = ep->bEndpointAddress;
+		else
+			g_msc.ep_out = ep->bEndpointAddress;
+	}
+
+	g_msc.intf = sel;
+
+	/* Buffers are only allocated once, SET_CONFIGURATION may be repeated */
+	if (!g_msc.booted) {
+		usb_ep_boot(base, g_msc.ep_out, true);
+		usb_ep_boot(base, g_msc.ep_in,  true);
+		g_msc.booted = true;
+	}
+
+	_msc_reset();
+
+	g_msc.eject  = false;
+	g_msc.active = true;
+
+	return USB_FND_SUCCESS;
+}
+
+
+static struct usb_fn_drv _msc_drv = {
+	.poll		= _msc_poll,
+	.bus_reset	= _msc_bus_reset,
+	.state_chg	= _msc_state_chg,
+	.ctrl_req	= _msc_ctrl_req,
+	.set_intf	= _msc_set_intf,
+};
+
+
+void
+usb_msc_uf2_init(const char *info, int n_zones)
+{
+	memset(&g_msc, 0x00, sizeof(g_msc));
+	g_msc.info     = info;
+	g_msc.info_len = strlen(info);
+	if (g_msc.info_len > MSC_SECTOR_SIZE)
+		g_msc.info_len = MSC_SECTOR_SIZE;
+	g_msc.n_zones  = n_zones;
+	usb_register_function_driver(&_msc_drv);
+}
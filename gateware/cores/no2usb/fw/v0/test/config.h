@@ -0,0 +1,13 @@
+/*
+ * config.h
+ *
+ * Host build of the DFU code for tests, the core is never accessed
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#pragma once
+
+#define USB_CORE_BASE	0x84000000
+#define USB_DATA_BASE	0x85000000
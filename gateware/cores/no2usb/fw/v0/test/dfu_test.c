@@ -0,0 +1,440 @@
+/*
+ * dfu_test.c
+ *
+ * Host tests of the DFU download / flash logic
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: LGPL-3.0-or-later
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <no2usb/usb.h>
+#include <no2usb/usb_dfu.h>
+#include <no2usb/usb_dfu_priv.h>
+#include <no2usb/usb_dfu_proto.h>
+
+
+#define FLASH_SIZE	(1 << 20)
+#define BLK_SIZE	USB_DFU_TRANSFER_SIZE
+
+
+/* Emulated environment */
+/* -------------------- */
+
+static struct {
+	uint8_t  mem[FLASH_SIZE];
+	uint32_t tick;
+	struct usb_fn_drv *drv;
+	uint8_t  ctrl_buf[64];
+} g_env;
+
+uint32_t
+usb_get_tick(void)
+{
+	return g_env.tick;
+}
+
+void
+usb_register_function_driver(struct usb_fn_drv *drv)
+{
+	g_env.drv = drv;
+}
+
+bool
+usb_dfu_cb_flash_busy(void)
+{
+	return false;
+}
+
+void
+usb_dfu_cb_flash_erase(uint32_t addr, unsigned size)
+{
+	if ((addr & (size - 1)) || ((addr + size) > FLASH_SIZE)) {
+		fprintf(stderr, "Bad erase %08x / %d\n", addr, size);
+		exit(1);
+	}
+	memset(&g_env.mem[addr], 0xff, size);
+}
+
+void
+usb_dfu_cb_flash_program(const void *data, uint32_t addr, unsigned size)
+{
+	const uint8_t *d = data;
+
+	for (unsigned i=0; i<size; i++)
+		g_env.mem[addr+i] &= d[i];
+}
+
+void
+usb_dfu_cb_flash_read(void *data, uint32_t addr, unsigned size)
+{
+	memcpy(data, &g_env.mem[addr], size);
+}
+
+void
+usb_dfu_cb_flash_raw(void *data, unsigned len)
+{
+}
+
+
+/* DFU host */
+/* -------- */
+
+static void
+_poll(void)
+{
+	g_env.tick++;
+	g_env.drv->poll();
+}
+
+static bool
+_req(uint8_t req_type, uint8_t req, uint16_t len, struct usb_xfer *xfer)
+{
+	struct usb_ctrl_req r = {
+		.bmRequestType = req_type,
+		.bRequest = req,
+		.wIndex = 0,
+		.wLength = len,
+	};
+
+	memset(xfer, 0x00, sizeof(*xfer));
+	xfer->data = g_env.ctrl_buf;
+	xfer->len  = len;
+
+	return g_env.drv->ctrl_req(&r, xfer) == USB_FND_SUCCESS;
+}
+
+static void
+_select(int alt)
+{
+	struct usb_intf_desc intf = {
+		.bInterfaceNumber   = 0,
+		.bAlternateSetting  = alt,
+		.bInterfaceClass    = 0xfe,
+		.bInterfaceSubClass = 0x01,
+		.bInterfaceProtocol = 0x02,
+	};
+
+	g_env.drv->set_intf(&intf, &intf);
+}
+
+static int
+_get_alt(void)
+{
+	struct usb_intf_desc intf = {
+		.bInterfaceNumber   = 0,
+		.bInterfaceClass    = 0xfe,
+		.bInterfaceSubClass = 0x01,
+		.bInterfaceProtocol = 0x02,
+	};
+	uint8_t alt;
+
+	if (g_env.drv->get_intf(&intf, &alt) != USB_FND_SUCCESS)
+		return -1;
+
+	return alt;
+}
+
+static int
+_getstatus(void)
+{
+	struct usb_xfer xfer;
+
+	if (!_req(0xa1, USB_REQ_DFU_GETSTATUS, 6, &xfer))
+		return -1;
+
+	return g_env.ctrl_buf[4];
+}
+
+static bool
+_download(const uint8_t *data, int len)
+{
+	struct usb_xfer xfer;
+	int ofs = 0;
+
+	/* Blocks, then the final zero-length DNLOAD */
+	while (1) {
+		int l = (len - ofs) > BLK_SIZE ? BLK_SIZE : (len - ofs);
+
+		if (!_req(0x21, USB_REQ_DFU_DNLOAD, l, &xfer))
+			return false;
+
+		if (l) {
+			memcpy(xfer.data, &data[ofs], l);
+			xfer.cb_done(&xfer);
+		}
+
+		/* Wait until the device accepts more */
+		while (1) {
+			int state = _getstatus();
+			if ((state == dfuDNLOAD_IDLE) || (state == dfuIDLE))
+				break;
+			if ((state != dfuDNBUSY) && (state != dfuMANIFEST))
+				return false;
+			_poll();
+		}
+
+		if (!l)
+			return true;
+
+		ofs += l;
+	}
+}
+
+
+/* Tests */
+/* ----- */
+
+static const struct usb_dfu_zone zones[] = {
+	{ 0x20000, 0x40000, 0 },			/* 128k */
+	{ 0x40000, 0x80000, USB_DFU_ZONE_F_PREERASE },	/* 256k */
+	{ 0x80000, 0xa0000, USB_DFU_ZONE_F_LZ },	/* 128k */
+};
+
+static int
+_check(const char *name, bool ok)
+{
+	printf("%-50s %s\n", name, ok ? "OK" : "FAIL");
+	return ok ? 0 : 1;
+}
+
+static bool
+_mem_is(uint32_t addr, uint32_t len, uint8_t v)
+{
+	while (len--)
+		if (g_env.mem[addr++] != v)
+			return false;
+	return true;
+}
+
+static void
+_setup(void)
+{
+	memset(g_env.mem, 0xa5, sizeof(g_env.mem));
+
+	usb_dfu_init(zones, sizeof(zones) / sizeof(zones[0]));
+}
+
+static int
+test_short_image_erase(void)
+{
+	static uint8_t img[2 * BLK_SIZE + 100];
+	bool ok;
+
+	_setup();
+	_select(0);
+
+	for (int i=0; i<sizeof(img); i++)
+		img[i] = i * 7;
+
+	ok = _download(img, sizeof(img));
+
+	/* Image is there, and nothing past its last sector was erased */
+	ok = ok && !memcmp(&g_env.mem[0x20000], img, sizeof(img));
+	ok = ok && _mem_is(0x20000 + sizeof(img), 4096 - (sizeof(img) & 0xfff), 0xff);
+	ok = ok && _mem_is(0x23000, 0x40000 - 0x23000, 0xa5);
+	ok = ok && _mem_is(0x40000, 0x20000, 0xa5);
+
+	return _check("Short image in a large zone keeps data past it", ok);
+}
+
+static int
+test_preerase(void)
+{
+	static uint8_t img[BLK_SIZE];
+	bool ok;
+
+	_setup();
+	_select(1);
+
+	memset(img, 0x5a, sizeof(img));
+
+	/* Must only report idle once the background erase is done */
+	ok = _download(img, sizeof(img));
+
+	ok = ok && !memcmp(&g_env.mem[0x40000], img, sizeof(img));
+	ok = ok && _mem_is(0x40000 + sizeof(img), 0x40000 - sizeof(img), 0xff);
+	ok = ok && _mem_is(0x3f000, 0x1000, 0xa5);
+	ok = ok && _mem_is(0x80000, 0x1000, 0xa5);
+
+	return _check("Pre-erase zone is fully erased once idle", ok);
+}
+
+static int
+test_sparse_wrap(void)
+{
+	static const uint32_t img[] = {
+		USB_DFU_PACK_MAGIC,
+		USB_DFU_PACK_SPARSE,
+		USB_DFU_SPARSE_BLANK | USB_DFU_SPARSE_LEN_MSK,
+		USB_DFU_SPARSE_BLANK | USB_DFU_SPARSE_LEN_MSK,
+		4, 0x00000000,
+	};
+	bool ok;
+
+	_setup();
+	_select(0);
+
+	/* Blank runs adding up past 4G land below the zone, must be refused */
+	ok = !_download((const uint8_t *)img, sizeof(img));
+
+	ok = ok && _mem_is(0x00000, 0x40000, 0xa5);
+
+	return _check("Sparse runs wrapping around are refused", ok);
+}
+
+static int
+test_other_zone_dl(void)
+{
+	static uint8_t img[BLK_SIZE];
+	uint8_t *blk;
+	bool ok;
+
+	_setup();
+	_select(0);
+
+	/* Download to zone 1 from another interface */
+	memset(img, 0x3c, sizeof(img));
+
+	ok = usb_dfu_dl_start(1);
+	ok = ok && (blk = usb_dfu_dl_blk_get(sizeof(img))) != NULL;
+	if (ok) {
+		memcpy(blk, img, sizeof(img));
+		usb_dfu_dl_blk_put();
+		usb_dfu_dl_finish();
+		while (!usb_dfu_dl_done())
+			_poll();
+	}
+
+	ok = ok && (usb_dfu_dl_status() == OK);
+	ok = ok && !memcmp(&g_env.mem[0x40000], img, sizeof(img));
+
+	/* Alt setting didn't change, and control downloads still use it */
+	ok = ok && (_get_alt() == 0);
+
+	memset(img, 0xc3, sizeof(img));
+	ok = ok && _download(img, sizeof(img));
+	ok = ok && !memcmp(&g_env.mem[0x20000], img, sizeof(img));
+	ok = ok && (g_env.mem[0x40000] == 0x3c);
+
+	return _check("Other zone download keeps the alt setting zone", ok);
+}
+
+static int
+test_other_dl_busy(void)
+{
+	static uint8_t img[2 * BLK_SIZE];
+	struct usb_xfer xfer;
+	uint8_t *blk;
+	bool ok;
+
+	_setup();
+	_select(0);
+
+	memset(img, 0x69, sizeof(img));
+
+	/* Nothing may reset the pipeline while blocks are queued */
+	ok = usb_dfu_dl_start(1);
+	ok = ok && (blk = usb_dfu_dl_blk_get(BLK_SIZE)) != NULL;
+	if (ok) {
+		memcpy(blk, img, BLK_SIZE);
+		usb_dfu_dl_blk_put();
+	}
+
+	ok = ok && !_req(0x21, USB_REQ_DFU_DNLOAD, BLK_SIZE, &xfer);
+	ok = ok && !_req(0xa1, USB_REQ_DFU_UPLOAD, BLK_SIZE, &xfer);
+	ok = ok && !_req(0x21, USB_REQ_DFU_ABORT, 0, &xfer);
+	ok = ok && !usb_dfu_dl_start(0);
+	ok = ok && (_getstatus() >= 0);
+	_select(0);
+
+	ok = ok && (blk = usb_dfu_dl_blk_get(BLK_SIZE)) != NULL;
+	if (ok) {
+		memcpy(blk, &img[BLK_SIZE], BLK_SIZE);
+		usb_dfu_dl_blk_put();
+		usb_dfu_dl_finish();
+		while (!usb_dfu_dl_done())
+			_poll();
+	}
+
+	ok = ok && (usb_dfu_dl_status() == OK);
+	ok = ok && !memcmp(&g_env.mem[0x40000], img, sizeof(img));
+
+	/* Then control transfers are fine again */
+	ok = ok && _download(img, BLK_SIZE);
+	ok = ok && !memcmp(&g_env.mem[0x20000], img, BLK_SIZE);
+
+	return _check("Other interface download can't be disturbed", ok);
+}
+
+static int
+test_lz_stats(void)
+{
+	static uint8_t img[8 + 1 + 24 + 6000 + 2];
+	struct usb_xfer xfer[2];
+	int n = 0, len[2];
+	bool ok;
+
+	_setup();
+	_select(2);
+
+	/* Header, then 6000 literals (15 + 23 * 255 + 120) and the end */
+	((uint32_t *)img)[0] = USB_DFU_PACK_MAGIC;
+	((uint32_t *)img)[1] = USB_DFU_PACK_LZ;
+	img[n += 8] = 0xf0;
+	memset(&img[n += 1], 0xff, 23);
+	img[n += 23] = 120;
+	for (int i=0; i<6000; i++)
+		img[++n] = i * 13;
+	img[++n] = 0x00;
+	img[++n] = 0x00;
+
+	len[0] = BLK_SIZE;
+	len[1] = sizeof(img) - BLK_SIZE;
+
+	/* Second block set up before the first one is decoded, and
+	 * queued after */
+	ok = _req(0x21, USB_REQ_DFU_DNLOAD, len[0], &xfer[0]);
+	if (ok) {
+		memcpy(xfer[0].data, img, len[0]);
+		xfer[0].cb_done(&xfer[0]);
+	}
+
+	ok = ok && (_getstatus() == dfuDNLOAD_IDLE);
+	ok = ok && _req(0x21, USB_REQ_DFU_DNLOAD, len[1], &xfer[1]);
+
+	for (int i=0; ok && (usb_dfu_get_stats()->blocks < 1) && (i < 100000); i++)
+		_poll();
+
+	if (ok) {
+		memcpy(xfer[1].data, &img[BLK_SIZE], len[1]);
+		xfer[1].cb_done(&xfer[1]);
+	}
+
+	ok = ok && _download(NULL, 0);
+
+	ok = ok && !memcmp(&g_env.mem[0x80000], &img[8 + 1 + 24], 6000);
+	ok = ok && (usb_dfu_get_stats()->bytes == 6000);
+
+	return _check("LZ download counts decoded bytes once", ok);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int fail = 0;
+
+	fail += test_short_image_erase();
+	fail += test_preerase();
+	fail += test_sparse_wrap();
+	fail += test_other_zone_dl();
+	fail += test_other_dl_busy();
+	fail += test_lz_stats();
+
+	return fail ? 1 : 0;
+}
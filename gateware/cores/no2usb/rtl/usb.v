@@ -14,6 +14,7 @@ module usb #(
 	parameter integer EPDW = 16,
 	parameter integer EVT_DEPTH = 0,
 	parameter integer IRQ = 0,
+	parameter integer BD_RING = 0,
 
 	/* Auto-set */
 	parameter integer EPAW = 11 - $clog2(EPDW / 8)
@@ -119,7 +120,7 @@ module usb #(
 	wire eps_read_0;
 	wire eps_zero_0;
 	wire eps_write_0;
-	wire [ 7:0] eps_addr_0;
+	wire [ 9:0] eps_addr_0;
 	wire [15:0] eps_wrdata_0;
 	wire [15:0] eps_rddata_3;
 
@@ -292,7 +293,9 @@ module usb #(
 	// Transaction control
 	// -------------------
 
-	usb_trans trans_I (
+	usb_trans #(
+		.BD_RING(BD_RING)
+	) trans_I (
 		.txpkt_start(txpkt_start),
 		.txpkt_done(txpkt_done),
 		.txpkt_pid(txpkt_pid),
@@ -373,14 +376,16 @@ module usb #(
 	// EP Status / Buffer Descriptors
 	// ------------------------------
 
-	usb_ep_status ep_status_I (
+	usb_ep_status #(
+		.BANKS(1 + BD_RING / 4)
+	) ep_status_I (
 		.p_addr_0(eps_addr_0),
 		.p_read_0(eps_read_0),
 		.p_zero_0(eps_zero_0),
 		.p_write_0(eps_write_0),
 		.p_din_0(eps_wrdata_0),
 		.p_dout_3(eps_rddata_3),
-		.s_addr_0(wb_addr[7:0]),
+		.s_addr_0(wb_addr[9:0]),
 		.s_read_0(eps_bus_ready),
 		.s_zero_0(eps_bus_zero),
 		.s_write_0(eps_bus_write),
@@ -9,9 +9,11 @@
 
 `default_nettype none
 
-module usb_ep_status (
+module usb_ep_status #(
+	parameter integer BANKS = 1
+)(
 	// Priority port
-	input  wire [ 7:0] p_addr_0,
+	input  wire [ 9:0] p_addr_0,
 	input  wire        p_read_0,
 	input  wire        p_zero_0,
 	input  wire        p_write_0,
@@ -19,7 +21,7 @@ module usb_ep_status (
 	output reg  [15:0] p_dout_3,
 
 	// Aux R/W port
-	input  wire [ 7:0] s_addr_0,
+	input  wire [ 9:0] s_addr_0,
 	input  wire        s_read_0,
 	input  wire        s_zero_0,
 	input  wire        s_write_0,
@@ -33,7 +35,7 @@ module usb_ep_status (
 );
 	// Signals
 	wire s_ready_0_i;
-	reg  [ 7:0] addr_1;
+	reg  [ 9:0] addr_1;
 	reg  [15:0] din_1;
 	reg  we_1;
 	reg  p_read_1;
@@ -41,7 +43,9 @@ module usb_ep_status (
 	reg  s_read_1;
 	reg  s_zero_1;
 
+	wire [16*BANKS-1:0] dout_bank_2;
 	wire [15:0] dout_2;
+	reg  [ 1:0] bank_2;
 	reg  p_read_2;
 	reg  p_zero_2;
 	reg  s_read_2;
@@ -70,6 +74,7 @@ module usb_ep_status (
 		p_zero_2 <= p_zero_1;
 		s_read_2 <= s_read_1 | s_zero_1;
 		s_zero_2 <= s_zero_1;
+		bank_2   <= addr_1[9:8];
 	end
 
 	// Stage 3 : Output registers
@@ -81,25 +86,37 @@ module usb_ep_status (
 		if (s_read_2)
 			s_dout_3 <= s_zero_2 ? 16'h0000 : dout_2;
 
-	// RAM element
-	SB_RAM40_4K #(
+	// RAM elements
+	genvar i;
+
+	generate
+		for (i=0; i<BANKS; i=i+1)
+		begin : bank
+
+			SB_RAM40_4K #(
 `ifdef SIM
-		.INIT_FILE("usb_ep_status.hex"),
+				.INIT_FILE(i == 0 ? "usb_ep_status.hex" : ""),
 `endif
-		.WRITE_MODE(0),
-		.READ_MODE(0)
-	) ebr_I (
-		.RDATA(dout_2),
-		.RADDR({3'b000, addr_1}),
-		.RCLK(clk),
-		.RCLKE(1'b1),
-		.RE(1'b1),
-		.WDATA(din_1),
-		.WADDR({3'b000, addr_1}),
-		.MASK(16'h0000),
-		.WCLK(clk),
-		.WCLKE(we_1),
-		.WE(1'b1)
-	);
+				.WRITE_MODE(0),
+				.READ_MODE(0)
+			) ebr_I (
+				.RDATA(dout_bank_2[16*i+:16]),
+				.RADDR({3'b000, addr_1[7:0]}),
+				.RCLK(clk),
+				.RCLKE(1'b1),
+				.RE(1'b1),
+				.WDATA(din_1),
+				.WADDR({3'b000, addr_1[7:0]}),
+				.MASK(16'h0000),
+				.WCLK(clk),
+				.WCLKE(we_1 & (addr_1[9:8] == i)),
+				.WE(1'b1)
+			);
+
+		end
+	endgenerate
+
+	// Read mux (missing banks read as zero)
+	assign dout_2 = dout_bank_2 >> { bank_2, 4'h0 };
 
 endmodule // usb_ep_status
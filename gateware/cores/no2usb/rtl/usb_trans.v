@@ -10,7 +10,8 @@
 `default_nettype none
 
 module usb_trans #(
-	parameter integer ADDR_MATCH = 1
+	parameter integer ADDR_MATCH = 1,
+	parameter integer BD_RING = 0
 )(
 	// TX Packet interface
 	output wire txpkt_start,
@@ -53,7 +54,7 @@ module usb_trans #(
 	output wire eps_read_0,
 	output wire eps_zero_0,
 	output wire eps_write_0,
-	output wire [ 7:0] eps_addr_0,
+	output wire [ 9:0] eps_addr_0,
 	output wire [15:0] eps_wrdata_0,
 	input  wire [15:0] eps_rddata_3,
 
@@ -115,14 +116,34 @@ module usb_trans #(
 	reg        trans_cel;
 
 	reg  [2:0] ep_type;
+	reg        ep_xfer;
+	reg  [6:0] ep_mps;
 	reg        ep_bd_dual;
 	reg        ep_bd_ctrl;
-	reg        ep_bd_idx_cur;
-	reg        ep_bd_idx_nxt;
+	reg        ep_bd_ring;
+	wire       ep_bd_setup;
+	reg  [2:0] ep_bd_idx_cur;
+	reg  [2:0] ep_bd_idx_nxt;
+	wire       eps_rd_ring;
 	reg        ep_data_toggle;
 
+	localparam [2:0] BD_RING_MSK = BD_RING - 1;
+
 	reg  [2:0] bd_state;
 
+	// Transfer mode BDs
+	wire       bd_xfer_mode;
+	reg  [9:0] bd_rem;
+	reg [10:0] bd_ptr;
+	reg        bd_zlp;
+	reg        bd_adv;
+
+	wire [9:0] bd_pkt_max;
+	wire [9:0] bd_pkt_len;
+	wire [9:0] bd_rem_nxt;
+	wire [10:0] bd_ptr_nxt;
+	wire       bd_more;
+
 	// EP & BD Infos fetch/writeback
 	localparam
 		EPFW_IDLE		= 4'b0000,
@@ -130,7 +151,8 @@ module usb_trans #(
 		EPFW_RD_BD_W0	= 4'b0110,
 		EPFW_RD_BD_W1	= 4'b0111,
 		EPFW_WR_STATUS	= 4'b1000,
-		EPFW_WR_BD_W0	= 4'b1010;
+		EPFW_WR_BD_W0	= 4'b1010,
+		EPFW_WR_BD_W1	= 4'b1011;
 
 	reg  [3:0] epfw_state;
 	reg  [5:0] epfw_cap_dl;
@@ -212,8 +234,8 @@ module usb_trans #(
 			casez (mc_opcode[2:1])
 				2'b00:   mc_a_reg <= evt;
 				2'b01:   mc_a_reg <= pkt_pid ^ { ep_data_toggle & mc_opcode[0], 3'b000 };
-				2'b10:   mc_a_reg <= { trans_cel, ep_type };
-				2'b11:   mc_a_reg <= { 1'b0, bd_state };
+				2'b10:   mc_a_reg <= { mc_opcode[0] ? bd_xfer_mode : trans_cel, ep_type };
+				2'b11:   mc_a_reg <= { mc_opcode[0] & bd_more, bd_state };
 				default: mc_a_reg <= 4'hx;
 			endcase
 
@@ -270,7 +292,7 @@ module usb_trans #(
 		trans_endp,     // [ 7:4] Endpoint
 		trans_dir,      //    [3] Direction
 		trans_is_setup, //    [2] SETUP transaction
-		ep_bd_idx_cur,  //    [1] BD where it happenned
+		ep_bd_idx_cur[0], //  [1] BD where it happenned
 		1'b0
 	};
 
@@ -318,28 +340,47 @@ module usb_trans #(
 					epfw_state <= EPFW_WR_BD_W0;
 
 				EPFW_WR_BD_W0:
+					epfw_state <= bd_adv ? EPFW_WR_BD_W1 : EPFW_IDLE;
+
+				EPFW_WR_BD_W1:
 					epfw_state <= EPFW_IDLE;
 
 				default:
 					epfw_state <= EPFW_IDLE;
 			endcase
 
+		// In control double buffered mode, SETUP uses a third BD
+		// (in the words following the EP status)
+	assign ep_bd_setup = ep_bd_ctrl & ep_bd_dual & trans_is_setup;
+
 		// Issue command to RAM
 	assign eps_zero_0  = 1'b0;
 	assign eps_read_0  = epfw_state[2];
 	assign eps_write_0 = epfw_state[3];
 
-	assign eps_addr_0  = {
+		// In ring mode, BDs live in the extra banks, 4 per bank
+	assign eps_addr_0  = (epfw_state[1] & ep_bd_ring) ? {
+		ep_bd_idx_cur[2],
+		~ep_bd_idx_cur[2],
 		trans_endp,
 		trans_dir,
-		epfw_state[1],
-		epfw_state[1] & ep_bd_idx_cur,
+		ep_bd_idx_cur[1:0],
+		epfw_state[0]
+	} : {
+		2'b00,
+		trans_endp,
+		trans_dir,
+		epfw_state[1] & ~ep_bd_setup,
+		epfw_state[1] & (ep_bd_idx_cur[0] | ep_bd_setup),
 		epfw_state[0]
 	};
 
-	assign eps_wrdata_0 = epfw_state[1] ?
-		{ bd_state, trans_is_setup, 2'b00, xfer_length[9:0] } :
-		{ 8'h00, ep_data_toggle, ep_bd_idx_nxt, ep_bd_ctrl, ep_bd_dual, 1'b0, ep_type };
+	assign eps_wrdata_0 = epfw_state[1] ? (
+			epfw_state[0] ?
+			{ bd_zlp & |bd_rem_nxt, 4'b0000, bd_ptr_nxt } :
+			{ bd_state, trans_is_setup, 2'b00, bd_xfer_mode ? (bd_adv ? bd_rem_nxt : bd_rem) : xfer_length[9:0] }
+		) :
+		{ ep_xfer, ep_mps, ep_data_toggle, ep_bd_ring ? ep_bd_idx_nxt : { ep_bd_idx_nxt[0], ep_bd_ctrl, ep_bd_dual }, ep_bd_ring, ep_type };
 
 		// Delay line for what to expect on read data
 	always @(posedge clk or posedge rst)
@@ -352,35 +393,74 @@ module usb_trans #(
 				epfw_cap_dl[5:2]
 			};
 
+		// Ring mode is ignored if the core has no ring BDs
+	assign eps_rd_ring = (BD_RING != 0) & eps_rddata_3[3];
+
 		// Capture read data
 	always @(posedge clk)
 	begin
 		// EP Status
 		if (epfw_cap_dl[1:0] == 2'b01) begin
 			ep_type        <= eps_rddata_3[2:0];
-			ep_bd_dual     <= eps_rddata_3[4];
-			ep_bd_ctrl     <= eps_rddata_3[5];
-			ep_bd_idx_cur  <= eps_rddata_3[5] ? trans_is_setup : eps_rddata_3[6];
-			ep_bd_idx_nxt  <= eps_rddata_3[6];
+			ep_xfer        <= eps_rddata_3[15];
+			ep_mps         <= eps_rddata_3[14:8];
+			ep_bd_ring     <= eps_rd_ring;
+			ep_bd_dual     <= eps_rddata_3[4] & ~eps_rd_ring;
+			ep_bd_ctrl     <= eps_rddata_3[5] & ~eps_rd_ring;
+			ep_bd_idx_cur  <= eps_rd_ring ? eps_rddata_3[6:4] : { 2'b00, (eps_rddata_3[5] & ~eps_rddata_3[4]) ? trans_is_setup : eps_rddata_3[6] };
+			ep_bd_idx_nxt  <= eps_rd_ring ? eps_rddata_3[6:4] : { 2'b00, eps_rddata_3[6] };
 			ep_data_toggle <= eps_rddata_3[7] & ~trans_is_setup; /* For SETUP, DT == 0 */
 		end else begin
 			ep_data_toggle <= ep_data_toggle ^ (mc_op_ep & mc_opcode[0]);
-			ep_bd_idx_nxt  <= ep_bd_idx_nxt  ^ (mc_op_ep & mc_opcode[1] & ep_bd_dual );
+			if (mc_op_ep & mc_opcode[1])
+				ep_bd_idx_nxt <= ep_bd_ring ?
+					((ep_bd_idx_nxt + 3'd1) & BD_RING_MSK) :
+					(ep_bd_idx_nxt ^ { 2'b00, ep_bd_dual & ~ep_bd_setup });
 		end
 
 		// BD Word 0
 		if (epfw_cap_dl[1:0] == 2'b10) begin
 			bd_state <= eps_rddata_3[15:13];
+			bd_rem   <= eps_rddata_3[9:0];
 		end else begin
 			bd_state <= (mc_op_ep & mc_opcode[2]) ? mc_opcode[5:3]: bd_state;
 		end
+
+		// BD Word 1
+		if (epfw_cap_dl[1:0] == 2'b11) begin
+			bd_ptr   <= eps_rddata_3[10:0];
+			bd_zlp   <= eps_rddata_3[15];
+		end
 	end
 
+		// Does the write back advance a transfer mode BD ?
+	always @(posedge clk)
+		if (mc_op_ep)
+			bd_adv <= mc_opcode[9] & bd_xfer_mode;
+
 		// When do to write backs
 	always @(posedge clk)
 		epfw_issue_wb <= mc_op_ep & mc_opcode[7];
 
 
+	// Transfer mode BDs
+	// -----------------
+
+	// Only for Bulk/Control/Interrupt data, never for SETUP
+	assign bd_xfer_mode = ep_xfer & |ep_type[2:1] & ~trans_is_setup;
+
+	// Packet length : IN sends up to MPS, OUT got whatever the host
+	// sent (minus CRC), both limited to what's left in the BD
+	assign bd_pkt_max = trans_dir ? { 3'b000, ep_mps } : (xfer_length - 10'd2);
+	assign bd_pkt_len = (bd_pkt_max > bd_rem) ? bd_rem : bd_pkt_max;
+
+	assign bd_rem_nxt = bd_rem - bd_pkt_len;
+	assign bd_ptr_nxt = bd_ptr + { 1'b0, bd_pkt_len };
+
+	// Full packet and something left (or a ZLP to send) -> keep going
+	assign bd_more = bd_xfer_mode & (bd_pkt_len == { 3'b000, ep_mps }) & (|bd_rem_nxt | (trans_dir & bd_zlp));
+
+
 	// Control Endpoint Lockout
 	// ------------------------
 
@@ -404,7 +484,7 @@ module usb_trans #(
 		txpkt_start_i <= mc_op_tx;
 
 	assign txpkt_start = txpkt_start_i;
-	assign txpkt_len = bd_length[9:0];
+	assign txpkt_len = (bd_xfer_mode & (bd_length[9:0] > { 3'b000, ep_mps })) ? { 3'b000, ep_mps } : bd_length[9:0];
 
 
 	// Data Address/Length shared logic
@@ -23,17 +23,20 @@ def LD(src):
 		'pkt_pid': 2,
 		'pkt_pid_chk': 3,
 		'ep_type': 4,
+		'ep_xfer': 5,
 		'bd_state': 6,
+		'bd_xfer': 7,
 	}
 	return 0x1000 | srcs[src]
 
-def EP(bd_state=None, bdi_flip=False, dt_flip=False, wb=False, cel_set=False):
+def EP(bd_state=None, bdi_flip=False, dt_flip=False, wb=False, cel_set=False, xfer_adv=False):
 	return 0x2000 | \
 		((1 << 0) if dt_flip else 0) | \
 		((1 << 1) if bdi_flip else 0) | \
 		(((bd_state << 3) | (1 << 2)) if bd_state is not None else 0) | \
 		((1 << 7) if wb else 0) | \
-		((1 << 8) if cel_set else 0)
+		((1 << 8) if cel_set else 0) | \
+		((1 << 9) if xfer_adv else 0)
 
 def ZL():
 	return 0x3000
@@ -147,7 +150,8 @@ EP_TYPE_CTRL  = 0b0110
 EP_TYPE_MSK1  = 0b0111
 EP_TYPE_MSK2  = 0b0110
 EP_TYPE_HALT  = 0b0001
-EP_TYPE_CEL   = 0b1000
+EP_TYPE_CEL   = 0b1000	# With LD('ep_type')
+EP_TYPE_XFER  = 0b1000	# With LD('ep_xfer')
 
 BD_NONE      = 0b000
 BD_RDY_DATA  = 0b010
@@ -156,6 +160,8 @@ BD_RDY_MSK   = 0b110
 BD_RDY_VAL   = 0b010
 BD_DONE_OK   = 0b100
 BD_DONE_ERR  = 0b101
+BD_STATE_MSK = 0b111
+BD_XFER_MORE = 0b1000	# With LD('bd_xfer')
 
 NOTIFY_SUCCESS = 0x00
 NOTIFY_TX_FAIL = 0x08
@@ -241,11 +247,18 @@ ENDIF(),
 		LD('pkt_pid'),
 		JNE('_DO_IN_BCI_FAIL', PID_ACK),
 
-		# Success !
-		EP(bd_state=BD_DONE_OK, bdi_flip=True, dt_flip=True, wb=True),
+		# Success ! (in transfer mode, only if that was the last packet)
+		LD('bd_xfer'),
+		JEQ('_DO_IN_BCI_MORE', BD_XFER_MORE, BD_XFER_MORE),
+		EP(bd_state=BD_DONE_OK, bdi_flip=True, dt_flip=True, wb=True, xfer_adv=True),
 		NOTIFY(NOTIFY_SUCCESS),
 		JMP('IDLE'),
 
+		# Transfer mode: BD advanced and still ready, no notification
+	L('_DO_IN_BCI_MORE'),
+		EP(bd_state=BD_RDY_DATA, dt_flip=True, wb=True, xfer_adv=True),
+		JMP('IDLE'),
+
 		# TX Fail handler, notify the host
 	L('_DO_IN_BCI_FAIL'),
 		NOTIFY(NOTIFY_TX_FAIL),
@@ -371,17 +384,25 @@ ENDIF(),
 		JEQ('TX_ACK', PID_DATA1),								# With pid_chk, DATA1 means wrong DT
 
 			# We didn't have space -> NAK
-		LD('bd_state'),
+		LD('bd_xfer'),
 		JNE('TX_NAK', BD_RDY_VAL, BD_RDY_MSK),
 
 			# Explicitely asked for stall ?
-		JEQ('TX_STALL_BD', BD_RDY_STALL),
+		JEQ('TX_STALL_BD', BD_RDY_STALL, BD_STATE_MSK),
+
+			# Transfer mode and more packets to go ?
+		JEQ('_DO_OUT_BCI_MORE', BD_XFER_MORE, BD_XFER_MORE),
 
 		# We're all good !
-		EP(bd_state=BD_DONE_OK, bdi_flip=True, dt_flip=True, wb=True),
+		EP(bd_state=BD_DONE_OK, bdi_flip=True, dt_flip=True, wb=True, xfer_adv=True),
 		NOTIFY(NOTIFY_SUCCESS),
 		JMP('TX_ACK'),
 
+		# Transfer mode: BD advanced and still ready, no notification
+	L('_DO_OUT_BCI_MORE'),
+		EP(bd_state=BD_RDY_DATA, dt_flip=True, wb=True, xfer_adv=True),
+		JMP('TX_ACK'),
+
 		# Fail handler: Prepare to drop data
 	L('_DO_OUT_BCI_DROP_DATA'),
 		ZL(),
@@ -394,6 +415,10 @@ IFNDEF('IGNORE_RX_ERR'),
 		LD('bd_state'),
 		JNE('IDLE', BD_RDY_VAL, BD_RDY_MSK),
 
+			# In transfer mode, keep the BD going, host will retry
+		LD('ep_xfer'),
+		JEQ('IDLE', EP_TYPE_XFER, EP_TYPE_XFER),
+
 			# We had a BD, so report the error
 		EP(bd_state=BD_DONE_ERR, bdi_flip=True, dt_flip=False, wb=True),
 		NOTIFY(NOTIFY_RX_FAIL),
@@ -16,6 +16,7 @@
 `elsif BOARD_ICEBREAKER
 	// 1bitsquared iCEbreaker
 	`define HAS_RGB
+	`define HAS_QSPI
 
 `elsif BOARD_TT_UM_BCD7SEG
 // FOMU PVT1 (prod version)
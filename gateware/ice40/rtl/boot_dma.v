@@ -0,0 +1,128 @@
+/*
+ * boot_dma.v
+ *
+ * vim: ts=4 sw=4
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: CERN-OHL-P-2.0
+ */
+
+`default_nettype none
+
+// Copies words from the SPI master RX FIFO to SPRAM. Software sets up
+// the flash read command itself, then starts this to drain the data at
+// full SPI speed. While busy, this owns the SPI wishbone port and the
+// SPRAM port (see top.v), so software must wait on the busy bit and
+// must not access SPRAM in the mean time.
+//
+// Registers :
+//  0x00 (W) : Destination, as a CPU address in SPRAM (bits [16:2] used)
+//  0x04 (W) : Number of words minus 1 (bits [15:0]), starts the copy
+//  0x00 (R) : [31] Busy
+//  0x04 (R) : Sum of the words copied (modulo 2^32), to check images
+//
+// Writes while busy are ignored.
+
+module boot_dma (
+	// Wishbone slave (control)
+	input  wire  [0:0] wb_addr,
+	output reg  [31:0] wb_rdata,
+	input  wire [31:0] wb_wdata,
+	input  wire        wb_we,
+	input  wire        wb_cyc,
+	output reg         wb_ack,
+
+	// Wishbone master (SPI master data register)
+	output wire  [1:0] spi_addr,
+	input  wire [31:0] spi_rdata,
+	output reg         spi_cyc,
+	input  wire        spi_ack,
+
+	// SPRAM write port
+	output reg  [14:0] ram_addr,
+	output wire [31:0] ram_wdata,
+	output wire        ram_we,
+
+	// Status
+	output reg         busy,
+
+	// Clock / Reset
+	input  wire clk,
+	input  wire rst
+);
+
+	// Signals
+	// -------
+
+	wire        bus_wr_addr;
+	wire        bus_wr_len;
+
+	reg  [15:0] cnt;
+	reg  [31:0] sum;
+	wire        xfer;
+
+
+	// Bus interface
+	// -------------
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			wb_ack <= 1'b0;
+		else
+			wb_ack <= wb_cyc & ~wb_ack;
+
+	always @(posedge clk)
+		if (wb_ack | wb_we | ~wb_cyc)
+			wb_rdata <= 32'h00000000;
+		else
+			wb_rdata <= wb_addr[0] ? sum : { busy, 31'h00000000 };
+
+	assign bus_wr_addr = wb_ack & wb_we & ~wb_addr[0] & ~busy;
+	assign bus_wr_len  = wb_ack & wb_we &  wb_addr[0] & ~busy;
+
+
+	// Copy
+	// ----
+
+	// One read of the data register at a time, it waits for RX data
+	assign spi_addr = 2'b10;
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			spi_cyc <= 1'b0;
+		else
+			spi_cyc <= spi_cyc ? ~spi_ack : busy;
+
+	assign xfer = spi_cyc & spi_ack;
+
+	// Each word read is written right away
+	assign ram_wdata = spi_rdata;
+	assign ram_we    = xfer;
+
+	always @(posedge clk)
+		if (bus_wr_addr)
+			ram_addr <= wb_wdata[16:2];
+		else if (xfer)
+			ram_addr <= ram_addr + 1;
+
+	// Word counter
+	always @(posedge clk)
+		if (bus_wr_len)
+			cnt <= wb_wdata[15:0];
+		else if (xfer)
+			cnt <= cnt - 1;
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			busy <= 1'b0;
+		else
+			busy <= (busy & ~(xfer & (cnt == 16'h0000))) | bus_wr_len;
+
+	// Checksum
+	always @(posedge clk)
+		if (bus_wr_len)
+			sum <= 32'h00000000;
+		else if (xfer)
+			sum <= sum + spi_rdata;
+
+endmodule // boot_dma
@@ -10,6 +10,10 @@
 `default_nettype none
 `include "boards.vh"
 
+`ifndef USB_BD_RING
+`define USB_BD_RING 0
+`endif
+
 module top (
 	// Special features
 `ifdef MISC_SEL
@@ -46,16 +50,24 @@ module top (
 	// SPI
 	inout  wire spi_mosi,
 	inout  wire spi_miso,
+`ifdef HAS_QSPI
+	inout  wire spi_io2,
+	inout  wire spi_io3,
+`endif
 	inout  wire spi_clk,
 	inout  wire spi_cs_n
 );
 
-	localparam WB_N  =  6;
+	localparam WB_N  =  8;
 	localparam WB_DW = 32;
-	localparam WB_AW = 16;
+	localparam WB_AW = 22;
 	localparam WB_AI =  2;
 
-	localparam SPRAM_AW = 14; /* 14 => 64k, 15 => 128k */
+`ifdef SPRAM128K
+	localparam SPRAM_AW = 15; /* 14 => 64k, 15 => 128k */
+`else
+	localparam SPRAM_AW = 14;
+`endif
 
 	genvar i;
 
@@ -87,6 +99,11 @@ module top (
 	wire [ 3:0] spram_wmsk;
 	wire        spram_we;
 
+	wire [14:0] spram_m_addr;
+	wire [31:0] spram_m_wdata;
+	wire [ 3:0] spram_m_wmsk;
+	wire        spram_m_we;
+
 	// Wishbone
 	wire [ WB_AW   -1:0] wb_addr;
 	wire [ WB_DW-1   :0] wb_rdata [0:WB_N-1];
@@ -98,6 +115,35 @@ module top (
 
 	wire [(WB_DW*WB_N)-1:0] wb_rdata_flat;
 
+	// SPI
+	wire  [3:0] sio_io_o;
+	wire  [3:0] sio_io_oe;
+	wire  [3:0] sio_io_i;
+	wire        sio_clk;
+	wire        sio_csn;
+
+	wire  [1:0] spi_wb_addr;
+	wire [31:0] spi_wb_rdata;
+	wire [31:0] spi_wb_wdata;
+	wire        spi_wb_we;
+	wire        spi_wb_cyc;
+	wire        spi_wb_ack;
+
+	// Boot DMA
+	wire  [1:0] dma_spi_addr;
+	wire        dma_spi_cyc;
+	wire [14:0] dma_ram_addr;
+	wire [31:0] dma_ram_wdata;
+	wire        dma_ram_we;
+	wire        dma_busy;
+
+	// XIP
+	wire  [1:0] xip_spi_addr;
+	wire [31:0] xip_spi_wdata;
+	wire        xip_spi_we;
+	wire        xip_spi_cyc;
+	wire        xip_busy;
+
 	// USB Core
 		// EP Buffer
 	wire [ 8:0] ep_tx_addr_0;
@@ -213,14 +259,20 @@ module top (
 	soc_spram #(
 		.AW(SPRAM_AW)
 	) spram_I (
-		.addr  (spram_addr[SPRAM_AW-1:0]),
+		.addr  (spram_m_addr[SPRAM_AW-1:0]),
 		.rdata (spram_rdata),
-		.wdata (spram_wdata),
-		.wmsk  (spram_wmsk),
-		.we    (spram_we),
+		.wdata (spram_m_wdata),
+		.wmsk  (spram_m_wmsk),
+		.we    (spram_m_we),
 		.clk   (clk_24m)
 	);
 
+	// Boot DMA owns the write port while busy
+	assign spram_m_addr  = dma_busy ? dma_ram_addr  : spram_addr;
+	assign spram_m_wdata = dma_busy ? dma_ram_wdata : spram_wdata;
+	assign spram_m_wmsk  = dma_busy ? 4'b0000       : spram_wmsk;
+	assign spram_m_we    = dma_busy ? dma_ram_we    : spram_we;
+
 
 	// Misc [0]
 	// ----
@@ -307,25 +359,72 @@ module top (
 	// SPI [2]
 	// ---
 
-	ice40_spi_wb #(
+	spi_master_wb #(
 		.N_CS(1),
-		.WITH_IOB(1),
-		.UNIT(0)
+		.FIFO_DEPTH(256),
+`ifdef HAS_QSPI
+		.QUAD_IO(1)
+`else
+		.QUAD_IO(0)
+`endif
 	) spi_I (
-		.pad_mosi (spi_mosi),
-		.pad_miso (spi_miso),
-		.pad_clk  (spi_clk),
-		.pad_csn  (spi_cs_n),
-		.wb_addr  (wb_addr[3:0]),
-		.wb_rdata (wb_rdata[2]),
-		.wb_wdata (wb_wdata),
-		.wb_we    (wb_we),
-		.wb_cyc   (wb_cyc[2]),
-		.wb_ack   (wb_ack[2]),
-		.clk      (clk_24m),
-		.rst      (rst)
+		.spi_io_o  (sio_io_o),
+		.spi_io_oe (sio_io_oe),
+		.spi_io_i  (sio_io_i),
+		.spi_clk   (sio_clk),
+		.spi_csn   (sio_csn),
+		.wb_addr   (spi_wb_addr),
+		.wb_rdata  (spi_wb_rdata),
+		.wb_wdata  (spi_wb_wdata),
+		.wb_we     (spi_wb_we),
+		.wb_cyc    (spi_wb_cyc),
+		.wb_ack    (spi_wb_ack),
+		.clk       (clk_24m),
+		.rst       (rst)
+	);
+
+	// Boot DMA / XIP own the bus interface while busy, CPU accesses wait
+	assign spi_wb_addr  = dma_busy ? dma_spi_addr : (xip_busy ? xip_spi_addr  : wb_addr[1:0]);
+	assign spi_wb_wdata = xip_busy ? xip_spi_wdata : wb_wdata;
+	assign spi_wb_we    = dma_busy ? 1'b0         : (xip_busy ? xip_spi_we    : wb_we);
+	assign spi_wb_cyc   = dma_busy ? dma_spi_cyc  : (xip_busy ? xip_spi_cyc   : wb_cyc[2]);
+
+	assign wb_rdata[2] = (dma_busy | xip_busy) ? 32'h00000000 : spi_wb_rdata;
+	assign wb_ack[2]   = (dma_busy | xip_busy) ? 1'b0         : spi_wb_ack;
+
+	SB_IO #(
+		.PIN_TYPE(6'b011001),
+		.PULLUP(1'b1)
+	) spi_out_I[1:0] (
+		.PACKAGE_PIN ({spi_clk, spi_cs_n}),
+		.D_OUT_0     ({sio_clk, sio_csn })
 	);
 
+	// IO0 / IO1 are bidirectional for dual reads
+	SB_IO #(
+		.PIN_TYPE(6'b101001),
+		.PULLUP(1'b1)
+	) spi_io_I[1:0] (
+		.PACKAGE_PIN   ({spi_miso,     spi_mosi    }),
+		.OUTPUT_ENABLE ({sio_io_oe[1], sio_io_oe[0]}),
+		.D_OUT_0       ({sio_io_o[1],  sio_io_o[0] }),
+		.D_IN_0        ({sio_io_i[1],  sio_io_i[0] })
+	);
+
+`ifdef HAS_QSPI
+	SB_IO #(
+		.PIN_TYPE(6'b101001),
+		.PULLUP(1'b1)
+	) spi_io_hi_I[1:0] (
+		.PACKAGE_PIN   ({spi_io3,      spi_io2     }),
+		.OUTPUT_ENABLE ({sio_io_oe[3], sio_io_oe[2]}),
+		.D_OUT_0       ({sio_io_o[3],  sio_io_o[2] }),
+		.D_IN_0        ({sio_io_i[3],  sio_io_i[2] })
+	);
+`else
+	assign sio_io_i[3:2] = 2'b11;
+`endif
+
 
 	// RGB LEDs [3]
 	// --------
@@ -362,7 +461,8 @@ module top (
 
 	// Core
 	usb #(
-		.EPDW(32)
+		.EPDW(32),
+		.BD_RING(`USB_BD_RING)
 	) usb_I (
 		.pad_dp       (usb_dp),
 		.pad_dn       (usb_dn),
@@ -430,6 +530,54 @@ module top (
 	);
 
 
+	// Boot DMA [6]
+	// --------
+
+	boot_dma dma_I (
+		.wb_addr   (wb_addr[0]),
+		.wb_rdata  (wb_rdata[6]),
+		.wb_wdata  (wb_wdata),
+		.wb_we     (wb_we),
+		.wb_cyc    (wb_cyc[6]),
+		.wb_ack    (wb_ack[6]),
+		.spi_addr  (dma_spi_addr),
+		.spi_rdata (spi_wb_rdata),
+		.spi_cyc   (dma_spi_cyc),
+		.spi_ack   (spi_wb_ack),
+		.ram_addr  (dma_ram_addr),
+		.ram_wdata (dma_ram_wdata),
+		.ram_we    (dma_ram_we),
+		.busy      (dma_busy),
+		.clk       (clk_24m),
+		.rst       (rst)
+	);
+
+
+	// XIP [7]
+	// ---
+
+	xip_cache #(
+		.LINE_WORDS(8),
+		.LINES(64)
+	) xip_I (
+		.wb_addr   (wb_addr[21:0]),
+		.wb_rdata  (wb_rdata[7]),
+		.wb_wdata  (wb_wdata),
+		.wb_we     (wb_we),
+		.wb_cyc    (wb_cyc[7]),
+		.wb_ack    (wb_ack[7]),
+		.spi_addr  (xip_spi_addr),
+		.spi_rdata (spi_wb_rdata),
+		.spi_wdata (xip_spi_wdata),
+		.spi_we    (xip_spi_we),
+		.spi_cyc   (xip_spi_cyc),
+		.spi_ack   (spi_wb_ack),
+		.busy      (xip_busy),
+		.clk       (clk_24m),
+		.rst       (rst)
+	);
+
+
 	// Special Features
 	// ----------------
 
@@ -0,0 +1,359 @@
+/*
+ * xip_cache.v
+ *
+ * vim: ts=4 sw=4
+ *
+ * Copyright (C) 2026  agent <agent@local>
+ * SPDX-License-Identifier: CERN-OHL-P-2.0
+ */
+
+`default_nettype none
+
+// Execute-in-place from SPI flash, through a direct mapped read cache.
+//
+// The lower half of the wishbone window maps the first 8 MB of flash
+// (read only, writes are ignored). Misses fill a whole line by issuing
+// a read through the SPI master bus interface (see top.v), using the
+// clock divider software configured there. This means software must not
+// keep the flash selected, or have it busy (program / erase), while code
+// or data from this window is accessed. Fills do wait for a running
+// flash sequencer operation to be over though, so code issuing one
+// from this window just stalls until it's done.
+//
+// The opcode and address are always sent x1, so Fast Read (0x0b) and the
+// Dual / Quad Output Reads (0x3b / 0x6b) can be used, but not 0xeb.
+//
+// Registers (upper half of the window) :
+//  0x00 (RW) : Configuration
+//              [31]    Flush (write only, invalidates all lines)
+//              [15:12] Dummy bytes, in the data lines width
+//              [ 9: 8] Data lines width (0=x1, 1=x2, 2=x4)
+//              [ 7: 0] Read opcode
+//  0x04 (R)  : Hit counter (any write clears)
+//  0x08 (R)  : Miss counter (any write clears)
+
+module xip_cache #(
+	parameter integer LINE_WORDS = 8,
+	parameter integer LINES = 64,
+
+	// auto
+	parameter integer OW = $clog2(LINE_WORDS),
+	parameter integer IW = $clog2(LINES),
+	parameter integer TW = 21 - OW - IW
+)(
+	// Wishbone slave
+	input  wire [21:0] wb_addr,
+	output wire [31:0] wb_rdata,
+	input  wire [31:0] wb_wdata,
+	input  wire        wb_we,
+	input  wire        wb_cyc,
+	output wire        wb_ack,
+
+	// Wishbone master (SPI master)
+	output reg   [1:0] spi_addr,
+	input  wire [31:0] spi_rdata,
+	output reg  [31:0] spi_wdata,
+	output reg         spi_we,
+	output reg         spi_cyc,
+	input  wire        spi_ack,
+
+	// Status (owns the SPI master bus interface)
+	output wire        busy,
+
+	// Clock / Reset
+	input  wire clk,
+	input  wire rst
+);
+
+	localparam [1:0]
+		ST_IDLE   = 0,
+		ST_LOOKUP = 1,
+		ST_FILL   = 2;
+
+	localparam [3:0]
+		FS_SEQ_RD  = 0,
+		FS_CSR_RD  = 1,
+		FS_CSR_CS  = 2,
+		FS_CMD_TX  = 3,
+		FS_DATA    = 4,
+		FS_CMD_DUM = 5,
+		FS_CMD_RX  = 6,
+		FS_RX      = 7,
+		FS_CSR_REL = 8;
+
+	localparam [15:0] RX_LEN = (4 * LINE_WORDS) - 1;
+
+
+	// Signals
+	// -------
+
+	// Bus
+	wire          is_ctrl;
+	reg           bus_ack;
+	reg    [31:0] bus_rdata;
+
+	// Config / Stats
+	reg     [7:0] cfg_op;
+	reg     [1:0] cfg_w;
+	reg     [3:0] cfg_dummy;
+
+	reg    [31:0] cnt_hit;
+	reg    [31:0] cnt_miss;
+
+	// Cache
+	reg    [31:0] data_mem [0:(LINES*LINE_WORDS)-1];
+	reg    [31:0] data_rdata;
+
+	reg  [TW-1:0] tag_mem [0:LINES-1];
+	reg  [TW-1:0] tag_rdata;
+
+	reg [LINES-1:0] valid;
+
+	wire [OW-1:0] req_ofs;
+	wire [IW-1:0] req_idx;
+	wire [TW-1:0] req_tag;
+
+	wire          hit;
+	reg           refill;
+
+	// Control
+	reg     [1:0] state;
+
+	reg     [3:0] fs;
+	reg  [OW-1:0] fs_word;
+	wire          fs_xfer;
+	reg     [7:0] spi_div;
+
+	reg  [IW-1:0] fill_idx;
+	reg  [TW-1:0] fill_tag;
+	wire   [23:0] fill_addr;
+
+
+	// Bus interface
+	// -------------
+
+	assign is_ctrl = wb_addr[21];
+
+	// Control registers and (ignored) writes are acked here, cached
+	// reads at lookup time
+	always @(posedge clk or posedge rst)
+		if (rst)
+			bus_ack <= 1'b0;
+		else
+			bus_ack <= wb_cyc & (is_ctrl | wb_we) & ~bus_ack;
+
+	always @(posedge clk)
+		if (bus_ack | wb_we | ~wb_cyc | ~is_ctrl)
+			bus_rdata <= 32'h00000000;
+		else
+			case (wb_addr[1:0])
+				2'b00:   bus_rdata <= { 16'h0000, cfg_dummy, 2'b00, cfg_w, cfg_op };
+				2'b01:   bus_rdata <= cnt_hit;
+				2'b10:   bus_rdata <= cnt_miss;
+				default: bus_rdata <= 32'h00000000;
+			endcase
+
+	assign wb_ack   = bus_ack | ((state == ST_LOOKUP) & hit);
+	assign wb_rdata = bus_rdata | (((state == ST_LOOKUP) & hit) ? data_rdata : 32'h00000000);
+
+
+	// Configuration / Stats
+	// ---------------------
+
+	always @(posedge clk or posedge rst)
+		if (rst) begin
+			cfg_op    <= 8'h0b;
+			cfg_w     <= 2'b00;
+			cfg_dummy <= 4'd1;
+		end else if (bus_ack & wb_we & is_ctrl & (wb_addr[1:0] == 2'b00)) begin
+			cfg_op    <= wb_wdata[ 7: 0];
+			cfg_w     <= wb_wdata[ 9: 8];
+			cfg_dummy <= wb_wdata[15:12];
+		end
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			cnt_hit <= 32'h00000000;
+		else if (bus_ack & wb_we & is_ctrl & (wb_addr[1:0] == 2'b01))
+			cnt_hit <= 32'h00000000;
+		else if ((state == ST_LOOKUP) & hit & ~refill)
+			cnt_hit <= cnt_hit + 1;
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			cnt_miss <= 32'h00000000;
+		else if (bus_ack & wb_we & is_ctrl & (wb_addr[1:0] == 2'b10))
+			cnt_miss <= 32'h00000000;
+		else if ((state == ST_LOOKUP) & ~hit)
+			cnt_miss <= cnt_miss + 1;
+
+
+	// Cache
+	// -----
+
+	assign req_ofs = wb_addr[OW-1:0];
+	assign req_idx = wb_addr[OW+IW-1:OW];
+	assign req_tag = wb_addr[20:OW+IW];
+
+	// Read ports, addressed directly by the pending request
+	always @(posedge clk)
+		data_rdata <= data_mem[{req_idx, req_ofs}];
+
+	always @(posedge clk)
+		tag_rdata <= tag_mem[req_idx];
+
+	// Line fill
+	always @(posedge clk)
+		if ((state == ST_FILL) & (fs == FS_RX) & fs_xfer)
+			data_mem[{fill_idx, fs_word}] <= spi_rdata;
+
+	always @(posedge clk)
+		if ((state == ST_FILL) & (fs == FS_CSR_REL) & fs_xfer)
+			tag_mem[fill_idx] <= fill_tag;
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			valid <= 0;
+		else if (bus_ack & wb_we & is_ctrl & (wb_addr[1:0] == 2'b00) & wb_wdata[31])
+			valid <= 0;
+		else if ((state == ST_FILL) & (fs == FS_CSR_REL) & fs_xfer)
+			valid[fill_idx] <= 1'b1;
+
+	assign hit = valid[req_idx] & (tag_rdata == req_tag);
+
+
+	// Control
+	// -------
+
+	always @(posedge clk or posedge rst)
+		if (rst)
+			state <= ST_IDLE;
+		else
+			case (state)
+				ST_IDLE:
+					if (wb_cyc & ~wb_we & ~is_ctrl)
+						state <= ST_LOOKUP;
+
+				ST_LOOKUP:
+					state <= hit ? ST_IDLE : ST_FILL;
+
+				ST_FILL:
+					if ((fs == FS_CSR_REL) & fs_xfer)
+						state <= ST_IDLE;
+
+				default:
+					state <= ST_IDLE;
+			endcase
+
+	// The access following a fill is a hit, but not a real one
+	always @(posedge clk or posedge rst)
+		if (rst)
+			refill <= 1'b0;
+		else if (state == ST_FILL)
+			refill <= 1'b1;
+		else if (state == ST_LOOKUP)
+			refill <= 1'b0;
+
+	always @(posedge clk)
+		if (state == ST_LOOKUP) begin
+			fill_idx <= req_idx;
+			fill_tag <= req_tag;
+		end
+
+	assign fill_addr = { 1'b0, fill_tag, fill_idx, {OW{1'b0}}, 2'b00 };
+
+	assign busy = (state == ST_FILL);
+
+
+	// Fill sequence
+	// -------------
+
+	// Each step is one access to the SPI master, with a cycle between.
+	// The sequencer status is polled first, while it runs the master
+	// drops register writes and doesn't hold data reads.
+	always @(posedge clk or posedge rst)
+		if (rst)
+			spi_cyc <= 1'b0;
+		else
+			spi_cyc <= spi_cyc ? ~spi_ack : (state == ST_FILL);
+
+	assign fs_xfer = spi_cyc & spi_ack;
+
+	always @(posedge clk)
+		if (state != ST_FILL) begin
+			fs      <= FS_SEQ_RD;
+			fs_word <= 0;
+		end else if (fs_xfer) begin
+			case (fs)
+				FS_SEQ_RD: fs <= spi_rdata[31] ? FS_SEQ_RD : FS_CSR_RD;
+				FS_DATA:   fs <= (cfg_dummy != 4'd0) ? FS_CMD_DUM : FS_CMD_RX;
+				FS_RX:     fs <= (fs_word == (LINE_WORDS - 1)) ? FS_CSR_REL : FS_RX;
+				default:   fs <= fs + 1;
+			endcase
+
+			if (fs == FS_RX)
+				fs_word <= fs_word + 1;
+		end
+
+	// Keep the clock divider software selected
+	always @(posedge clk)
+		if (fs_xfer & (fs == FS_CSR_RD))
+			spi_div <= spi_rdata[7:0];
+
+	always @(*)
+	begin
+		spi_we    = 1'b1;
+		spi_wdata = 32'h00000000;
+
+		case (fs)
+			FS_SEQ_RD: begin
+				spi_addr = 2'b11;
+				spi_we   = 1'b0;
+			end
+
+			FS_CSR_RD: begin
+				spi_addr = 2'b00;
+				spi_we   = 1'b0;
+			end
+
+			FS_CSR_CS: begin
+				spi_addr  = 2'b00;
+				spi_wdata = { 15'h0000, 1'b1, 8'h00, spi_div };
+			end
+
+			FS_CMD_TX: begin
+				spi_addr  = 2'b01;
+				spi_wdata = 32'h40000003;
+			end
+
+			FS_DATA: begin
+				spi_addr  = 2'b10;
+				spi_wdata = { fill_addr[7:0], fill_addr[15:8], fill_addr[23:16], cfg_op };
+			end
+
+			FS_CMD_DUM: begin
+				spi_addr  = 2'b01;
+				spi_wdata = { 2'b00, cfg_w, 24'h000000, cfg_dummy - 4'd1 };
+			end
+
+			FS_CMD_RX: begin
+				spi_addr  = 2'b01;
+				spi_wdata = { 2'b10, cfg_w, 12'h000, RX_LEN };
+			end
+
+			FS_RX: begin
+				spi_addr = 2'b10;
+				spi_we   = 1'b0;
+			end
+
+			FS_CSR_REL: begin
+				spi_addr  = 2'b00;
+				spi_wdata = { 24'h000000, spi_div };
+			end
+
+			default:
+				spi_addr = 2'b00;
+		endcase
+	end
+
+endmodule // xip_cache
@@ -0,0 +1,26 @@
+#!/usr/bin/env python3
+#
+# Builds a SPI flash content file for the spiflash.v model (one byte per
+# line, as read by $readmemh) from images placed at given offsets :
+#
+#   mkflash.py out.hex 0x60000:firmware.img [...]
+#
+# Copyright (C) 2026 agent <agent@local>
+# SPDX-License-Identifier: MIT
+#
+
+import sys
+
+
+def main(argv0, out_name, *images):
+	with open(out_name, 'w') as out_fh:
+		for img in images:
+			ofs, name = img.split(':', 1)
+			with open(name, 'rb') as in_fh:
+				data = in_fh.read()
+			out_fh.write('@%08x\n' % int(ofs, 0))
+			out_fh.write(''.join('%02x\n' % b for b in data))
+
+
+if __name__ == '__main__':
+	main(*sys.argv)
@@ -26,7 +26,7 @@
 // updates output signals 1ns after the SPI clock edge.
 //
 // Supported commands:
-//    AB, B9, FF, 03, BB, EB, ED
+//    AB, B9, FF, 03, 0B, 3B, 6B, 35, BB, EB, ED
 //
 // Well written SPI flash data sheets:
 //    Cypress S25FL064L http://www.cypress.com/file/316661/download
@@ -157,6 +157,29 @@ module spiflash (
 				end
 			end
 
+			if (powered_up && (spi_cmd == 'h 3b || spi_cmd == 'h 6b)) begin
+				if (bytecount == 2)
+					spi_addr[23:16] = buffer;
+
+				if (bytecount == 3)
+					spi_addr[15:8] = buffer;
+
+				if (bytecount == 4)
+					spi_addr[7:0] = buffer;
+
+				if (bytecount == 5)
+					mode = (spi_cmd == 'h 3b) ? mode_dspi_wr : mode_qspi_wr;
+
+				if (bytecount >= 5) begin
+					buffer = memory[spi_addr];
+					spi_addr = spi_addr + 1;
+				end
+			end
+
+			// SR2, with QE set
+			if (powered_up && spi_cmd == 'h 35)
+				buffer = 8'h 02;
+
 			if (powered_up && spi_cmd == 'h bb) begin
 				if (bytecount == 1)
 					mode = mode_dspi_rd;
@@ -8,6 +8,7 @@
  */
 
 `default_nettype none
+`include "boards.vh"
 
 module top_tb;
 
@@ -16,7 +17,9 @@ module top_tb;
 
 	wire spi_mosi;
 	wire spi_miso;
-	wire spi_flash_cs_n;
+	wire spi_io2;
+	wire spi_io3;
+	wire spi_cs_n;
 	wire spi_clk;
 
 	wire usb_dp;
@@ -26,32 +29,61 @@ module top_tb;
 	wire uart_rx;
 	wire uart_tx;
 
+	reg  boot_done = 1'b0;
+
 
 	// Setup recording
 	// ---------------
 
 	initial begin
-		$dumpfile("top_tb.vcd");
-		$dumpvars(0,top_tb);
-		# 2000000 $finish;
+		if (!$test$plusargs("boot")) begin
+			$dumpfile("top_tb.vcd");
+			$dumpvars(0,top_tb);
+			# 2000000 $finish;
+		end
 	end
 
 
+	// Boot time
+	// ---------
+
+	// First instruction fetch from the application (SPRAM). With +boot,
+	// simulation ends there, which allows to compare flash images.
+	always @(posedge dut_I.clk_24m)
+		if (dut_I.mem_valid & dut_I.mem_instr & dut_I.mem_addr[17] & ~boot_done) begin
+			boot_done <= 1'b1;
+			$display("Application entry at %08x after %t", dut_I.mem_addr, $time);
+			if ($test$plusargs("boot"))
+				$finish;
+		end
+
+
 	// DUT
 	// ---
 
 	top dut_I (
 		.spi_mosi(spi_mosi),
 		.spi_miso(spi_miso),
-		.spi_flash_cs_n(spi_flash_cs_n),
+`ifdef HAS_QSPI
+		.spi_io2(spi_io2),
+		.spi_io3(spi_io3),
+`endif
+		.spi_cs_n(spi_cs_n),
 		.spi_clk(spi_clk),
 		.usb_dp(usb_dp),
 		.usb_dn(usb_dn),
 		.usb_pu(usb_pu),
+`ifdef ENABLE_UART
 		.uart_rx(uart_rx),
 		.uart_tx(uart_tx),
+`endif
+`ifdef HAS_RGB
 		.rgb(),
+`endif
+		.btn(1'b1),
+`ifndef USE_HF_OSC
 		.clk_in(1'b0)
+`endif
 	);
 
 
@@ -64,13 +96,16 @@ module top_tb;
 	pullup(uart_tx);
 	pullup(uart_rx);
 
+	pullup(spi_io2);
+	pullup(spi_io3);
+
 	spiflash flash_I (
-		.csb(spi_flash_cs_n),
+		.csb(spi_cs_n),
 		.clk(spi_clk),
 		.io0(spi_mosi),
 		.io1(spi_miso),
-		.io2(),
-		.io3()
+		.io2(spi_io2),
+		.io3(spi_io3)
 	);
 
 endmodule // top_tb
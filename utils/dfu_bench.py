@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+#
+# Compares flashing time of an image downloaded raw and in the packed
+# (sparse / LZ compressed) formats using dfu-util. The selected zone
+# should not use compare mode, which would skip most of the work on
+# all but the first run.
+#
+# Copyright (C) 2026 agent <agent@local>
+# SPDX-License-Identifier: MIT
+#
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from dfu_pack import pack_sparse, pack_lz
+
+
+def dfu_download(args, filename):
+	t = time.monotonic()
+	subprocess.run([
+		args.dfu_util,
+		'-d', args.device,
+		'-a', str(args.alt),
+		'-D', filename,
+	], check=True, stdout=subprocess.DEVNULL)
+	return time.monotonic() - t
+
+
+def main(argv0, *args):
+	parser = argparse.ArgumentParser(description='Benchmark DFU payload formats')
+	parser.add_argument('-a', '--alt', type=int, default=0,
+		help='DFU alt setting, must accept LZ payloads (default: %(default)d)')
+	parser.add_argument('-d', '--device', default='1d50:6146',
+		help='USB VID:PID (default: %(default)s)')
+	parser.add_argument('-t', '--transfer-size', type=int, default=4096,
+		help='DFU transfer size (default: %(default)d)')
+	parser.add_argument('-n', '--runs', type=int, default=3,
+		help='Runs per format (default: %(default)d)')
+	parser.add_argument('--dfu-util', default='dfu-util')
+	parser.add_argument('input')
+	args = parser.parse_args(args)
+
+	with open(args.input, 'rb') as fh:
+		data = fh.read()
+
+	payloads = [
+		('raw',    data),
+		('sparse', pack_sparse(data, args.transfer_size)),
+		('lz',     pack_lz(data)),
+	]
+
+	print(f"{'Format':8s} {'Size':>8s} {'Time':>8s}")
+
+	with tempfile.TemporaryDirectory() as tmp:
+		for name, payload in payloads:
+			filename = os.path.join(tmp, name + '.bin')
+			with open(filename, 'wb') as fh:
+				fh.write(payload)
+
+			# dfu-util only returns once everything is written
+			t_tot = 0
+			for i in range(args.runs):
+				t_tot += dfu_download(args, filename)
+
+			print(f"{name:8s} {len(payload):8d} {t_tot / args.runs:7.2f}s")
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(*sys.argv) or 0)
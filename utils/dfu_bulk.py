@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+#
+# Downloads an image to a DFU zone through the bulk endpoints interface
+# of the DFU bootloader (see usb_dfu_bulk.c in no2usb), and optionally
+# checks the flash content against it.
+#
+# Copyright (C) 2026 agent <agent@local>
+# SPDX-License-Identifier: MIT
+#
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+import usb.core
+import usb.util
+
+from dfu_pack import pack_sparse, pack_lz
+
+
+class DFUBulk:
+
+	INTF_CLASS    = 0xff
+	INTF_SUBCLASS = 0xdf
+	INTF_PROTOCOL = 0x01
+
+	MAGIC = 0x42324f4e	# 'NO2B'
+
+	OP_STATUS = 0
+	OP_DNLOAD = 1
+	OP_HASH   = 2
+
+	STATUS = [
+		'OK', 'errTARGET', 'errFILE', 'errWRITE', 'errERASE',
+		'errCHECK_ERASED', 'errPROG', 'errVERIFY', 'errADDRESS',
+		'errNOTDONE', 'errFIRMWARE', 'errVENDOR', 'errUSBR',
+		'errPOR', 'errUNKNOWN', 'errSTALLEDPKT',
+	]
+
+	def __init__(self, vid=0x1d50, pid=0x6146, timeout=30000):
+
+		self.dev = usb.core.find(idVendor=vid, idProduct=pid)
+		if self.dev is None:
+			raise RuntimeError('Device not found')
+
+		self.dev.set_configuration()
+		self.timeout = timeout
+
+		intf = usb.util.find_descriptor(self.dev.get_active_configuration(),
+			bInterfaceClass    = self.INTF_CLASS,
+			bInterfaceSubClass = self.INTF_SUBCLASS,
+			bInterfaceProtocol = self.INTF_PROTOCOL,
+		)
+		if intf is None:
+			raise RuntimeError('Device has no bulk flashing interface')
+
+		self.intf = intf.bInterfaceNumber
+		usb.util.claim_interface(self.dev, self.intf)
+
+		self.ep_out = usb.util.find_descriptor(intf, custom_match =
+			lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+		self.ep_in  = usb.util.find_descriptor(intf, custom_match =
+			lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+
+	def _cmd(self, op, zone=0, length=0, payload=None):
+		self.ep_out.write(struct.pack('<4I', self.MAGIC, op, zone, length), self.timeout)
+		if payload:
+			self.ep_out.write(payload, self.timeout)
+
+		r_op, status, value, aux = struct.unpack('<4I', bytes(self.ep_in.read(16, self.timeout)))
+		if r_op != op:
+			raise RuntimeError('Unexpected response')
+		if status != 0:
+			raise RuntimeError(f'Device error: {self.STATUS[status & 15]:s}')
+
+		return value, aux
+
+	def status(self):
+		# Returns the block size and number of zones
+		return self._cmd(self.OP_STATUS)
+
+	def download(self, zone, payload):
+		# Returns the number of bytes written and flash time in ms
+		return self._cmd(self.OP_DNLOAD, zone, len(payload), payload)
+
+	def hash(self, zone, length):
+		# Returns the CRC32 of the first 'length' bytes of the zone
+		return self._cmd(self.OP_HASH, zone, length)
+
+	def detach(self):
+		# DFU_DETACH to the DFU interface reboots the device
+		try:
+			self.dev.ctrl_transfer(0x21, 0, 0, 0, None)
+		except usb.core.USBError:
+			pass
+
+
+def main(argv0, *args):
+	parser = argparse.ArgumentParser(description='Flash an image through the DFU bulk interface')
+	parser.add_argument('-d', '--device', default='1d50:6146',
+		help='USB VID:PID (default: %(default)s)')
+	parser.add_argument('-a', '--alt', type=int, default=0,
+		help='DFU zone / alt setting (default: %(default)d)')
+	parser.add_argument('-f', '--format', choices=['raw', 'sparse', 'lz'], default='raw',
+		help='Payload format, the zone must accept it (default: %(default)s)')
+	parser.add_argument('-v', '--verify', action='store_true',
+		help='Check the flash content CRC32 after download')
+	parser.add_argument('-R', '--reset', action='store_true',
+		help='Reboot the device when done')
+	parser.add_argument('input')
+	args = parser.parse_args(args)
+
+	vid, pid = [int(x, 16) for x in args.device.split(':')]
+
+	with open(args.input, 'rb') as fh:
+		data = fh.read()
+
+	dev = DFUBulk(vid, pid)
+	blk_size, n_zones = dev.status()
+
+	if args.alt >= n_zones:
+		raise RuntimeError(f'Zone {args.alt:d} not available ({n_zones:d} zones)')
+
+	if args.format == 'sparse':
+		payload = pack_sparse(data, blk_size)
+	elif args.format == 'lz':
+		payload = pack_lz(data)
+	else:
+		payload = data
+
+	t = time.monotonic()
+	n, flash_ms = dev.download(args.alt, payload)
+	t = time.monotonic() - t
+
+	print(f"{len(payload):d} bytes sent, {n:d} bytes written in {t:.3f} s " +
+	      f"({len(data) / t / 1024:.1f} kB/s, {flash_ms:d} ms in flash)", file=sys.stderr)
+
+	if args.verify:
+		crc, ms = dev.hash(args.alt, len(data))
+		if crc != zlib.crc32(data):
+			print(f"Verify failed: flash {crc:08x}, image {zlib.crc32(data):08x}", file=sys.stderr)
+			return 1
+		print(f"Verify OK ({ms:d} ms)", file=sys.stderr)
+
+	if args.reset:
+		dev.detach()
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(*sys.argv) or 0)
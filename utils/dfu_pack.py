@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# Packs a raw image into one of the DFU payload formats understood by
+# the bootloader :
+#  - sparse : blank (0xff) areas don't need to be sent
+#  - lz     : LZ compressed, decompressed on the device (only accepted
+#             on zones flagged for it)
+#
+# The result can be downloaded with any DFU tool. For the sparse format,
+# the transfer size used must match the block size given here (which
+# must be the wTransferSize of the device, 4096 unless the firmware was
+# built with a different DFU_TRANSFER_SIZE).
+#
+# Copyright (C) 2026 agent <agent@local>
+# SPDX-License-Identifier: MIT
+#
+
+import argparse
+import struct
+import sys
+
+
+PACK_MAGIC  = 0x50324f4e		# 'NO2P'
+PACK_SPARSE = 0x00000001
+PACK_LZ     = 0x00000002
+
+SPARSE_BLANK = (1 << 31)
+
+LZ_WIN       = 4096
+LZ_MIN_MATCH = 4
+LZ_MAX_CHAIN = 64
+
+PAGE_SIZE = 256
+
+
+def split_runs(data):
+	# Split image in runs of blank / non-blank pages
+	runs = []
+
+	for ofs in range(0, len(data), PAGE_SIZE):
+		page  = data[ofs:ofs+PAGE_SIZE]
+		blank = page == (b'\xff' * len(page))
+
+		if runs and (runs[-1][0] == blank):
+			runs[-1][1] += len(page)
+		else:
+			runs.append([blank, len(page), ofs])
+
+	return runs
+
+
+def pack_sparse(data, blk_size):
+	blocks = []
+	cur = bytearray(struct.pack('<II', PACK_MAGIC, PACK_SPARSE))
+
+	def room():
+		return blk_size - len(cur)
+
+	def next_block():
+		nonlocal cur
+		# Pad with an empty blank record if needed
+		if room():
+			cur += struct.pack('<I', SPARSE_BLANK)
+		blocks.append(bytes(cur))
+		cur = bytearray()
+
+	for blank, length, ofs in split_runs(data):
+		if blank:
+			if room() < 4:
+				next_block()
+			cur += struct.pack('<I', SPARSE_BLANK | length)
+			continue
+
+		while length:
+			if room() < 8:
+				next_block()
+			l = min(length, room() - 4)
+			cur += struct.pack('<I', l)
+			cur += data[ofs:ofs+l]
+			cur += bytes(-l & 3)
+			ofs    += l
+			length -= l
+
+	if len(cur):
+		blocks.append(bytes(cur))
+
+	return b''.join(blocks)
+
+
+def _lz_len(n):
+	# Extra length bytes for a nibble value >= 15
+	out = bytearray()
+	n -= 15
+	while n >= 255:
+		out.append(255)
+		n -= 255
+	out.append(n)
+	return out
+
+
+def _lz_seq(out, lit, mlen, moff):
+	ln = min(len(lit), 15)
+	mn = min(mlen - LZ_MIN_MATCH, 15) if moff else 0
+
+	out.append((ln << 4) | mn)
+	if ln == 15:
+		out += _lz_len(len(lit))
+	out += lit
+	out += struct.pack('<H', moff)
+	if moff and (mn == 15):
+		out += _lz_len(mlen - LZ_MIN_MATCH)
+
+
+def pack_lz(data):
+	# Greedy LZ77 with hash chains over the last LZ_WIN-1 bytes
+	out  = bytearray(struct.pack('<II', PACK_MAGIC, PACK_LZ))
+	head = {}
+	prev = [0] * len(data)
+	lit_start = 0
+	pos = 0
+
+	def insert(p):
+		k = data[p:p+LZ_MIN_MATCH]
+		prev[p] = head.get(k, -1)
+		head[k] = p
+
+	while pos + LZ_MIN_MATCH <= len(data):
+		best_len = 0
+		best_ofs = 0
+
+		cand  = head.get(data[pos:pos+LZ_MIN_MATCH], -1)
+		chain = LZ_MAX_CHAIN
+
+		while (cand >= 0) and ((pos - cand) < LZ_WIN) and chain:
+			l = 0
+			while (pos + l < len(data)) and (data[cand + l] == data[pos + l]):
+				l += 1
+			if l > best_len:
+				best_len = l
+				best_ofs = pos - cand
+			cand   = prev[cand]
+			chain -= 1
+
+		if best_len >= LZ_MIN_MATCH:
+			_lz_seq(out, data[lit_start:pos], best_len, best_ofs)
+			for p in range(pos, min(pos + best_len, len(data) - LZ_MIN_MATCH + 1)):
+				insert(p)
+			pos += best_len
+			lit_start = pos
+		else:
+			insert(pos)
+			pos += 1
+
+	# Remaining literals and end marker
+	_lz_seq(out, data[lit_start:], 0, 0)
+
+	return bytes(out)
+
+
+def main(argv0, *args):
+	parser = argparse.ArgumentParser(description='Pack image in sparse or compressed DFU format')
+	parser.add_argument('-f', '--format', choices=['sparse', 'lz'], default='sparse',
+		help='Payload format (default: %(default)s)')
+	parser.add_argument('-t', '--transfer-size', type=int, default=4096,
+		help='DFU transfer size (default: %(default)d)')
+	parser.add_argument('input')
+	parser.add_argument('output')
+	args = parser.parse_args(args)
+
+	if args.transfer_size & 3:
+		raise RuntimeError('Transfer size must be a multiple of 4')
+
+	with open(args.input, 'rb') as fh:
+		data = fh.read()
+
+	if args.format == 'lz':
+		packed = pack_lz(data)
+	else:
+		packed = pack_sparse(data, args.transfer_size)
+
+	with open(args.output, 'wb') as fh:
+		fh.write(packed)
+
+	print(f"{len(data):d} bytes -> {len(packed):d} bytes ({100 * len(packed) / len(data):.1f} %)", file=sys.stderr)
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(*sys.argv) or 0)
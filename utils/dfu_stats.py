@@ -0,0 +1,25 @@
+#!/usr/bin/env python3
+
+import sys
+
+from no2bootloader import NO2Bootloader
+
+
+def main(argv0):
+
+	bl = NO2Bootloader()
+	st = bl.get_stats()
+
+	print(f"Blocks written   : {st['blocks']:d} ({st['bytes']:d} bytes)")
+	print(f"Last block       : {st['blk_last_ms']:d} ms")
+	print(f"Slowest block    : {st['blk_max_ms']:d} ms")
+	print(f"Total flash time : {st['blk_total_ms']:d} ms")
+
+	if st['blocks']:
+		print(f"Average block    : {st['blk_total_ms'] / st['blocks']:.1f} ms")
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(*sys.argv) or 0)
@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import struct
 import sys
 
 import usb.core
@@ -17,7 +18,8 @@ class NO2Bootloader:
 
 		self.dev.set_configuration()
 
-		if self.get_version() != (1, 0):
+		self.version = self.get_version()
+		if self.version[0] != 1:
 			raise RuntimeError('Unknown version')
 
 	def get_version(self):
@@ -31,6 +33,22 @@ class NO2Bootloader:
 		)
 		return ( resp[0], resp[1] )
 
+	def get_stats(self):
+		if self.version < (1, 1):
+			raise RuntimeError('Statistics not supported by device')
+		resp = self.dev.ctrl_transfer(
+			0xc1,	# bmRequestType
+			3,		# bRequest,
+			0,		# wValue=0,
+			0,		# wIndex=0,
+			20,		# data_or_wLength=None,
+			None	# timeout=None,
+		)
+		return dict(zip(
+			[ 'blocks', 'bytes', 'blk_last_ms', 'blk_max_ms', 'blk_total_ms' ],
+			struct.unpack('<5I', bytes(resp))
+		))
+
 	def spi_exec(self, cmd, rlen=0):
 		# Execute command
 		buf = cmd + (b'\x00' * rlen)
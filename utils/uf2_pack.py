@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+#
+# Wraps an image in a UF2 file, for the mass storage interface of the
+# bootloader (built with MSC_UF2=1). Copying the file to the drive
+# downloads it to the DFU zone starting at the given flash address.
+#
+# The image can first be packed (see dfu_pack.py), the UF2 blocks then
+# just carry the packed payload : their target address is the zone start
+# plus the offset in that payload, not where the data ends up in flash.
+# All blocks carry 256 bytes, the payload is padded in a way that leaves
+# the flash content unchanged (0xff for raw images, empty blank records
+# for sparse payloads, ignored after the end of LZ streams).
+#
+# Copyright (C) 2026 agent <agent@local>
+# SPDX-License-Identifier: MIT
+#
+
+import argparse
+import struct
+import sys
+
+from dfu_pack import pack_sparse, pack_lz, SPARSE_BLANK
+
+
+UF2_MAGIC_START0 = 0x0a324655
+UF2_MAGIC_START1 = 0x9e5d5157
+UF2_MAGIC_END    = 0x0ab16f30
+
+UF2_FLAG_FAMILY_ID = 0x00002000
+UF2_FAMILY_ID_NO2  = 0x5d4c2f16
+
+UF2_PAYLOAD_SIZE = 256
+
+
+def pack_uf2(payload, addr):
+	n = (len(payload) + UF2_PAYLOAD_SIZE - 1) // UF2_PAYLOAD_SIZE
+	out = bytearray()
+
+	for i in range(n):
+		data = payload[i*UF2_PAYLOAD_SIZE:(i+1)*UF2_PAYLOAD_SIZE]
+		out += struct.pack('<8I',
+			UF2_MAGIC_START0, UF2_MAGIC_START1,
+			UF2_FLAG_FAMILY_ID, addr + i * UF2_PAYLOAD_SIZE,
+			UF2_PAYLOAD_SIZE, i, n, UF2_FAMILY_ID_NO2
+		)
+		out += data + bytes(476 - len(data))
+		out += struct.pack('<I', UF2_MAGIC_END)
+
+	return bytes(out)
+
+
+def main(argv0, *args):
+	parser = argparse.ArgumentParser(description='Create a UF2 file for the bootloader mass storage interface')
+	parser.add_argument('-a', '--addr', type=lambda x: int(x, 0), default=0x000a0000,
+		help='Flash address of the DFU zone (default: 0x%(default)08x, RISC-V firmware)')
+	parser.add_argument('-f', '--format', choices=['raw', 'sparse', 'lz'], default='raw',
+		help='Payload format, the zone must accept it (default: %(default)s)')
+	parser.add_argument('-t', '--transfer-size', type=int, default=4096,
+		help='DFU transfer size, for the sparse format (default: %(default)d)')
+	parser.add_argument('input')
+	parser.add_argument('output')
+	args = parser.parse_args(args)
+
+	with open(args.input, 'rb') as fh:
+		data = fh.read()
+
+	if args.format == 'sparse':
+		payload = pack_sparse(data, args.transfer_size)
+		payload += struct.pack('<I', SPARSE_BLANK) * ((-len(payload) % UF2_PAYLOAD_SIZE) // 4)
+	elif args.format == 'lz':
+		payload = pack_lz(data)
+		payload += bytes(-len(payload) % UF2_PAYLOAD_SIZE)
+	else:
+		payload = data + b'\xff' * (-len(data) % UF2_PAYLOAD_SIZE)
+
+	uf2 = pack_uf2(payload, args.addr)
+
+	with open(args.output, 'wb') as fh:
+		fh.write(uf2)
+
+	print(f"{len(data):d} bytes -> {len(uf2) // 512:d} UF2 blocks", file=sys.stderr)
+
+
+if __name__ == '__main__':
+	main(*sys.argv)